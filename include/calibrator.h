@@ -20,8 +20,17 @@
 #ifndef __CALIBRATOR_H__
 #define __CALIBRATOR_H__
 
+#include <stddef.h>
+#include "fits_handler.h"
+#include "frame_stats.h"
+#include "cosmic_rays.h"
+#include "kernels.h"
+#include "priority.h"
+
 typedef void (*logger_msg_cb) (char*, ...);
 typedef void (*done_cb) (void);
+/* called for every calibrated image HDU, calls of one file are serialized */
+typedef void (*hdu_stats_cb) (void *arg, int hdu, const frame_stats_t *stats);
 
 typedef struct calibrator_params {
 	char inpath[256];
@@ -29,19 +38,62 @@ typedef struct calibrator_params {
 	char darkpath[256];
 	char biaspath[256];
 	char flatpath[256];
+	char cachepath[256];
+	char qapath[256];
+	char claimpath[256];
 	char run_flag;
+	char pin_threads;
+	char dark_scaling;
+	char dark_fit;
 	int jobs_count;
+	int strip_rows;
+	int preview_format;
+	int preview_size;
+	int shard_index;
+	int shard_count;
+	int io_read_permits;
+	int io_write_permits;
+	char io_adaptive;
+	int raw_io;
+	char drop_cache;
+	char write_behind;
 	int min_calfiles;
 	int max_calfiles;
 	long int max_timediff;
+	long int claim_timeout;
 	double min_exp_eq_percent;
+	double max_tempdiff;
+	size_t cache_mem_limit;
+	size_t cache_disk_limit;
+	char incremental;
+	fits_output_format_t out_format;
+	fits_overscan_t overscan;
+	fits_badpix_t badpix;
+	cr_params_t crreject;
+	priority_rules_t priority;
 
 	logger_msg_cb logger_msg;
 	done_cb complete;
 } calibrator_params_t;
 
-void calibrate_files(calibrator_params_t *params);
-void calibrator_stop();
+typedef struct calibrator_session calibrator_session_t;
+
+calibrator_session_t *calibrator_session_new(calibrator_params_t *params);
+void calibrator_session_free(calibrator_session_t *session);
+
+int calibrator_start(calibrator_session_t *session);
+thread_pool_t *calibrator_session_pool(calibrator_session_t *session);
+
+int calibrate_files(calibrator_session_t *session);
+int calibrate_file(calibrator_session_t *session, const char *file, const char *save_path);
+int calibrate_file_stats(calibrator_session_t *session, const char *file, const char *save_path,
+			hdu_stats_cb stats_cb, void *stats_arg);
+int calibrate_manifest(calibrator_session_t *session, const char *path);
+void calibrator_stop(calibrator_session_t *session);
+
+/* pixel_type is one of KERNEL_IN_*, result is width * height floats and may be the F32 pixels */
+int calibrate_buffer(calibrator_session_t *session, const void *pixels, int pixel_type, int width, int height,
+			time_t obs_time, double exptime, double ccd_temp, float *result);
 
 #endif
 
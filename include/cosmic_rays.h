@@ -0,0 +1,43 @@
+/* 
+   cosmic_rays.h
+
+   Copyright 2022  Oleg Kutkov <contact@olegkutkov.me>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  
+ */
+
+#ifndef __COSMIC_RAYS_H__
+#define __COSMIC_RAYS_H__
+
+#include "fits_handler.h"
+#include "thread_pool.h"
+
+#define CR_DEFAULT_SIGFRAC 0.3
+#define CR_DEFAULT_OBJLIM 5.0
+#define CR_DEFAULT_GAIN 1.0
+#define CR_DEFAULT_READNOISE 10.0
+#define CR_DEFAULT_ITERATIONS 4
+
+typedef struct cr_params {
+	double sigclip;
+	double sigfrac;
+	double objlim;
+	double gain;
+	double readnoise;
+	int iterations;
+} cr_params_t;
+
+long cr_reject(fits_handle_t *image, const cr_params_t *params, thread_pool_t *pool);
+
+#endif
@@ -0,0 +1,36 @@
+/* 
+   cpu_topology.h
+
+   Copyright 2022  Oleg Kutkov <contact@olegkutkov.me>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  
+ */
+
+#ifndef __CPU_TOPOLOGY_H__
+#define __CPU_TOPOLOGY_H__
+
+#include <stddef.h>
+
+#define CPU_TOPOLOGY_MAX_NODES 16
+
+void cpu_topology_init();
+int cpu_topology_nodes_count();
+int cpu_topology_cpus_count();
+int cpu_topology_node_of_cpu(int cpu);
+int cpu_topology_current_node();
+int cpu_topology_cpu_for_slot(int slot);
+
+void *node_local_alloc(size_t size);
+
+#endif
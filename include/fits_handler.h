@@ -22,30 +22,137 @@
 #define __FITS_HANDLER_H__
 
 #include <fitsio.h>
+#include <stdint.h>
 #include <time.h>
 
+/* higher axes of the data cubes are flattened to the planes */
+#define FITS_MAX_AXES 9
+
+/* max order of the polynomial fitted to the overscan levels */
+#define FITS_OVERSCAN_MAX_ORDER 7
+
+enum {
+	OVERSCAN_NONE = 0,
+	OVERSCAN_MEAN,
+	OVERSCAN_MEDIAN
+};
+
+typedef struct fits_overscan {
+	int mode;
+	int fit_order;
+} fits_overscan_t;
+
+enum {
+	BADPIX_NONE = 0,
+	BADPIX_FLAG,
+	BADPIX_INTERPOLATE
+};
+
+typedef struct fits_badpix {
+	int mode;
+	double hot_sigma;
+	double dead_fraction;
+} fits_badpix_t;
+
+/* image section, 0-based and the end is exclusive */
+typedef struct fits_section {
+	int x0;
+	int x1;
+	int y0;
+	int y1;
+} fits_section_t;
+
+/* uncompressed data unit of the current HDU, read and written past cfitsio */
+typedef struct fits_raw_unit {
+	int mode;
+	int fd;
+	char opened;
+	char usable;
+	int bitpix;
+	double bzero;
+	double bscale;
+	long long offset;
+	long long file_size;
+	unsigned char *buffer;
+	size_t buffer_size;
+} fits_raw_unit_t;
+
+/* page cache use of the file which is read or written once */
+typedef struct fits_cache_policy {
+	char drop;
+	char write_behind;
+	char out_opened;
+	int out_fd;
+	size_t pending;
+} fits_cache_policy_t;
+
 typedef struct fits_handle {
 	fitsfile *src_fptr;
 	fitsfile *new_fptr;
-	long *image;
+	float *image;
+	void *mapped_base;
+	size_t mapped_size;
 	int width;
 	int height;
+	long planes;
+	int hdu;
+	int naxis;
+	long naxes[FITS_MAX_AXES];
 	int bitpix;
+	int out_bitpix;
+	double out_bzero;
+	double out_bscale;
+	char out_blank;
+	const fits_overscan_t *overscan;
+	fits_section_t trim_sec;
+	fits_section_t bias_sec;
+	float *overscan_level;
+	long overscan_plane;
+	char overscan_by_rows;
+	char has_overscan;
+	char trimmed;
+	uint32_t *bad_pixels;
+	long bad_count;
+	float saturation;
+	long saturated;
+	fits_raw_unit_t raw;
+	fits_cache_policy_t cache;
 } fits_handle_t;
 
+typedef struct fits_output_format {
+	int bitpix;
+	double bzero;
+	double bscale;
+	char blank;
+} fits_output_format_t;
+
 fits_handle_t *fits_handler_mem_new(int *status);
 fits_handle_t *fits_handler_new(const char *filepath, int *status);
+void fits_set_raw_io(fits_handle_t *handle, int mode);
+void fits_set_cache_policy(fits_handle_t *handle, int drop, int write_behind);
+void fits_prefetch_file(const char *path);
 
 time_t fits_get_observation_dt(fits_handle_t *handle);
 int fits_get_object_name(fits_handle_t *handle, char *buf);
 double fits_get_object_exptime(fits_handle_t *handle);
+double fits_get_ccd_temperature(fits_handle_t *handle);
+double fits_get_gain(fits_handle_t *handle);
+double fits_get_readnoise(fits_handle_t *handle);
+double fits_get_saturation(fits_handle_t *handle);
 
 int fits_create_image_mem(fits_handle_t *handle, int width, int height);
-int fits_load_image(fits_handle_t *handle);
+int fits_get_hdus_count(fits_handle_t *handle);
+int fits_select_hdu(fits_handle_t *handle, int hdu);
+int fits_is_image_hdu(fits_handle_t *handle);
+int fits_get_image_size(fits_handle_t *handle);
+int fits_load_plane(fits_handle_t *handle, long plane);
+int fits_read_rows(fits_handle_t *handle, long plane, int first_row, int rows, float *pixels);
+int fits_read_rows_raw(fits_handle_t *handle, long plane, int first_row, int rows, int datatype, void *pixels);
 int fits_copy_image(fits_handle_t *handle, fits_handle_t *src);
-int fits_add_image_matrix(fits_handle_t *handle, fits_handle_t *src);
-int fits_divide_image_matrix(fits_handle_t *handle, int divider);
-int fits_substract_image_matrix(fits_handle_t *handle, fits_handle_t *sb);
+double fits_fit_dark_scale(fits_handle_t *handle, fits_handle_t *bias, fits_handle_t *dark_current, int step);
+long fits_find_bad_pixels(fits_handle_t *handle, double hot_sigma, double dead_fraction);
+int fits_copy_bad_pixels(fits_handle_t *handle, fits_handle_t *src);
+void fits_correct_bad_pixels(fits_handle_t *handle, fits_handle_t *mask, int first_row, int mode);
 void fits_free_image(fits_handle_t *handle);
 
 int fits_get_image_w(fits_handle_t *handle);
@@ -54,7 +161,11 @@ int fits_get_image_h(fits_handle_t *handle);
 int fits_substract_dark(fits_handle_t *image, fits_handle_t *dark);
 int fits_substract_bias(fits_handle_t *image, fits_handle_t *bias);
 
-int fits_save_as_new_file(fits_handle_t *image, const char *filepath, const char *comment);
+int fits_create_new_file(fits_handle_t *handle, const char *filepath);
+int fits_add_new_hdu(fits_handle_t *handle, const char *comment, const fits_output_format_t *format);
+int fits_write_rows(fits_handle_t *handle, long plane, int first_row, int rows, float *pixels);
+void fits_write_behind(fits_handle_t *handle, size_t bytes);
+int fits_close_new_file(fits_handle_t *handle);
 
 void fits_release_file(fits_handle_t *handle);
 void fits_handler_free(fits_handle_t *handle);
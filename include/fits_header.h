@@ -0,0 +1,47 @@
+/* 
+   fits_header.h
+
+   Copyright 2022  Oleg Kutkov <contact@olegkutkov.me>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  
+ */
+
+#ifndef __FITS_HEADER_H__
+#define __FITS_HEADER_H__
+
+#include <time.h>
+#include "fits_handler.h"
+
+#define FITS_BLOCK_SIZE 2880
+#define FITS_CARD_SIZE 80
+/* primary headers longer than this are not scanned */
+#define FITS_HEADER_MAX_BLOCKS 64
+
+/* keys of the primary header needed to select the calibration files */
+typedef struct fits_header_info {
+	time_t obs_time;
+	double exptime;
+	double ccd_temp;
+	int bitpix;
+	int naxis;
+	long naxes[FITS_MAX_AXES];
+} fits_header_info_t;
+
+int fits_header_scan(const char *path, fits_header_info_t *info);
+int fits_header_key(const char *path, const char *key, char *value, size_t size);
+
+double fits_utc_time(int year, int month, int day, int hour, int minute, double second);
+time_t fits_parse_date_obs(const char *date, const char *time_obs);
+
+#endif
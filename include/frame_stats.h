@@ -0,0 +1,61 @@
+/* 
+   frame_stats.h
+
+   Copyright 2022  Oleg Kutkov <contact@olegkutkov.me>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  
+ */
+
+#ifndef __FRAME_STATS_H__
+#define __FRAME_STATS_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include "fits_handler.h"
+
+/* integer data is binned by 1 ADU in [-STATS_HIST_OFFSET, STATS_HIST_OFFSET) */
+#define STATS_HIST_OFFSET 131072
+#define STATS_HIST_BINS (2 * STATS_HIST_OFFSET)
+/* float data median is estimated on the regular subsample of this size */
+#define STATS_MAX_SAMPLES 262144
+
+typedef struct frame_stats {
+	long count;
+	long saturated;
+	double sum;
+	double sum_comp;
+	float min;
+	float max;
+	uint32_t *hist;
+	float *samples;
+	long sample_count;
+	long sample_step;
+	long sample_skip;
+	double mean;
+	double median;
+	double sigma;
+} frame_stats_t;
+
+int frame_stats_init(frame_stats_t *stats, fits_handle_t *image);
+void frame_stats_add(frame_stats_t *stats, const float *pixels, long npixels);
+void frame_stats_finish(frame_stats_t *stats);
+void frame_stats_free(frame_stats_t *stats);
+
+int frame_stats_reserve_keys(fits_handle_t *output);
+int frame_stats_write_keys(fits_handle_t *output, int hdu, const frame_stats_t *stats);
+void frame_stats_print_header(FILE *f, int json);
+void frame_stats_print(FILE *f, int json, int first, const char *file, int hdu, const frame_stats_t *stats);
+void frame_stats_print_footer(FILE *f, int json);
+
+#endif
@@ -0,0 +1,46 @@
+/* 
+   io_limiter.h
+
+   Copyright 2022  Oleg Kutkov <contact@olegkutkov.me>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  
+ */
+
+#ifndef __IO_LIMITER_H__
+#define __IO_LIMITER_H__
+
+#include <stddef.h>
+#include <time.h>
+
+enum {
+	IO_READ,
+	IO_WRITE,
+	IO_KINDS
+};
+
+/* upper bound of the adaptive permits when the count isn't set */
+#define IO_DEFAULT_MAX_PERMITS 16
+
+typedef struct io_limiter io_limiter_t;
+typedef struct io_device io_device_t;
+
+io_limiter_t *io_limiter_new(int read_permits, int write_permits, int adaptive);
+void io_limiter_free(io_limiter_t *limiter);
+
+io_device_t *io_limiter_device(io_limiter_t *limiter, const char *path);
+
+void io_begin(io_device_t *device, int kind, struct timespec *start);
+void io_end(io_device_t *device, int kind, const struct timespec *start, size_t bytes);
+
+#endif
@@ -0,0 +1,79 @@
+/* 
+   kernels.h
+
+   Copyright 2022  Oleg Kutkov <contact@olegkutkov.me>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  
+ */
+
+#ifndef __KERNELS_H__
+#define __KERNELS_H__
+
+#include <stddef.h>
+#include "fits_handler.h"
+
+/* type of the raw pixels read from the file */
+enum {
+	KERNEL_IN_U16,
+	KERNEL_IN_I16,
+	KERNEL_IN_I32,
+	KERNEL_IN_F32,
+	KERNEL_INPUTS
+};
+
+/* calibration steps done by the kernel */
+enum {
+	KERNEL_OPS_DARK,
+	KERNEL_OPS_SCALED_DARK,
+	KERNEL_OPS_COUNT
+};
+
+/* type of the stored integer output */
+enum {
+	KERNEL_OUT_U8,
+	KERNEL_OUT_I16,
+	KERNEL_OUT_I32,
+	KERNEL_OUTPUTS
+};
+
+/*
+ * out = in - dark or out = in - (bias + scale * dark_current),
+ *  the F32 kernels work in place (in == out)
+ */
+typedef void (*calib_kernel_fn) (const void *in, float *out, const float *restrict bias,
+					const float *restrict dark, float scale, long n);
+typedef long (*saturation_kernel_fn) (const void *in, float level, long n);
+typedef void (*output_kernel_fn) (const float *restrict in, void *restrict out,
+					double bzero, double bscale, int blank, long n);
+
+typedef struct calib_kernel {
+	int input;
+	int datatype;
+	size_t pixel_size;
+	calib_kernel_fn apply;
+	saturation_kernel_fn count_saturated;
+} calib_kernel_t;
+
+typedef struct output_kernel {
+	int datatype;
+	size_t pixel_size;
+	output_kernel_fn convert;
+	long blank;
+} output_kernel_t;
+
+int kernel_input_for_bitpix(int bitpix);
+void calib_kernel_select(calib_kernel_t *kernel, int input, int ops);
+void output_kernel_select(output_kernel_t *kernel, int out_bitpix);
+
+#endif
@@ -0,0 +1,53 @@
+/* 
+   master_cache.h
+
+   Copyright 2022  Oleg Kutkov <contact@olegkutkov.me>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  
+ */
+
+#ifndef __MASTER_CACHE_H__
+#define __MASTER_CACHE_H__
+
+#include <stdint.h>
+#include "list.h"
+#include "fits_handler.h"
+#include "master_stack.h"
+
+typedef struct master_entry master_entry_t;
+typedef struct master_cache master_cache_t;
+
+enum {
+	MASTER_MEAN = 0,
+	MASTER_DARK_CURRENT
+};
+
+/* adds (sign 1) or takes out (sign -1) the frames of the files */
+typedef int (*master_stack_cb) (void *arg, list_node_t *files, int sign, master_stack_t *stack);
+typedef void (*master_finish_cb) (void *arg, fits_handle_t *master);
+
+master_cache_t *master_cache_new(size_t max_bytes, int numa_replicas, const char *shared_path, size_t shared_max_bytes,
+				uint64_t variant, int incremental);
+void master_cache_free(master_cache_t *cache);
+
+uint64_t master_cache_file_id(const char *path);
+uint64_t master_cache_key(master_cache_t *cache, list_node_t *files, int kind, int hdu, uint64_t depends);
+
+master_entry_t *master_cache_acquire(master_cache_t *cache, list_node_t *files, int kind, int hdu, uint64_t depends,
+				int node, master_stack_cb stack_files, master_finish_cb finish, void *build_arg);
+fits_handle_t *master_entry_image(master_entry_t *entry, int node);
+uint64_t master_entry_key(master_entry_t *entry);
+void master_cache_release(master_entry_t *entry);
+
+#endif
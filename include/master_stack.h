@@ -0,0 +1,63 @@
+/* 
+   master_stack.h
+
+   Copyright 2022  Oleg Kutkov <contact@olegkutkov.me>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  
+ */
+
+#ifndef __MASTER_STACK_H__
+#define __MASTER_STACK_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "list.h"
+#include "fits_handler.h"
+
+typedef struct master_stack_file {
+	uint64_t id;
+	int frames;
+	char *path;
+} master_stack_file_t;
+
+/*
+ * Running sum of the frames, master is the sum divided by count, comp is the Kahan compensation.
+ *  No sum of squares, the masters are means only
+ */
+typedef struct master_stack {
+	int width;
+	int height;
+	int bitpix;
+	int count;
+	double *sum;
+	double *comp;
+	master_stack_file_t *files;
+	int files_count;
+	int files_allocated;
+} master_stack_t;
+
+master_stack_t *master_stack_new(void);
+void master_stack_free(master_stack_t *stack);
+size_t master_stack_bytes(master_stack_t *stack);
+
+int master_stack_add(master_stack_t *stack, fits_handle_t *frame, fits_handle_t *bias, float scale, int sign);
+int master_stack_track(master_stack_t *stack, const char *path, int frames);
+int master_stack_find(master_stack_t *stack, const char *path);
+void master_stack_untrack(master_stack_t *stack, int index);
+
+int master_stack_overlap(master_stack_t *stack, const uint64_t *ids, int ids_count);
+int master_stack_diff(master_stack_t *stack, list_node_t *files, list_node_t **added, list_node_t **removed);
+fits_handle_t *master_stack_mean(master_stack_t *stack);
+
+#endif
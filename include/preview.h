@@ -0,0 +1,47 @@
+/* 
+   preview.h
+
+   Copyright 2022  Oleg Kutkov <contact@olegkutkov.me>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  
+ */
+
+#ifndef __PREVIEW_H__
+#define __PREVIEW_H__
+
+#include <stdint.h>
+
+#define PREVIEW_NONE 0
+#define PREVIEW_PGM 1
+#define PREVIEW_PNG 2
+
+#define PREVIEW_DEFAULT_SIZE 512
+
+typedef struct preview {
+	int block;
+	int image_width;
+	int width;
+	int height;
+	float *sum;
+	uint32_t *count;
+} preview_t;
+
+int preview_init(preview_t *preview, int image_width, int image_height, int max_size);
+void preview_add_rows(preview_t *preview, const float *pixels, int first_row, int rows);
+int preview_save(preview_t *preview, const char *path, int format);
+void preview_free(preview_t *preview);
+
+const char *preview_file_ext(int format);
+
+#endif
@@ -0,0 +1,44 @@
+/* 
+   priority.h
+
+   Copyright 2022  Oleg Kutkov <contact@olegkutkov.me>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  
+ */
+
+#ifndef __PRIORITY_H__
+#define __PRIORITY_H__
+
+#define PRIORITY_MAX_RULES 16
+#define PRIORITY_KEY_SIZE 9
+#define PRIORITY_PATTERN_SIZE 72
+
+/* header key matching the pattern, or the file modified less than max_age seconds ago when key is empty */
+typedef struct priority_rule {
+	char key[PRIORITY_KEY_SIZE];
+	char pattern[PRIORITY_PATTERN_SIZE];
+	long max_age;
+	int priority;
+} priority_rule_t;
+
+typedef struct priority_rules {
+	priority_rule_t rule[PRIORITY_MAX_RULES];
+	int count;
+	long deadline;
+} priority_rules_t;
+
+int priority_rule_parse(priority_rules_t *rules, const char *text);
+void priority_of_file(const priority_rules_t *rules, const char *path, int *priority, long *deadline);
+
+#endif
@@ -0,0 +1,45 @@
+/* 
+   raw_io.h
+
+   Copyright 2022  Oleg Kutkov <contact@olegkutkov.me>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  
+ */
+
+#ifndef __RAW_IO_H__
+#define __RAW_IO_H__
+
+#include <stddef.h>
+#include <sys/types.h>
+
+enum {
+	RAW_IO_NONE = 0,
+	RAW_IO_PREAD,
+	RAW_IO_URING
+};
+
+/* offsets, sizes and buffers of the direct I/O are aligned to this */
+#define RAW_IO_ALIGN 4096
+
+/* data unit is transferred by spans of this size, split to the batch of requests */
+#define RAW_IO_SPAN (16 << 20)
+
+int raw_io_mode_parse(const char *name);
+
+int raw_io_open(const char *path, int flags);
+void *raw_io_alloc(size_t size);
+
+ssize_t raw_io_read(int mode, int fd, void *buf, size_t len, off_t offset);
+
+#endif
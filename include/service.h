@@ -0,0 +1,30 @@
+/* 
+   service.h
+
+   Copyright 2022  Oleg Kutkov <contact@olegkutkov.me>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  
+ */
+
+#ifndef __SERVICE_H__
+#define __SERVICE_H__
+
+#include "calibrator.h"
+
+/* calibrated floats of the BUFFER request follow the raw pixels at this offset of the shared memory */
+#define SERVICE_RESULT_OFFSET(raw_bytes) (((raw_bytes) + 63) & ~((size_t) 63))
+
+int calibrator_serve(calibrator_session_t *session, const char *socket_path, volatile int *run_flag);
+
+#endif
@@ -0,0 +1,66 @@
+/* 
+   shared_cache.h
+
+   Copyright 2022  Oleg Kutkov <contact@olegkutkov.me>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  
+ */
+
+#ifndef __SHARED_CACHE_H__
+#define __SHARED_CACHE_H__
+
+#include <stdint.h>
+#include "list.h"
+#include "fits_handler.h"
+#include "master_stack.h"
+
+#define SHARED_CACHE_MAGIC "FCMASTR3"
+#define SHARED_STACK_MAGIC "FCSTACK2"
+
+typedef struct shared_master_hdr {
+	char magic[8];
+	uint64_t key;
+	int32_t width;
+	int32_t height;
+	int32_t bitpix;
+	int32_t count;
+	uint32_t elem_size;
+	uint32_t bad_count;
+	uint64_t data_offset;
+	uint64_t bad_offset;
+} shared_master_hdr_t;
+
+/* file records (id, frames, path length, path) follow the header, sums and compensations start at data_offset */
+typedef struct shared_stack_hdr {
+	char magic[8];
+	uint64_t group;
+	int32_t width;
+	int32_t height;
+	int32_t bitpix;
+	int32_t count;
+	uint32_t files_count;
+	uint32_t elem_size;
+	uint64_t data_offset;
+} shared_stack_hdr_t;
+
+fits_handle_t *shared_cache_lookup(const char *dir, uint64_t key, int *count);
+int shared_cache_lock(const char *dir, uint64_t key);
+void shared_cache_unlock(const char *dir, uint64_t key, int lock_fd);
+int shared_cache_publish(const char *dir, uint64_t key, list_node_t *files, fits_handle_t *master, int count);
+master_stack_t *shared_cache_load_stack(const char *dir, uint64_t group, const uint64_t *ids, int ids_count);
+int shared_cache_publish_stack(const char *dir, uint64_t key, uint64_t group, master_stack_t *stack);
+void shared_cache_remove_stack(const char *dir, uint64_t key);
+void shared_cache_evict(const char *dir, uint64_t max_bytes);
+
+#endif
@@ -20,14 +20,29 @@
 #ifndef __THREAD_POOL_H__
 #define __THREAD_POOL_H__
 
+#include <stddef.h>
+
 typedef void* (*thread_task) (void *arg);
 
-void init_thread_pool(size_t num_threads);
-void thread_pool_add_task(thread_task task, void *task_arg);
-void cleanup_thread_pool();
+typedef struct thread_pool thread_pool_t;
+
+typedef struct thread_group {
+	thread_pool_t *pool;
+	int pending;
+} thread_group_t;
+
+thread_pool_t *thread_pool_new(size_t num_threads, int pin_threads);
+void thread_pool_add_task(thread_pool_t *pool, thread_task task, void *task_arg);
+void thread_pool_add_task_prio(thread_pool_t *pool, thread_task task, void *task_arg, int priority, long deadline);
+void thread_pool_free(thread_pool_t *pool);
+size_t thread_pool_threads(thread_pool_t *pool);
+
+void thread_group_init(thread_group_t *group, thread_pool_t *pool);
+void thread_pool_add_group_task(thread_group_t *group, thread_task task, void *task_arg);
+void thread_pool_wait_group(thread_group_t *group);
 
-void task_enter_critical_section();
-void task_exit_critical_section();
+void task_enter_critical_section(thread_pool_t *pool);
+void task_exit_critical_section(thread_pool_t *pool);
 
 #endif
 
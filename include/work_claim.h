@@ -0,0 +1,30 @@
+/* 
+   work_claim.h
+
+   Copyright 2022  Oleg Kutkov <contact@olegkutkov.me>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  
+ */
+
+#ifndef __WORK_CLAIM_H__
+#define __WORK_CLAIM_H__
+
+#define WORK_CLAIM_DEFAULT_TIMEOUT 3600
+
+int work_shard_match(const char *file, int shard, int shards);
+
+int work_claim(const char *claim_dir, const char *file, const char *save_path, long stale_timeout);
+void work_claim_release(const char *claim_dir, const char *file, const char *save_path, int done);
+
+#endif
@@ -19,14 +19,28 @@
  */
 
 #include <limits.h>
+#include <errno.h>
+#include <math.h>
 #include <stdlib.h>
 #include <dirent.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <libgen.h>
 #include <time.h>
+#include <pthread.h>
+#include <stdint.h>
 #include "list.h"
 #include "thread_pool.h"
+#include "cpu_topology.h"
+#include "master_cache.h"
+#include "frame_stats.h"
+#include "preview.h"
+#include "kernels.h"
+#include "fits_header.h"
+#include "work_claim.h"
+#include "priority.h"
+#include "io_limiter.h"
 #include "calibrator.h"
 #include "fits_handler.h"
 #include "file_utils.h"
@@ -36,16 +50,22 @@
 #define min(a, b) ((a) < (b)) ? (a) : (b)
 #define max(a, b) ((a) > (b)) ? (a) : (b)
 
-static list_node_t *file_list = NULL;
-static int total_files_counter = 0;
-static char *USER_TIMEZONE = NULL;
-
-typedef struct thread_arg {
-	calibrator_params_t *cal_param;
-	list_node_t *filelist;
-	int file_list_offset;
-	int file_list_len;
-} thread_arg_t;
+/*
+ * Everything the calibrator owns while it runs, several sessions
+ *  can live in one process with their own params
+ */
+struct calibrator_session {
+	calibrator_params_t *params;
+	thread_pool_t *pool;
+	master_cache_t *cache;
+	io_limiter_t *io;
+	list_node_t *file_list;
+	int total_files_counter;
+	FILE *qa_summary;
+	int qa_json;
+	int qa_rows;
+	pthread_mutex_t lock;
+};
 
 int find_best_calibration_files(calibrator_params_t *params, time_t imtime, double exptime, const char *objname, fits_handle_t **cfiles)
 {
@@ -63,41 +83,140 @@ void free_darks_list(fits_handle_t **list, int cnt)
 	free(list);
 }
 
-fits_handle_t *build_master_calibration_file(calibrator_params_t *params, char *dpath,
-			int *count, const char *src_file,
-			time_t imtime, double exptime)
+/* every n-th pixel of every n-th row is used for the dark scale fit */
+#define DARK_FIT_SAMPLE_STEP 16
+
+/* used for the strip size when the system doesn't report L2 size */
+#define DEFAULT_L2_CACHE_SIZE (256 * 1024)
+
+/* calibration frames selected for the image, masters are built from them for every HDU */
+typedef struct calibration_files {
+	list_node_t *darks;
+	list_node_t *biases;
+	int dark_count;
+	int bias_count;
+	double exptime;
+} calibration_files_t;
+
+typedef struct calibration_set {
+	master_entry_t *dark;
+	master_entry_t *bias;
+	fits_handle_t *dark_img;
+	fits_handle_t *bias_img;
+	double exptime;
+	double dark_scale;
+	char scaled;
+	int badpix_mode;
+} calibration_set_t;
+
+typedef struct master_build_arg {
+	calibrator_params_t *params;
+	io_limiter_t *io;
+	fits_handle_t *bias;
+	int hdu;
+	char bad_pixels;
+} master_build_arg_t;
+
+/* one science file, its image HDUs are calibrated in parallel into the shared output */
+typedef struct calibration_job {
+	calibrator_session_t *session;
+	calibrator_params_t *params;
+	const char *file;
+	calibration_files_t *cal_files;
+	const char *save_path;
+	io_device_t *read_dev;
+	io_device_t *write_dev;
+	fits_handle_t *output;
+	pthread_mutex_t output_lock;
+	hdu_stats_cb stats_cb;
+	void *stats_arg;
+} calibration_job_t;
+
+/* products of the HDU collected from the calibrated pixels before they are written */
+typedef struct hdu_products {
+	frame_stats_t *stats;
+	preview_t *preview;
+} hdu_products_t;
+
+typedef struct hdu_task {
+	calibration_job_t *job;
+	int hdu;
+	int status;
+} hdu_task_t;
+
+typedef struct file_task {
+	calibrator_session_t *session;
+	const char *file;
+	int priority;
+	long deadline;
+	int order;
+} file_task_t;
+
+/* line of the manifest, calibration frames are pinned when dark_count > 0 */
+typedef struct manifest_task {
+	calibrator_session_t *session;
+	char *file;
+	char *save_path;
+	calibration_files_t pinned;
+	int priority;
+	long deadline;
+} manifest_task_t;
+
+/* calibration file which matches the image, the closest in time are taken */
+typedef struct calibration_candidate {
+	char *path;
+	time_t timediff;
+	double exp_diff;
+} calibration_candidate_t;
+
+static int worker_node(calibrator_params_t *params)
+{
+	return params->pin_threads ? cpu_topology_current_node() : 0;
+}
+
+static int compare_candidates(const void *a, const void *b)
+{
+	const calibration_candidate_t *ca = (const calibration_candidate_t *) a;
+	const calibration_candidate_t *cb = (const calibration_candidate_t *) b;
+
+	if (ca->timediff != cb->timediff) {
+		return ca->timediff < cb->timediff ? -1 : 1;
+	}
+
+	return strcmp(ca->path, cb->path);
+}
+
+/*
+ * Whole directory is scanned and the max_calfiles files closest in time to the image are taken,
+ *  so the selection doesn't depend on the readdir() order of the filesystem
+ */
+int select_calibration_files(calibrator_params_t *params, char *dpath, list_node_t **files,
+			const char *src_file, time_t imtime, double exptime, double temp)
 {
 	DIR *dp;
 	struct dirent *ep;
 	char *full_file_path = NULL;
 	char err_buf[32] = { 0 };
-	int status = 0, dark_counter = 0;
-	double dark_exposure, exp_diff, min_exp, max_exp;
+	int i, status = 0, dark_counter = 0, candidates_count = 0, candidates_allocated = 0;
+	double dark_exposure, exp_diff, min_exp, max_exp, dark_temp;
 	time_t dark_date, timediff_sec, min_time, max_time;
-	fits_handle_t *curr_dark = NULL;
-	fits_handle_t *master_file = NULL;
-
-	*count = 0;
+	fits_header_info_t header;
+	calibration_candidate_t *candidates = NULL, *tmp;
 
 	dp = opendir(dpath);
 
 	if (dp == NULL) {
-		return NULL;
+		return 0;
 	}
 
 	while ((ep = readdir(dp))) {
-		if (dark_counter >= params->max_calfiles) {
-			break;
-		}
-
 		if (strstr(ep->d_name, "fit") || strstr(ep->d_name, "FIT")) {
 			build_full_file_path(dpath, ep->d_name, &full_file_path);
 
-			status = 0;
-
-			curr_dark = fits_handler_new(full_file_path, &status);
+			/* only the primary header is needed here, it's scanned without cfitsio */
+			status = fits_header_scan(full_file_path, &header);
 
-			if (status !=0 ) {
+			if (status != 0) {
 				fits_get_status_code_msg(status, err_buf);
 				params->logger_msg("\nUnable to process %s error: %s\n", full_file_path, err_buf);
 				free(full_file_path);
@@ -105,8 +224,21 @@ fits_handle_t *build_master_calibration_file(calibrator_params_t *params, char *
 				continue;
 			}
 
-			dark_date = fits_get_observation_dt(curr_dark);
-			dark_exposure = fits_get_object_exptime(curr_dark);
+			dark_date = header.obs_time;
+			dark_exposure = header.exptime;
+
+			if (params->max_tempdiff > 0 && !isnan(temp)) {
+				dark_temp = header.ccd_temp;
+
+				if (!isnan(dark_temp) && fabs(dark_temp - temp) > params->max_tempdiff) {
+					params->logger_msg("\tWarning: Couldn't apply %s calibration to %s, temperature diff is out limit, ΔT = %.1f C\n",
+											full_file_path, src_file, fabs(dark_temp - temp));
+
+					free(full_file_path);
+
+					continue;
+				}
+			}
 
 			min_time = min(dark_date, imtime);
 			max_time = max(dark_date, imtime);
@@ -124,26 +256,27 @@ fits_handle_t *build_master_calibration_file(calibrator_params_t *params, char *
 				}
 
 				if (exp_diff >= params->min_exp_eq_percent) {
-					params->logger_msg("\tInfo: Found corresponding calibration %s to file %s, timediff: %li sec, expdiff %.2f %%\n",
-											full_file_path, src_file, timediff_sec, exp_diff);
+					if (candidates_count == candidates_allocated) {
+						candidates_allocated = candidates_allocated ? candidates_allocated * 2 : 32;
 
-					fits_load_image(curr_dark);
+						tmp = (calibration_candidate_t *) realloc(candidates,
+									candidates_allocated * sizeof(calibration_candidate_t));
 
-					if (dark_counter == 0) {
-						status = 0;
+						if (!tmp) {
+							free(full_file_path);
+							break;
+						}
 
-						master_file = fits_handler_mem_new(&status);
-
-						fits_create_image_mem(master_file, fits_get_image_w(curr_dark), fits_get_image_h(curr_dark));
-
-						fits_copy_image(master_file, curr_dark);
-					} else {
-						fits_add_image_matrix(master_file, curr_dark);
+						candidates = tmp;
 					}
 
-					fits_free_image(curr_dark);
+					candidates[candidates_count].path = full_file_path;
+					candidates[candidates_count].timediff = timediff_sec;
+					candidates[candidates_count].exp_diff = exp_diff;
+					candidates_count++;
 
-					dark_counter++;
+					/* path is owned by the candidate now */
+					continue;
 				} else {
 					params->logger_msg("\tWarning: Couldn't apply %s calibration to %s, exposure time is out limit\n", full_file_path, src_file);
 				}
@@ -151,271 +284,1698 @@ fits_handle_t *build_master_calibration_file(calibrator_params_t *params, char *
 				params->logger_msg("\tWarning: Couldn't apply %s calibration to %s, timestamps diff is out limit, Δt = %d sec\n", full_file_path, src_file, timediff_sec);
 			}
 
-			fits_handler_free(curr_dark);
-
 			free(full_file_path);
 		}
 	}
 
 	closedir (dp);
 
-	if (exptime > 0) {
-		if (dark_counter < params->min_calfiles) {
-			if (master_file) {
-				free(master_file);
-			}
+	if (candidates_count > 1) {
+		qsort(candidates, candidates_count, sizeof(calibration_candidate_t), compare_candidates);
+	}
 
-			params->logger_msg("\tWarning: To few (%i) calibration files for the %s skipping calibration...\n", dark_counter, src_file);
+	dark_counter = candidates_count < params->max_calfiles ? candidates_count : params->max_calfiles;
 
-			return NULL;
-		}
+	for (i = 0; i < dark_counter; ++i) {
+		params->logger_msg("\tInfo: Found corresponding calibration %s to file %s, timediff: %li sec, expdiff %.2f %%\n",
+								candidates[i].path, src_file, candidates[i].timediff, candidates[i].exp_diff);
+	}
+
+	/* list is built from the tail, so the files are in the order of selection */
+	for (i = dark_counter - 1; i >= 0; --i) {
+		*files = add_object_to_list(*files, candidates[i].path);
+	}
+
+	for (i = 0; i < candidates_count; ++i) {
+		free(candidates[i].path);
 	}
 
-	*count = dark_counter;
+	free(candidates);
 
-	return master_file;
+	return dark_counter;
 }
 
-int substract_darks(calibrator_params_t *params, fits_handle_t *orig_img, const char *src_file, time_t imtime, double exptime, int *dark_counter, int *bias_counter)
+/*
+ * Opens the calibration file at the same HDU as the calibrated image
+ */
+static fits_handle_t *open_calibration_hdu(calibrator_params_t *params, const char *path, int hdu)
 {
-	fits_handle_t *master_bias;
-	fits_handle_t *master_dark = build_master_calibration_file(params, params->darkpath, dark_counter, src_file, imtime, exptime);
+	char err_buf[32] = { 0 };
+	int status = 0;
+	fits_handle_t *handle = fits_handler_new(path, &status);
 
-	if (!master_dark) {
-		return -1;
+	if (status == 0) {
+		handle->overscan = &params->overscan;
+		fits_set_raw_io(handle, params->raw_io);
+		status = fits_select_hdu(handle, hdu);
 	}
 
-	fits_divide_image_matrix(master_dark, *dark_counter);
-
-	master_bias = build_master_calibration_file(params, params->biaspath, bias_counter, src_file, imtime, 0);
+	if (status == 0 && !fits_is_image_hdu(handle)) {
+		status = -ENOENT;
+	}
 
-	if (*bias_counter > 0) {
-		fits_divide_image_matrix(master_bias, *bias_counter);
+	if (status != 0) {
+		fits_get_status_code_msg(status, err_buf);
+		params->logger_msg("\nUnable to process %s HDU %i error: %s\n", path, hdu, err_buf);
+		fits_handler_free(handle);
 
-		fits_substract_image_matrix(master_dark, master_bias);
-		fits_substract_image_matrix(orig_img, master_bias);
+		return NULL;
 	}
 
-	fits_substract_image_matrix(orig_img, master_dark);
+	return handle;
+}
 
-	fits_free_image(master_dark);
-	fits_free_image(master_bias);
+static void find_bad_pixels(calibrator_params_t *params, fits_handle_t *master, double dead_fraction)
+{
+	long count = fits_find_bad_pixels(master, params->badpix.hot_sigma, dead_fraction);
 
-	if (master_dark) {
-		free(master_dark);
+	if (count < 0) {
+		params->logger_msg("\tWarning: Unable to make the bad pixels mask\n");
+	} else {
+		params->logger_msg("\tInfo: %li bad pixels found in the master dark\n", count);
 	}
+}
 
-	if (master_bias) {
-		free(master_bias);
-	}
+/* size of the plane in the file */
+static size_t plane_bytes(fits_handle_t *image, int rows, int bitpix)
+{
+	return (size_t) image->width * rows * (abs(bitpix) / 8);
+}
 
-	return 0;
+static int load_plane(io_device_t *io_dev, fits_handle_t *image, long plane)
+{
+	struct timespec io_start;
+	int status;
+
+	io_begin(io_dev, IO_READ, &io_start);
+
+	status = fits_load_plane(image, plane);
+
+	io_end(io_dev, IO_READ, &io_start, plane_bytes(image, image->height, image->bitpix));
+
+	return status;
 }
 
-void calibrate_one_file(const char *file, void *arg)
+/*
+ * Every plane of the calibration cube is a separate frame of the master,
+ *  dark current frames are (dark - bias) / exptime.
+ *  Returns the number of frames stacked, no more than max_frames if it isn't negative
+ */
+static int stack_calibration_file(master_build_arg_t *build_arg, const char *path, int sign, long max_frames,
+				master_stack_t *stack)
 {
+	calibrator_params_t *params = build_arg->params;
 	char err_buf[32] = { 0 };
-	char object[76] = { 0 };
-	char comment[35] = { 0 };
-	int status = 0, dark_count = 0, bias_count = 0;
-	time_t image_time;
-	double image_exptime;
-	fits_handle_t *fits_image;
-	char *save_path = NULL;
-	char *target_basename = NULL;
-	calibrator_params_t *params = (calibrator_params_t *) arg;
+	int status, frames = 0;
+	long plane;
+	double exposure, scale = 1.0;
+	fits_handle_t *frame;
+	io_device_t *io_dev;
 
-	params->logger_msg("\nWorking %s\n", file);
+	frame = open_calibration_hdu(params, path, build_arg->hdu);
 
-	target_basename = basename((char*)file);
-	build_full_file_path(params->outpath, target_basename, &save_path);
+	if (!frame) {
+		return 0;
+	}
 
-	if (is_file_exist(save_path)) {
-		params->logger_msg("File %s is already exists, skipping calibration\n", save_path);
-		free(save_path);
+	if (build_arg->bias) {
+		/* exposure is the keyword of the primary header */
+		fits_select_hdu(frame, 1);
+		exposure = fits_get_object_exptime(frame);
+		fits_select_hdu(frame, build_arg->hdu);
 
-		total_files_counter--;
+		if (exposure <= 0) {
+			params->logger_msg("\tWarning: %s has no exposure time, it can't be scaled\n", path);
+			fits_handler_free(frame);
 
-		if (total_files_counter == 0) {
-			params->complete();
+			return 0;
 		}
 
-		return;
+		scale = 1.0 / exposure;
 	}
 
-	fits_image = fits_handler_new(file, &status);
+	io_dev = io_limiter_device(build_arg->io, path);
 
-	if (status != 0) {
-		fits_get_status_code_msg(status, err_buf);
-		params->logger_msg("\nUnable to process %s error: %s\n", file, err_buf);
-		return;
+	for (plane = 0; plane < frame->planes && (max_frames < 0 || plane < max_frames); plane++) {
+		status = load_plane(io_dev, frame, plane);
+
+		if (status != 0) {
+			fits_get_status_code_msg(status, err_buf);
+			params->logger_msg("\nUnable to process %s error: %s\n", path, err_buf);
+
+			break;
+		}
+
+		if (master_stack_add(stack, frame, build_arg->bias, scale, sign) != 0) {
+			params->logger_msg(build_arg->bias ? "\tWarning: %s doesn't match size of the master bias\n"
+					: "\tWarning: %s doesn't match size of the other calibration frames\n", path);
+
+			break;
+		}
+
+		frames++;
 	}
 
-	image_time = fits_get_observation_dt(fits_image);
-	fits_get_object_name(fits_image, object);
-	image_exptime = fits_get_object_exptime(fits_image);
+	fits_free_image(frame);
+	fits_handler_free(frame);
+
+	return frames;
+}
+
+/*
+ * Unreadable files are skipped when added, like in a full build,
+ *  but the files taken out must give back all the frames recorded for them
+ */
+static int stack_calibration_files(void *arg, list_node_t *files, int sign, master_stack_t *stack)
+{
+	master_build_arg_t *build_arg = (master_build_arg_t *) arg;
+	calibrator_params_t *params = build_arg->params;
+	list_node_t *tmp;
+	int frames, index;
+
+	if (params->drop_cache && files) {
+		fits_prefetch_file(files->object);
+	}
+
+	for (tmp = files; tmp; tmp = tmp->next) {
+		/* next frame is read ahead while this one is added */
+		if (params->drop_cache && tmp->next) {
+			fits_prefetch_file(tmp->next->object);
+		}
 
-	if (strlen(params->darkpath) > 0) {
-		fits_load_image(fits_image);
+		if (sign > 0) {
+			frames = stack_calibration_file(build_arg, tmp->object, 1, -1, stack);
 
-		if ((substract_darks(params, fits_image, file, image_time, image_exptime, &dark_count, &bias_count)) != -1) {
+			if (frames > 0 && master_stack_track(stack, tmp->object, frames) != 0) {
+				return -ENOMEM;
+			}
 
-			snprintf(comment, sizeof(comment), "Calibrated: %i darks, %i bias", dark_count, bias_count);
+			continue;
+		}
 
-			params->logger_msg("Info: %s is %s\n", file, comment);
+		index = master_stack_find(stack, tmp->object);
 
-			fits_save_as_new_file(fits_image, save_path, comment);
+		if (index < 0) {
+			return -ENOENT;
+		}
 
-			free(save_path);
+		frames = stack->files[index].frames;
 
-		} else {
-			params->logger_msg("Warning: %s WASN'T calibrated\n", file);
+		if (stack_calibration_file(build_arg, tmp->object, -1, frames, stack) != frames) {
+			return -ESTALE;
 		}
 
-		fits_free_image(fits_image);
+		master_stack_untrack(stack, index);
 	}
 
-	fits_handler_free(fits_image);
+	return 0;
+}
+
+static void finish_master(void *arg, fits_handle_t *master)
+{
+	master_build_arg_t *build_arg = (master_build_arg_t *) arg;
+	calibrator_params_t *params = build_arg->params;
+
+	if (!build_arg->bad_pixels) {
+		return;
+	}
 
+	/* dark current of the good pixels is near zero, so only hot ones are detected */
+	find_bad_pixels(params, master, build_arg->bias ? 0 : params->badpix.dead_fraction);
+}
+
+/*
+ * Calibration frames are selected once for the image by its primary header,
+ *  masters of every HDU are made of the same files
+ */
+int select_calibration_frames(calibrator_params_t *params, calibration_files_t *files,
+			const char *src_file, time_t imtime, double exptime, double temp)
+{
+	memset(files, 0, sizeof(calibration_files_t));
 
-	task_enter_critical_section();
+	files->exptime = exptime;
 
-	total_files_counter--;
+	if (params->dark_scaling) {
+		files->bias_count = select_calibration_files(params, params->biaspath, &files->biases, src_file, imtime, 0, temp);
+
+		if (files->bias_count == 0) {
+			params->logger_msg("\tWarning: Dark scaling requires bias frames, none found for %s\n", src_file);
+			return -1;
+		}
+
+		/* zero exptime disables the exposure equality check */
+		files->dark_count = select_calibration_files(params, params->darkpath, &files->darks, src_file, imtime, 0, temp);
+	} else {
+		/* dark of the same exposure holds the bias already, the bias frames aren't used */
+		files->dark_count = select_calibration_files(params, params->darkpath, &files->darks, src_file, imtime, exptime, temp);
+	}
 
-	if (total_files_counter == 0) {
-		params->complete();
+	if ((exptime > 0 || params->dark_scaling) && files->dark_count < params->min_calfiles) {
+		params->logger_msg("\tWarning: To few (%i) calibration files for the %s skipping calibration...\n", files->dark_count, src_file);
+		return -1;
 	}
 
-	task_exit_critical_section();
+	return files->dark_count > 0 ? 0 : -1;
+}
+
+void release_calibration_frames(calibration_files_t *files)
+{
+	free_list(files->darks);
+	free_list(files->biases);
+
+	memset(files, 0, sizeof(calibration_files_t));
 }
 
-void *thread_func(void *arg)
+/*
+ * Masters are shared between all workers through the cache
+ *  and must be treated as read-only by the caller.
+ *  One bias-subtracted dark current master serves every exposure
+ *  within the time and temperature window, it's scaled by the image exptime
+ */
+int acquire_scaled_darks(calibrator_session_t *session, calibration_set_t *set, calibration_files_t *files, int hdu)
 {
-	thread_arg_t th_arg_local;
-	thread_arg_t *th_arg = (thread_arg_t *) arg;
-	calibrator_params_t *params = th_arg->cal_param;
+	calibrator_params_t *params = session->params;
+	int node = worker_node(params);
+	master_build_arg_t build_arg;
 
-	memcpy(&th_arg_local, th_arg, sizeof(thread_arg_t));
+	set->scaled = 1;
 
-	free(th_arg);
+	build_arg.params = params;
+	build_arg.io = session->io;
+	build_arg.bias = NULL;
+	build_arg.hdu = hdu;
+	build_arg.bad_pixels = 0;
 
-	params = th_arg_local.cal_param;
+	set->bias = master_cache_acquire(session->cache, files->biases, MASTER_MEAN, hdu, 0, node,
+					stack_calibration_files, finish_master, &build_arg);
 
-	iterate_list_cb(th_arg_local.filelist, &calibrate_one_file, params,
-					th_arg_local.file_list_offset, th_arg_local.file_list_len, &params->run_flag);
+	set->bias_img = master_entry_image(set->bias, node);
 
-	return NULL;
+	if (!set->bias_img) {
+		return -1;
+	}
+
+	/* dark current depends on the bias as well, so its master is in the key */
+	build_arg.bias = set->bias_img;
+	build_arg.bad_pixels = params->badpix.mode != BADPIX_NONE;
+
+	set->dark = master_cache_acquire(session->cache, files->darks, MASTER_DARK_CURRENT, hdu,
+					master_entry_key(set->bias), node, stack_calibration_files, finish_master, &build_arg);
+
+	set->dark_img = master_entry_image(set->dark, node);
+
+	return set->dark_img ? 0 : -1;
 }
 
-void calibrate_files(calibrator_params_t *params)
+/*
+ * Finds the masters for the HDU of the image, they stay referenced until release_calibration_set()
+ */
+int acquire_calibration_set(calibrator_session_t *session, calibration_set_t *set, calibration_files_t *files, int hdu)
 {
-	int file_count = 0;
-	DIR *dp;
-	struct dirent *ep;
-	char *full_path = NULL;
-	long int cpucnt;
-	int files_per_cpu_int, left_files, i;
-	int file_list_offset_next = 0;
-	thread_arg_t *thread_params;
+	calibrator_params_t *params = session->params;
+	int node = worker_node(params);
+	master_build_arg_t build_arg;
 
-	params->logger_msg("Reading directory %s\n", params->inpath);
+	memset(set, 0, sizeof(calibration_set_t));
 
-	dp = opendir(params->inpath);
+	set->exptime = files->exptime;
+	set->dark_scale = files->exptime;
+	set->badpix_mode = params->badpix.mode;
 
-	if (dp == NULL) {
+	if (params->dark_scaling) {
+		return acquire_scaled_darks(session, set, files, hdu);
+	}
+
+	build_arg.params = params;
+	build_arg.io = session->io;
+	build_arg.bias = NULL;
+	build_arg.hdu = hdu;
+	build_arg.bad_pixels = params->badpix.mode != BADPIX_NONE;
+
+	set->dark = master_cache_acquire(session->cache, files->darks, MASTER_MEAN, hdu, 0, node,
+					stack_calibration_files, finish_master, &build_arg);
+
+	set->dark_img = master_entry_image(set->dark, node);
+
+	return set->dark_img ? 0 : -1;
+}
+
+void fit_calibration_set(calibrator_params_t *params, calibration_set_t *set, fits_handle_t *image, const char *src_file)
+{
+	double fitted, exptime = set->exptime;
+
+	if (!set->scaled) {
 		return;
 	}
 
-	while ((ep = readdir(dp))) {
-		if (strstr(ep->d_name, "fit") || strstr(ep->d_name, "FIT")) {
-			build_full_file_path(params->inpath, ep->d_name, &full_path);
+	set->dark_scale = exptime;
 
-			file_list = add_object_to_list(file_list, full_path);
+	fitted = fits_fit_dark_scale(image, set->bias_img, set->dark_img, DARK_FIT_SAMPLE_STEP);
 
-			free (full_path);
+	/* fit is trusted only near the nominal value, stars and cosmics can spoil it */
+	if (isfinite(fitted) && fitted > 0.5 * exptime && fitted < 2 * exptime) {
+		params->logger_msg("\tInfo: Dark scale for %s fitted to %.3f sec, exposure is %.3f sec\n", src_file, fitted, exptime);
+		set->dark_scale = fitted;
+	} else {
+		params->logger_msg("\tWarning: Dark scale fit failed for %s, using exposure time\n", src_file);
+	}
+}
 
-			file_count++;
-		}
+/*
+ * Master dark of the same exposure already contains the bias level,
+ *  so (image - bias) - (dark - bias) is just image - dark
+ */
+static void select_calibration_kernel(calibration_set_t *set, int input, calib_kernel_t *kernel)
+{
+	calib_kernel_select(kernel, input, set->scaled ? KERNEL_OPS_SCALED_DARK : KERNEL_OPS_DARK);
+}
+
+/*
+ * Calibrated rows [first_row, first_row + image->height) are stored to the image,
+ *  raw pixels are in the kernel input type, or are the image itself for F32
+ */
+static void apply_calibration_kernel(calibration_set_t *set, const calib_kernel_t *kernel,
+			const void *raw, fits_handle_t *image, int first_row)
+{
+	long offset = (long) first_row * image->width;
+
+	kernel->apply(raw, image->image, set->scaled ? set->bias_img->image + offset : NULL,
+					set->dark_img->image + offset, set->dark_scale, (long) image->width * image->height);
+
+	fits_correct_bad_pixels(image, set->dark_img, first_row, set->badpix_mode);
+}
+
+void apply_calibration_set(calibration_set_t *set, fits_handle_t *image, int first_row)
+{
+	calib_kernel_t kernel;
+
+	select_calibration_kernel(set, KERNEL_IN_F32, &kernel);
+
+	apply_calibration_kernel(set, &kernel, image->image, image, first_row);
+}
+
+int calibration_set_matches(calibration_set_t *set, fits_handle_t *image)
+{
+	if (set->dark_img->width != image->width || set->dark_img->height != image->height) {
+		return 0;
 	}
 
-	closedir (dp);
+	if (set->scaled && (set->bias_img->width != image->width || set->bias_img->height != image->height)) {
+		return 0;
+	}
 
-	if (file_count == 0) {
-		params->logger_msg("Can't find fits files, sorry\n");
-		free_list(file_list);
-		file_list = NULL;
-		return;
+	return 1;
+}
+
+void release_calibration_set(calibration_set_t *set)
+{
+	master_cache_release(set->dark);
+	master_cache_release(set->bias);
+
+	memset(set, 0, sizeof(calibration_set_t));
+}
+
+/*
+ * Strip size is picked so the image, dark and bias strips fit a half of the L2 cache
+ */
+static int strip_rows_count(calibrator_params_t *params, int width)
+{
+	long cache_size, rows;
+
+	if (params->strip_rows > 0) {
+		return params->strip_rows;
 	}
 
-	cpucnt = sysconf(_SC_NPROCESSORS_ONLN);
+	cache_size = sysconf(_SC_LEVEL2_CACHE_SIZE);
 
-	params->logger_msg("\nStarting calibrator on %li processor cores with %i tasks by core...\n", cpucnt, params->jobs_count);
+	if (cache_size <= 0) {
+		cache_size = DEFAULT_L2_CACHE_SIZE;
+	}
+
+	rows = cache_size / 2 / (3 * sizeof(float) * (long) width);
+
+	return rows > 0 ? rows : 1;
+}
+
+static int write_output_rows(calibration_job_t *job, fits_handle_t *image, long plane,
+			int first_row, int rows, float *pixels)
+{
+	struct timespec io_start;
+	int status;
+	fitsfile *own_fptr = image->new_fptr;
+
+	io_begin(job->write_dev, IO_WRITE, &io_start);
+
+	pthread_mutex_lock(&job->output_lock);
+
+	image->new_fptr = job->output->new_fptr;
 
-	cpucnt *= params->jobs_count;
+	status = fits_write_rows(image, plane, first_row, rows, pixels);
 
-	USER_TIMEZONE = getenv("TZ");
+	image->new_fptr = own_fptr;
 
-	if (USER_TIMEZONE) {
-		USER_TIMEZONE = strdup(USER_TIMEZONE);
+	fits_write_behind(job->output, plane_bytes(image, rows, image->out_bitpix));
+
+	pthread_mutex_unlock(&job->output_lock);
+
+	io_end(job->write_dev, IO_WRITE, &io_start,
+				plane_bytes(image, rows, image->out_bitpix ? image->out_bitpix : image->bitpix));
+
+	return status;
+}
+
+/* preview shows the first plane of the cube */
+static void collect_products(hdu_products_t *products, long plane, int first_row, int rows,
+			const float *pixels, int width)
+{
+	if (products->stats) {
+		frame_stats_add(products->stats, pixels, (long) width * rows);
+	}
+
+	if (products->preview && plane == 0) {
+		preview_add_rows(products->preview, pixels, first_row, rows);
 	}
+}
 
-	setenv("TZ", "", 1);
-	tzset();
+/*
+ * Reads, calibrates and writes the image by strips of rows,
+ *  so only one strip of the image is in the memory at once
+ */
+int calibrate_by_strips(calibration_job_t *job, fits_handle_t *fits_image, calibration_set_t *set, hdu_products_t *products)
+{
+	int row, rows, strip_rows, status = 0;
+	long plane;
+	fits_handle_t *strip;
+	calib_kernel_t kernel;
+	struct timespec io_start;
+	void *raw = NULL;
 
+	strip_rows = strip_rows_count(job->params, fits_image->width);
 
-	if (cpucnt > file_count) {
-		files_per_cpu_int = 1;
-		left_files = 0;
-	} else {
-		files_per_cpu_int = file_count / cpucnt;
-		left_files = file_count % cpucnt;
+	if (strip_rows > fits_image->height) {
+		strip_rows = fits_image->height;
 	}
 
-	params->logger_msg("Total files to calibrate: %i\n", file_count);
-	params->logger_msg("Files per CPU core: %i, left: %i\n", files_per_cpu_int, left_files);
+	strip = fits_handler_mem_new(&status);
+
+	if (!strip) {
+		return status;
+	}
+
+	status = fits_create_image_mem(strip, fits_image->width, strip_rows);
 
-	total_files_counter = file_count;
+	/* overscan is subtracted by the reader in float, other frames are read in the file type */
+	select_calibration_kernel(set, fits_image->has_overscan || fits_image->trimmed ?
+				KERNEL_IN_F32 : kernel_input_for_bitpix(fits_image->bitpix), &kernel);
 
-	init_thread_pool(cpucnt);
+	if (status == 0 && kernel.input != KERNEL_IN_F32) {
+		raw = malloc((size_t) strip_rows * fits_image->width * kernel.pixel_size);
 
-	for (i = 0; i < cpucnt; i++) {
-		thread_params = (thread_arg_t*) malloc(sizeof(thread_arg_t));
+		if (!raw) {
+			status = -ENOMEM;
+		}
+	}
+
+	for (plane = 0; plane < fits_image->planes && status == 0; plane++) {
+		for (row = 0; row < fits_image->height && status == 0; row += rows) {
+			rows = min(strip_rows, fits_image->height - row);
+
+			strip->height = rows;
+
+			io_begin(job->read_dev, IO_READ, &io_start);
+
+			if (raw) {
+				status = fits_read_rows_raw(fits_image, plane, row, rows, kernel.datatype, raw);
+
+				if (status == 0 && fits_image->saturation > 0) {
+					fits_image->saturated += kernel.count_saturated(raw, fits_image->saturation,
+														(long) strip->width * rows);
+				}
+			} else {
+				status = fits_read_rows(fits_image, plane, row, rows, strip->image);
+			}
 
-		thread_params->cal_param = params;
-		thread_params->filelist = file_list;
+			io_end(job->read_dev, IO_READ, &io_start, plane_bytes(fits_image, rows, fits_image->bitpix));
 
-		thread_params->file_list_offset = file_list_offset_next;
-		thread_params->file_list_len = files_per_cpu_int;
+			if (status == 0) {
+				apply_calibration_kernel(set, &kernel, raw ? raw : strip->image, strip, row);
 
-		if (i == cpucnt - 1) {
-			thread_params->file_list_len += left_files;
+				collect_products(products, plane, row, rows, strip->image, strip->width);
+
+				status = write_output_rows(job, fits_image, plane, row, rows, strip->image);
+			}
 		}
- 
-		thread_pool_add_task(thread_func, thread_params);
+	}
+
+	free(raw);
+
+	fits_free_image(strip);
+	fits_handler_free(strip);
+
+	return status;
+}
+
+/*
+ * Cosmic rays detection works in electrons, detector gain and read noise are
+ *  taken from the header when present
+ */
+void setup_cosmic_rays(calibrator_params_t *params, fits_handle_t *fits_image, cr_params_t *cr)
+{
+	double val;
+
+	*cr = params->crreject;
+
+	val = fits_get_gain(fits_image);
+	cr->gain = isnan(val) ? CR_DEFAULT_GAIN : val;
+
+	val = fits_get_readnoise(fits_image);
+	cr->readnoise = isnan(val) ? CR_DEFAULT_READNOISE : val;
+}
+
+int calibrate_whole_frames(calibration_job_t *job, fits_handle_t *fits_image, calibration_set_t *set, hdu_products_t *products)
+{
+	int status = 0;
+	long plane, cleaned;
+	cr_params_t cr;
+
+	if (job->params->crreject.sigclip > 0) {
+		setup_cosmic_rays(job->params, fits_image, &cr);
+	}
+
+	for (plane = 0; plane < fits_image->planes && status == 0; plane++) {
+		status = load_plane(job->read_dev, fits_image, plane);
+
+		if (status == 0) {
+			if (job->params->dark_fit) {
+				fit_calibration_set(job->params, set, fits_image, job->file);
+			}
+
+			apply_calibration_set(set, fits_image, 0);
 
-		file_list_offset_next += files_per_cpu_int;
+			if (job->params->crreject.sigclip > 0) {
+				cleaned = cr_reject(fits_image, &cr, job->session->pool);
+
+				if (cleaned < 0) {
+					status = (int)cleaned;
+					break;
+				}
+
+				job->params->logger_msg("Info: %li cosmic ray pixels cleaned in %s\n", cleaned, job->file);
+			}
+
+			collect_products(products, plane, 0, fits_image->height, fits_image->image, fits_image->width);
+
+			status = write_output_rows(job, fits_image, plane, 0, fits_image->height, fits_image->image);
+		}
 	}
+
+	fits_free_image(fits_image);
+	fits_image->image = NULL;
+
+	return status;
 }
 
-void calibrator_stop(calibrator_params_t *params)
+static int write_output_stats(calibration_job_t *job, int hdu, frame_stats_t *stats)
 {
-	params->run_flag = 0;
+	calibrator_session_t *session = job->session;
+	int status = 0;
 
-	cleanup_thread_pool();
+	pthread_mutex_lock(&job->output_lock);
 
-	if (file_list) {
-		free_list(file_list);
-		file_list = NULL;
+	if (job->stats_cb) {
+		job->stats_cb(job->stats_arg, hdu, stats);
 	}
 
-	if (USER_TIMEZONE) {
-		setenv("TZ", USER_TIMEZONE, 1);
-		free(USER_TIMEZONE);
-		USER_TIMEZONE = NULL;
-	} else {
-		unsetenv("TZ");
+	if (session->qa_summary) {
+		status = frame_stats_write_keys(job->output, hdu, stats);
+	}
+
+	pthread_mutex_unlock(&job->output_lock);
+
+	if (!session->qa_summary) {
+		return status;
 	}
 
-	tzset();
+	pthread_mutex_lock(&session->lock);
+
+	frame_stats_print(session->qa_summary, session->qa_json, session->qa_rows == 0, job->file, hdu, stats);
+	session->qa_rows++;
+
+	pthread_mutex_unlock(&session->lock);
+
+	return status;
 }
 
+/*
+ * Preview goes next to the resulting file, HDUs after the primary get the suffix
+ */
+static void save_preview(calibration_job_t *job, int hdu, preview_t *preview)
+{
+	calibrator_params_t *params = job->params;
+	const char *ext = preview_file_ext(params->preview_format);
+	const char *base = strrchr(job->save_path, '/');
+	const char *dot;
+	char *path;
+	size_t stem;
+	int status;
+
+	base = base ? base + 1 : job->save_path;
+	dot = strrchr(base, '.');
+	stem = dot ? (size_t) (dot - job->save_path) : strlen(job->save_path);
+
+	path = (char*) malloc(stem + strlen(ext) + 16);
+
+	if (!path) {
+		return;
+	}
+
+	if (hdu > 1) {
+		sprintf(path, "%.*s_hdu%i%s", (int) stem, job->save_path, hdu, ext);
+	} else {
+		sprintf(path, "%.*s%s", (int) stem, job->save_path, ext);
+	}
+
+	status = preview_save(preview, path, params->preview_format);
+
+	if (status != 0) {
+		params->logger_msg("Warning: unable to save preview %s: %s\n", path, strerror(-status));
+	}
+
+	free(path);
+}
+
+/*
+ * Quality statistics and preview are accumulated by the same strips or frames,
+ *  right after they are calibrated and before they are written
+ */
+int calibrate_hdu_frames(calibration_job_t *job, fits_handle_t *fits_image, calibration_set_t *set, int hdu)
+{
+	calibrator_params_t *params = job->params;
+	hdu_products_t products = { NULL, NULL };
+	frame_stats_t stats;
+	preview_t preview;
+	int status = 0;
+
+	if (job->session->qa_summary || job->stats_cb) {
+		status = frame_stats_init(&stats, fits_image);
+		products.stats = &stats;
+
+		fits_image->saturation = fits_get_saturation(fits_image);
+		fits_image->saturated = 0;
+	}
+
+	if (status == 0 && params->preview_format != PREVIEW_NONE) {
+		status = preview_init(&preview, fits_image->width, fits_image->height, params->preview_size);
+		products.preview = &preview;
+	}
+
+	if (status == 0) {
+		if (params->strip_rows >= 0 && !params->dark_fit && params->crreject.sigclip <= 0) {
+			/* dark scale fit and cosmic rays cleaning need the whole frame before the first strip is written */
+			status = calibrate_by_strips(job, fits_image, set, &products);
+		} else {
+			status = calibrate_whole_frames(job, fits_image, set, &products);
+		}
+	}
+
+	if (products.stats) {
+		if (status == 0) {
+			stats.saturated = fits_image->saturated;
+
+			frame_stats_finish(&stats);
+
+			status = write_output_stats(job, hdu, &stats);
+		}
+
+		frame_stats_free(&stats);
+	}
+
+	if (products.preview) {
+		if (status == 0) {
+			save_preview(job, hdu, &preview);
+		}
+
+		preview_free(&preview);
+	}
+
+	return status;
+}
+
+/*
+ * Image HDU is calibrated with its own masters,
+ *  every plane of the cube is calibrated as a separate frame
+ */
+int calibrate_hdu(calibration_job_t *job, fits_handle_t *fits_image, int hdu)
+{
+	calibrator_params_t *params = job->params;
+	calibration_set_t cal_set;
+	int status;
+
+	fits_image->overscan = &params->overscan;
+
+	status = fits_select_hdu(fits_image, hdu);
+
+	if (status != 0) {
+		return status;
+	}
+
+	if (acquire_calibration_set(job->session, &cal_set, job->cal_files, hdu) != 0) {
+		params->logger_msg("Warning: no calibration frames for HDU %i of %s\n", hdu, job->file);
+		status = -ENOENT;
+	} else if (!calibration_set_matches(&cal_set, fits_image)) {
+		params->logger_msg("Warning: size of %s HDU %i doesn't match the calibration frames\n", job->file, hdu);
+		status = -EFAULT;
+	} else {
+		status = calibrate_hdu_frames(job, fits_image, &cal_set, hdu);
+	}
+
+	release_calibration_set(&cal_set);
+
+	return status;
+}
+
+/*
+ * Extensions are read through their own handles, cfitsio handle can't be shared between threads
+ */
+void *calibrate_hdu_task(void *arg)
+{
+	hdu_task_t *task = (hdu_task_t *) arg;
+	fits_handle_t *fits_image;
+	char err_buf[32] = { 0 };
+	int status = 0;
+
+	if (!task->job->params->run_flag) {
+		task->status = -EINTR;
+		return NULL;
+	}
+
+	fits_image = fits_handler_new(task->job->file, &status);
+
+	if (status == 0) {
+		fits_set_raw_io(fits_image, task->job->params->raw_io);
+		fits_set_cache_policy(fits_image, task->job->params->drop_cache, 0);
+		status = calibrate_hdu(task->job, fits_image, task->hdu);
+	} else {
+		fits_get_status_code_msg(status, err_buf);
+		task->job->params->logger_msg("\nUnable to process %s error: %s\n", task->job->file, err_buf);
+	}
+
+	fits_handler_free(fits_image);
+
+	task->status = status;
+
+	return NULL;
+}
+
+/*
+ * Output repeats the structure of the source file, then image HDUs are calibrated in parallel
+ */
+int calibrate_image_hdus(calibration_job_t *job, fits_handle_t *fits_image, const char *save_path, const char *comment)
+{
+	int hdu, hdus_count, image_hdus = 0, last_image_hdu = 0, status, close_status;
+	hdu_task_t *tasks;
+	thread_group_t group;
+	struct timespec io_start;
+
+	hdus_count = fits_get_hdus_count(fits_image);
+
+	/* output HDUs take the trimmed geometry */
+	fits_image->overscan = &job->params->overscan;
+
+	tasks = (hdu_task_t *) calloc(hdus_count > 0 ? hdus_count : 1, sizeof(hdu_task_t));
+
+	if (!tasks) {
+		return -errno;
+	}
+
+	status = fits_create_new_file(fits_image, save_path);
+
+	for (hdu = 1; hdu <= hdus_count && status == 0; hdu++) {
+		status = fits_select_hdu(fits_image, hdu);
+
+		if (status == 0) {
+			status = fits_add_new_hdu(fits_image, comment, &job->params->out_format);
+		}
+
+		if (status == 0 && fits_is_image_hdu(fits_image) && job->session->qa_summary) {
+			status = frame_stats_reserve_keys(fits_image);
+		}
+
+		if (status == 0 && fits_is_image_hdu(fits_image)) {
+			tasks[image_hdus].job = job;
+			tasks[image_hdus].hdu = hdu;
+			image_hdus++;
+
+			last_image_hdu = hdu;
+		}
+	}
+
+	if (status == 0 && image_hdus == 0) {
+		status = -ENOENT;
+	}
+
+	job->output = fits_image;
+
+	if (status == 0 && image_hdus == 1) {
+		/* single image is calibrated by this thread with the already opened file */
+		status = calibrate_hdu(job, fits_image, last_image_hdu);
+	} else if (status == 0) {
+		thread_group_init(&group, job->session->pool);
+
+		for (hdu = 0; hdu < image_hdus; hdu++) {
+			thread_pool_add_group_task(&group, calibrate_hdu_task, &tasks[hdu]);
+		}
+
+		thread_pool_wait_group(&group);
+
+		for (hdu = 0; hdu < image_hdus && status == 0; hdu++) {
+			status = tasks[hdu].status;
+		}
+	}
+
+	if (fits_image->new_fptr) {
+		/* rest of the cfitsio buffers is written by the close */
+		io_begin(job->write_dev, IO_WRITE, &io_start);
+
+		close_status = fits_close_new_file(fits_image);
+
+		io_end(job->write_dev, IO_WRITE, &io_start, 0);
+
+		if (status == 0) {
+			status = close_status;
+		}
+	}
+
+	/* partially calibrated file must not be taken as done by the next run */
+	if (status != 0) {
+		unlink(save_path);
+	}
+
+	free(tasks);
+
+	return status;
+}
+
+static void file_done(calibrator_session_t *session)
+{
+	pthread_mutex_lock(&session->lock);
+
+	session->total_files_counter--;
+
+	if (session->total_files_counter == 0 && session->params->complete) {
+		session->params->complete();
+	}
+
+	pthread_mutex_unlock(&session->lock);
+}
+
+/*
+ * Calibration frames pinned by the manifest are taken as is, without matching by the header
+ */
+static int pin_calibration_frames(calibrator_params_t *params, calibration_files_t *files,
+			const calibration_files_t *pinned, const char *src_file, double exptime)
+{
+	*files = *pinned;
+
+	files->exptime = exptime;
+
+	if (params->dark_scaling && files->bias_count == 0) {
+		params->logger_msg("\tWarning: Dark scaling requires bias frames, none pinned for %s\n", src_file);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Calibrates one file into save_path, existing output is never overwritten
+ */
+static int calibrate_file_with(calibrator_session_t *session, const char *file, const char *save_path,
+			const calibration_files_t *pinned, hdu_stats_cb stats_cb, void *stats_arg)
+{
+	char err_buf[32] = { 0 };
+	char object[76] = { 0 };
+	char comment[72] = { 0 };
+	int status = 0;
+	time_t image_time;
+	double image_exptime, image_temp;
+	fits_handle_t *fits_image;
+	calibration_files_t cal_files;
+	calibration_job_t job;
+	calibrator_params_t *params = session->params;
+
+	params->logger_msg("\nWorking %s\n", file);
+
+	if (is_file_exist((char*) save_path)) {
+		params->logger_msg("File %s is already exists, skipping calibration\n", save_path);
+
+		return -EEXIST;
+	}
+
+	fits_image = fits_handler_new(file, &status);
+
+	if (status != 0) {
+		fits_get_status_code_msg(status, err_buf);
+		params->logger_msg("\nUnable to process %s error: %s\n", file, err_buf);
+		fits_handler_free(fits_image);
+
+		return status;
+	}
+
+	/* the same handle writes the output */
+	fits_set_cache_policy(fits_image, params->drop_cache, params->write_behind);
+
+	image_time = fits_get_observation_dt(fits_image);
+	fits_get_object_name(fits_image, object);
+	image_exptime = fits_get_object_exptime(fits_image);
+	image_temp = fits_get_ccd_temperature(fits_image);
+
+	if (pinned || strlen(params->darkpath) > 0) {
+		if (pinned) {
+			status = pin_calibration_frames(params, &cal_files, pinned, file, image_exptime);
+		} else {
+			status = select_calibration_frames(params, &cal_files, file, image_time, image_exptime, image_temp);
+		}
+
+		if (status == 0) {
+
+			if (params->dark_scaling) {
+				snprintf(comment, sizeof(comment), "Calibrated: %i scaled darks, %i bias",
+							cal_files.dark_count, cal_files.bias_count);
+			} else {
+				snprintf(comment, sizeof(comment), "Calibrated: %i darks", cal_files.dark_count);
+			}
+
+			job.session = session;
+			job.params = params;
+			job.file = file;
+			job.cal_files = &cal_files;
+			job.save_path = save_path;
+			job.read_dev = io_limiter_device(session->io, file);
+			job.write_dev = io_limiter_device(session->io, save_path);
+			job.output = NULL;
+			job.stats_cb = stats_cb;
+			job.stats_arg = stats_arg;
+
+			pthread_mutex_init(&job.output_lock, NULL);
+
+			status = calibrate_image_hdus(&job, fits_image, save_path, comment);
+
+			pthread_mutex_destroy(&job.output_lock);
+
+			if (status == 0) {
+				params->logger_msg("Info: %s is %s\n", file, comment);
+			} else {
+				fits_get_status_code_msg(status, err_buf);
+				params->logger_msg("Warning: %s WASN'T calibrated, error: %s\n", file, err_buf);
+			}
+		} else {
+			params->logger_msg("Warning: %s WASN'T calibrated\n", file);
+			status = -ENOENT;
+		}
+
+		/* pinned lists belong to the caller */
+		if (!pinned) {
+			release_calibration_frames(&cal_files);
+		}
+	} else {
+		params->logger_msg("Warning: %s WASN'T calibrated, no darks are pinned and no dark directory is set\n", file);
+		status = -EINVAL;
+	}
+
+	fits_handler_free(fits_image);
+
+	return status;
+}
+
+int calibrate_file(calibrator_session_t *session, const char *file, const char *save_path)
+{
+	return calibrate_file_with(session, file, save_path, NULL, NULL, NULL);
+}
+
+int calibrate_file_stats(calibrator_session_t *session, const char *file, const char *save_path,
+			hdu_stats_cb stats_cb, void *stats_arg)
+{
+	return calibrate_file_with(session, file, save_path, NULL, stats_cb, stats_arg);
+}
+
+/*
+ * With the claim directory the file is calibrated by the instance which claimed it first
+ */
+static int calibrate_claimed_file(calibrator_session_t *session, const char *file, const char *save_path,
+			const calibration_files_t *pinned)
+{
+	calibrator_params_t *params = session->params;
+	int status;
+
+	if (!params->claimpath[0]) {
+		return calibrate_file_with(session, file, save_path, pinned, NULL, NULL);
+	}
+
+	status = work_claim(params->claimpath, file, save_path, params->claim_timeout);
+
+	if (status == -EBUSY || status == -EALREADY) {
+		params->logger_msg("File %s is %s, skipping calibration\n", file,
+					status == -EBUSY ? "claimed by another instance" : "already done");
+		return status;
+	}
+
+	if (status != 0) {
+		params->logger_msg("Warning: unable to claim %s: %s\n", file, strerror(-status));
+		return status;
+	}
+
+	status = calibrate_file_with(session, file, save_path, pinned, NULL, NULL);
+
+	/* existing output was made by the earlier run */
+	work_claim_release(params->claimpath, file, save_path, status == 0 || status == -EEXIST);
+
+	return status;
+}
+
+void calibrate_one_file(calibrator_session_t *session, const char *file)
+{
+	char *save_path = NULL;
+
+	build_full_file_path(session->params->outpath, basename((char*)file), &save_path);
+
+	calibrate_claimed_file(session, file, save_path, NULL);
+
+	free(save_path);
+
+	file_done(session);
+}
+
+void *file_task_func(void *arg)
+{
+	file_task_t *task = (file_task_t *) arg;
+
+	if (task->session->params->run_flag) {
+		calibrate_one_file(task->session, task->file);
+	}
+
+	free(task);
+
+	return NULL;
+}
+
+/*
+ * Options which change the masters made of the same files
+ */
+static uint64_t masters_variant(calibrator_params_t *params)
+{
+	uint64_t variant = 0, bits;
+
+	if (params->overscan.mode != OVERSCAN_NONE) {
+		variant = ((uint64_t) params->overscan.mode << 8) | (params->overscan.fit_order + 1);
+	}
+
+	/* masters carry the bad pixels mask made with these thresholds */
+	if (params->badpix.mode != BADPIX_NONE) {
+		memcpy(&bits, &params->badpix.hot_sigma, sizeof(bits));
+		variant = variant * 31 + bits;
+
+		memcpy(&bits, &params->badpix.dead_fraction, sizeof(bits));
+		variant = variant * 31 + bits;
+	}
+
+	return variant;
+}
+
+static int is_json_path(const char *path)
+{
+	size_t len = strlen(path);
+
+	return len > 5 && strcasecmp(path + len - 5, ".json") == 0;
+}
+
+/*
+ * Masters are cached by the session, so they are shared by the files and buffers it calibrates
+ */
+calibrator_session_t *calibrator_session_new(calibrator_params_t *params)
+{
+	calibrator_session_t *session = (calibrator_session_t *) calloc(1, sizeof(calibrator_session_t));
+
+	if (!session) {
+		return NULL;
+	}
+
+	session->params = params;
+
+	session->cache = master_cache_new(params->cache_mem_limit, params->pin_threads, params->cachepath,
+				params->cache_disk_limit, masters_variant(params), params->incremental);
+
+	if (!session->cache) {
+		free(session);
+		return NULL;
+	}
+
+	/* without the limits every thread does its own I/O */
+	if (params->io_read_permits > 0 || params->io_write_permits > 0 || params->io_adaptive) {
+		session->io = io_limiter_new(params->io_read_permits, params->io_write_permits, params->io_adaptive);
+
+		if (!session->io) {
+			master_cache_free(session->cache);
+			free(session);
+			return NULL;
+		}
+	}
+
+	pthread_mutex_init(&session->lock, NULL);
+
+	return session;
+}
+
+/* same order as the pool queue, readdir order among the equal files */
+static int compare_file_tasks(const void *a, const void *b)
+{
+	const file_task_t *ta = *(const file_task_t **) a;
+	const file_task_t *tb = *(const file_task_t **) b;
+
+	if (ta->priority != tb->priority) {
+		return ta->priority > tb->priority ? -1 : 1;
+	}
+
+	if (ta->deadline != tb->deadline) {
+		if (!ta->deadline || !tb->deadline) {
+			return ta->deadline ? -1 : 1;
+		}
+
+		return ta->deadline < tb->deadline ? -1 : 1;
+	}
+
+	return ta->order - tb->order;
+}
+
+/*
+ * Starts jobs_count workers by processor core of the process affinity mask,
+ *  they are shared by all the requests of the session
+ */
+int calibrator_start(calibrator_session_t *session)
+{
+	calibrator_params_t *params = session->params;
+	long int cpucnt;
+	size_t started;
+
+	if (session->pool) {
+		return 0;
+	}
+
+	cpucnt = (long) cpu_topology_cpus_count() * params->jobs_count;
+	cpucnt = cpucnt > 0 ? cpucnt : 1;
+
+	session->pool = thread_pool_new(cpucnt, params->pin_threads);
+
+	if (!session->pool) {
+		return -ENOMEM;
+	}
+
+	started = thread_pool_threads(session->pool);
+
+	if (started < (size_t) cpucnt) {
+		params->logger_msg("\tWarning: Only %zu of %li worker threads are started\n", started, cpucnt);
+	}
+
+	if (started == 0) {
+		thread_pool_free(session->pool);
+		session->pool = NULL;
+
+		return -EAGAIN;
+	}
+
+	return 0;
+}
+
+thread_pool_t *calibrator_session_pool(calibrator_session_t *session)
+{
+	return session->pool;
+}
+
+static void open_qa_summary(calibrator_session_t *session)
+{
+	calibrator_params_t *params = session->params;
+
+	if (!params->qapath[0] || session->qa_summary) {
+		return;
+	}
+
+	session->qa_summary = fopen(params->qapath, "w");
+
+	if (session->qa_summary) {
+		session->qa_json = is_json_path(params->qapath);
+		session->qa_rows = 0;
+		frame_stats_print_header(session->qa_summary, session->qa_json);
+	} else {
+		params->logger_msg("Warning: unable to create QA summary %s: %s\n", params->qapath, strerror(errno));
+	}
+}
+
+/*
+ * Returns the number of the queued files, params->complete() is called when all of them are done
+ */
+static void free_file_tasks(file_task_t **tasks, int count)
+{
+	int i;
+
+	for (i = 0; i < count; ++i) {
+		free(tasks[i]);
+	}
+
+	free(tasks);
+}
+
+int calibrate_files(calibrator_session_t *session)
+{
+	calibrator_params_t *params = session->params;
+	int file_count = 0, status;
+	DIR *dp;
+	struct dirent *ep;
+	char *full_path = NULL;
+	long int cpucnt;
+	list_node_t *tmp;
+	file_task_t *task, **tasks;
+	int i;
+
+	params->logger_msg("Reading directory %s\n", params->inpath);
+
+	dp = opendir(params->inpath);
+
+	if (dp == NULL) {
+		return -errno;
+	}
+
+	while ((ep = readdir(dp))) {
+		if ((strstr(ep->d_name, "fit") || strstr(ep->d_name, "FIT"))
+				&& work_shard_match(ep->d_name, params->shard_index, params->shard_count)) {
+			build_full_file_path(params->inpath, ep->d_name, &full_path);
+
+			session->file_list = add_object_to_list(session->file_list, full_path);
+
+			free (full_path);
+
+			file_count++;
+		}
+	}
+
+	closedir (dp);
+
+	if (file_count == 0) {
+		params->logger_msg("Can't find fits files, sorry\n");
+		free_list(session->file_list);
+		session->file_list = NULL;
+		return 0;
+	}
+
+	/* tasks are ready before the workers start, the session is complete only when all of them are done */
+	tasks = (file_task_t **) malloc(file_count * sizeof(file_task_t *));
+
+	if (!tasks) {
+		return -ENOMEM;
+	}
+
+	for (tmp = session->file_list, i = 0; tmp; tmp = tmp->next, ++i) {
+		task = (file_task_t *) malloc(sizeof(file_task_t));
+
+		if (!task) {
+			free_file_tasks(tasks, i);
+			return -ENOMEM;
+		}
+
+		task->session = session;
+		task->file = tmp->object;
+		task->order = i;
+
+		priority_of_file(&params->priority, task->file, &task->priority, &task->deadline);
+
+		tasks[i] = task;
+	}
+
+	/* first workers start right away, so the urgent files must be queued first as well */
+	qsort(tasks, file_count, sizeof(file_task_t *), compare_file_tasks);
+
+	cpucnt = cpu_topology_cpus_count();
+
+	params->logger_msg("\nStarting calibrator on %li processor cores with %i tasks by core...\n", cpucnt, params->jobs_count);
+
+	params->logger_msg("Total files to calibrate: %i\n", file_count);
+
+	session->total_files_counter = file_count;
+
+	open_qa_summary(session);
+
+	status = calibrator_start(session);
+
+	if (status != 0) {
+		params->logger_msg("Unable to start the workers: %s\n", strerror(-status));
+		free_file_tasks(tasks, file_count);
+		return status;
+	}
+
+	/* workers take the files from the queue, so the slow files don't stall the others */
+	for (i = 0; i < file_count; ++i) {
+		thread_pool_add_task_prio(session->pool, file_task_func, tasks[i], tasks[i]->priority, tasks[i]->deadline);
+	}
+
+	free(tasks);
+
+	return file_count;
+}
+
+void *manifest_task_func(void *arg)
+{
+	manifest_task_t *task = (manifest_task_t *) arg;
+
+	if (task->session->params->run_flag) {
+		calibrate_claimed_file(task->session, task->file, task->save_path,
+					task->pinned.dark_count > 0 ? &task->pinned : NULL);
+	}
+
+	file_done(task->session);
+
+	release_calibration_frames(&task->pinned);
+	free(task->save_path);
+	free(task->file);
+	free(task);
+
+	return NULL;
+}
+
+static char *trim_field(char *field)
+{
+	char *end;
+
+	while (*field == ' ' || *field == '\t') {
+		field++;
+	}
+
+	end = field + strlen(field);
+
+	while (end > field && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r' || end[-1] == '\n')) {
+		*--end = '\0';
+	}
+
+	return field;
+}
+
+/* files of the list are separated by ';' */
+static int parse_file_list(char *field, list_node_t **list)
+{
+	char *saveptr = NULL, *file;
+	int count = 0;
+
+	for (file = strtok_r(field, ";", &saveptr); file; file = strtok_r(NULL, ";", &saveptr)) {
+		file = trim_field(file);
+
+		if (*file) {
+			*list = add_object_to_list(*list, file);
+			count++;
+		}
+	}
+
+	return count;
+}
+
+/*
+ * input[,output[,darks[,biases[,priority[,deadline]]]]], empty output goes to the output directory
+ *  by the input name, single pinned dark may be the ready master. Priority and deadline (UTC seconds)
+ *  of the line replace the ones of the rules
+ */
+static manifest_task_t *parse_manifest_line(calibrator_session_t *session, char *line, long line_no)
+{
+	calibrator_params_t *params = session->params;
+	char *fields[6] = { NULL, NULL, NULL, NULL, NULL, NULL };
+	manifest_task_t *task;
+	int i;
+
+	for (i = 0; i < 6 && line; ++i) {
+		fields[i] = trim_field(strsep(&line, ","));
+	}
+
+	if (!fields[0][0] || fields[0][0] == '#' || strcmp(fields[0], "input") == 0) {
+		return NULL;
+	}
+
+	if (!work_shard_match(fields[0], params->shard_index, params->shard_count)) {
+		return NULL;
+	}
+
+	if ((!fields[1] || !fields[1][0]) && !params->outpath[0]) {
+		params->logger_msg("Warning: manifest line %li has no output and no output directory is set\n", line_no);
+		return NULL;
+	}
+
+	if ((!fields[2] || !fields[2][0]) && !params->darkpath[0]) {
+		params->logger_msg("Warning: manifest line %li has no darks and no dark directory is set\n", line_no);
+		return NULL;
+	}
+
+	task = (manifest_task_t *) calloc(1, sizeof(manifest_task_t));
+
+	if (!task) {
+		return NULL;
+	}
+
+	task->session = session;
+	task->file = strdup(fields[0]);
+
+	if (fields[1] && fields[1][0]) {
+		task->save_path = strdup(fields[1]);
+	} else {
+		build_full_file_path(params->outpath, basename(fields[0]), &task->save_path);
+	}
+
+	if (fields[2]) {
+		task->pinned.dark_count = parse_file_list(fields[2], &task->pinned.darks);
+	}
+
+	if (fields[3]) {
+		task->pinned.bias_count = parse_file_list(fields[3], &task->pinned.biases);
+	}
+
+	priority_of_file(&params->priority, task->file, &task->priority, &task->deadline);
+
+	if (fields[4] && fields[4][0]) {
+		task->priority = atoi(fields[4]);
+	}
+
+	if (fields[5] && fields[5][0]) {
+		task->deadline = atol(fields[5]);
+	}
+
+	return task;
+}
+
+/*
+ * Jobs are queued while the manifest is read, without the directory scan and calibration files matching.
+ *  Reader holds one count of the files counter, so params->complete() isn't called before the end of the manifest
+ */
+int calibrate_manifest(calibrator_session_t *session, const char *path)
+{
+	calibrator_params_t *params = session->params;
+	manifest_task_t *task;
+	char *line = NULL;
+	size_t line_size = 0;
+	long line_no = 0;
+	int job_count = 0, status;
+	FILE *manifest;
+
+	manifest = fopen(path, "r");
+
+	if (!manifest) {
+		return -errno;
+	}
+
+	status = calibrator_start(session);
+
+	if (status != 0) {
+		fclose(manifest);
+		return status;
+	}
+
+	open_qa_summary(session);
+
+	pthread_mutex_lock(&session->lock);
+	session->total_files_counter++;
+	pthread_mutex_unlock(&session->lock);
+
+	while (getline(&line, &line_size, manifest) > 0 && params->run_flag) {
+		task = parse_manifest_line(session, line, ++line_no);
+
+		if (!task) {
+			continue;
+		}
+
+		if (!task->file || !task->save_path) {
+			release_calibration_frames(&task->pinned);
+			free(task->save_path);
+			free(task->file);
+			free(task);
+			continue;
+		}
+
+		pthread_mutex_lock(&session->lock);
+		session->total_files_counter++;
+		pthread_mutex_unlock(&session->lock);
+
+		thread_pool_add_task_prio(session->pool, manifest_task_func, task, task->priority, task->deadline);
+
+		job_count++;
+	}
+
+	free(line);
+	fclose(manifest);
+
+	params->logger_msg("Total files to calibrate: %i\n", job_count);
+
+	file_done(session);
+
+	return job_count;
+}
+
+static void load_buffer_pixels(const void *pixels, int pixel_type, float *result, long n)
+{
+	long i;
+
+	switch (pixel_type) {
+		case KERNEL_IN_U16:
+			for (i = 0; i < n; ++i) {
+				result[i] = ((const uint16_t *) pixels)[i];
+			}
+			break;
+
+		case KERNEL_IN_I16:
+			for (i = 0; i < n; ++i) {
+				result[i] = ((const int16_t *) pixels)[i];
+			}
+			break;
+
+		case KERNEL_IN_I32:
+			for (i = 0; i < n; ++i) {
+				result[i] = ((const int32_t *) pixels)[i];
+			}
+			break;
+
+		default:
+			if (pixels != result) {
+				memcpy(result, pixels, n * sizeof(float));
+			}
+			break;
+	}
+}
+
+/*
+ * Calibrates the frame which is already in the memory, e.g. just read out from the camera.
+ *  Calibration frames are selected by the given metadata and the masters of the primary HDU are used,
+ *  so the frame must have the trimmed geometry of the masters.
+ *  Cosmic rays are cleaned by the session workers once calibrate_files() has started them,
+ *  otherwise by the calling thread.
+ */
+int calibrate_buffer(calibrator_session_t *session, const void *pixels, int pixel_type, int width, int height,
+			time_t obs_time, double exptime, double ccd_temp, float *result)
+{
+	calibrator_params_t *params = session->params;
+	calibration_files_t cal_files;
+	calibration_set_t cal_set;
+	calib_kernel_t kernel;
+	fits_handle_t image;
+	cr_params_t cr;
+	long cleaned;
+	int status = 0;
+
+	if (!pixels || !result || width <= 0 || height <= 0 || pixel_type < 0 || pixel_type >= KERNEL_INPUTS) {
+		return -EINVAL;
+	}
+
+	if (!params->darkpath[0]) {
+		return -EINVAL;
+	}
+
+	memset(&image, 0, sizeof(fits_handle_t));
+
+	image.image = result;
+	image.width = width;
+	image.height = height;
+	image.planes = 1;
+	image.hdu = 1;
+
+	if (select_calibration_frames(params, &cal_files, "buffer", obs_time, exptime, ccd_temp) != 0) {
+		release_calibration_frames(&cal_files);
+		return -ENOENT;
+	}
+
+	if (acquire_calibration_set(session, &cal_set, &cal_files, 1) != 0) {
+		status = -ENOENT;
+	} else if (!calibration_set_matches(&cal_set, &image)) {
+		status = -EFAULT;
+	} else {
+		if (pixel_type != KERNEL_IN_F32 && !params->dark_fit) {
+			select_calibration_kernel(&cal_set, pixel_type, &kernel);
+			apply_calibration_kernel(&cal_set, &kernel, pixels, &image, 0);
+		} else {
+			/* dark scale is fitted to the raw frame */
+			load_buffer_pixels(pixels, pixel_type, result, (long) width * height);
+
+			if (params->dark_fit) {
+				fit_calibration_set(params, &cal_set, &image, "buffer");
+			}
+
+			apply_calibration_set(&cal_set, &image, 0);
+		}
+
+		if (params->crreject.sigclip > 0) {
+			cr = params->crreject;
+			cr.gain = cr.gain > 0 ? cr.gain : CR_DEFAULT_GAIN;
+			cr.readnoise = cr.readnoise > 0 ? cr.readnoise : CR_DEFAULT_READNOISE;
+
+			cleaned = cr_reject(&image, &cr, session->pool);
+
+			if (cleaned < 0) {
+				status = (int) cleaned;
+			}
+		}
+	}
+
+	release_calibration_set(&cal_set);
+	release_calibration_frames(&cal_files);
+
+	return status;
+}
+
+/*
+ * Waits for the queued files, the masters stay cached until calibrator_session_free()
+ */
+void calibrator_stop(calibrator_session_t *session)
+{
+	session->params->run_flag = 0;
+
+	thread_pool_free(session->pool);
+	session->pool = NULL;
+
+	if (session->qa_summary) {
+		frame_stats_print_footer(session->qa_summary, session->qa_json);
+		fclose(session->qa_summary);
+		session->qa_summary = NULL;
+	}
+
+	if (session->file_list) {
+		free_list(session->file_list);
+		session->file_list = NULL;
+	}
+}
+
+void calibrator_session_free(calibrator_session_t *session)
+{
+	if (!session) {
+		return;
+	}
+
+	calibrator_stop(session);
+
+	master_cache_free(session->cache);
+
+	io_limiter_free(session->io);
+
+	pthread_mutex_destroy(&session->lock);
+
+	free(session);
+}
@@ -0,0 +1,454 @@
+/* 
+   cosmic_rays.c
+    - single frame cosmic rays rejection, L.A.Cosmic alike (van Dokkum 2001)
+
+   Copyright 2022  Oleg Kutkov <contact@olegkutkov.me>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <math.h>
+#include "cosmic_rays.h"
+#include "thread_pool.h"
+
+/* rows per parallel band, small enough to keep the 3x3 windows in cache */
+#define CR_BAND_ROWS 64
+#define CR_MIN_FINE 0.01f
+#define CR_MIN_NOISE 0.0001f
+#define CR_REPLACE_RADIUS 2
+
+#define CR_MIN(a, b) ((a) < (b) ? (a) : (b))
+#define CR_MAX(a, b) ((a) > (b) ? (a) : (b))
+#define CR_SORT(a, b) { float t_ = CR_MIN(a, b); b = CR_MAX(a, b); a = t_; }
+
+/*
+ * Five full frame planes are kept while a frame is cleaned:
+ *  fine   - 3x3 median of the image, later the fine structure image
+ *  noise  - median of the median (~5x5 median), used for the noise model
+ *  lplus  - Laplacian of the 2x subsampled image, clipped at zero
+ *  sig    - Laplacian significance, later with the large scale part removed
+ *  tmp    - scratch plane for the chained medians
+ */
+typedef struct cr_frame {
+	const cr_params_t *params;
+	long width;
+	long height;
+	float *image;
+	float *fine;
+	float *noise;
+	float *lplus;
+	float *sig;
+	float *tmp;
+	unsigned char *mask;
+	unsigned char *grown;
+} cr_frame_t;
+
+typedef long (*cr_band_func) (cr_frame_t *frame, long y0, long y1);
+
+typedef struct cr_band {
+	cr_frame_t *frame;
+	cr_band_func func;
+	long y0;
+	long y1;
+	long count;
+} cr_band_t;
+
+/* branchless median of 9 values, sorting network by Paeth/Devillard */
+static inline float median9(float p0, float p1, float p2, float p3, float p4,
+							float p5, float p6, float p7, float p8)
+{
+	CR_SORT(p1, p2); CR_SORT(p4, p5); CR_SORT(p7, p8);
+	CR_SORT(p0, p1); CR_SORT(p3, p4); CR_SORT(p6, p7);
+	CR_SORT(p1, p2); CR_SORT(p4, p5); CR_SORT(p7, p8);
+	CR_SORT(p0, p3); CR_SORT(p5, p8); CR_SORT(p4, p7);
+	CR_SORT(p3, p6); CR_SORT(p1, p4); CR_SORT(p2, p5);
+	CR_SORT(p4, p7); CR_SORT(p4, p2); CR_SORT(p6, p4);
+	CR_SORT(p4, p2);
+
+	return p4;
+}
+
+static inline long clamp_row(long y, long height)
+{
+	return y < 0 ? 0 : (y >= height ? height - 1 : y);
+}
+
+static inline float median3x3_at(const float *up, const float *mid, const float *down,
+									long x, long width)
+{
+	long xl = x > 0 ? x - 1 : 0;
+	long xr = x < width - 1 ? x + 1 : width - 1;
+
+	return median9(up[xl], up[x], up[xr], mid[xl], mid[x], mid[xr], down[xl], down[x], down[xr]);
+}
+
+/*
+ * 3x3 median of the src rows [y0, y1) into out, edges are clamped.
+ * The inner loop has no edge checks, so the compiler can vectorize it.
+ */
+static void median3x3_rows(const float *src, float *out, long width, long height, long y0, long y1)
+{
+	long x, y;
+
+	for (y = y0; y < y1; ++y) {
+		const float *up = src + clamp_row(y - 1, height) * width;
+		const float *mid = src + y * width;
+		const float *down = src + clamp_row(y + 1, height) * width;
+		float *dst = out + y * width;
+
+		dst[0] = median3x3_at(up, mid, down, 0, width);
+
+		for (x = 1; x < width - 1; ++x) {
+			dst[x] = median9(up[x - 1], up[x], up[x + 1], mid[x - 1], mid[x], mid[x + 1],
+								down[x - 1], down[x], down[x + 1]);
+		}
+
+		dst[width - 1] = median3x3_at(up, mid, down, width - 1, width);
+	}
+}
+
+static long band_median_image(cr_frame_t *frame, long y0, long y1)
+{
+	median3x3_rows(frame->image, frame->fine, frame->width, frame->height, y0, y1);
+	return 0;
+}
+
+static long band_median_noise(cr_frame_t *frame, long y0, long y1)
+{
+	median3x3_rows(frame->fine, frame->noise, frame->width, frame->height, y0, y1);
+	return 0;
+}
+
+/*
+ * Laplacian of the image subsampled by 2: every subpixel of a pixel p is
+ * 2p minus its two outer neighbours, negative values are clipped and the
+ * four subpixels are block averaged back. Significance is L+ over twice
+ * the noise of the median image.
+ */
+static long band_laplacian(cr_frame_t *frame, long y0, long y1)
+{
+	const float *image = frame->image;
+	long width = frame->width;
+	float gain = (float)frame->params->gain;
+	float rn2 = (float)(frame->params->readnoise * frame->params->readnoise);
+	long x, y;
+
+	for (y = y0; y < y1; ++y) {
+		const float *up = image + clamp_row(y - 1, frame->height) * width;
+		const float *mid = image + y * width;
+		const float *down = image + clamp_row(y + 1, frame->height) * width;
+		const float *med = frame->noise + y * width;
+		float *lplus = frame->lplus + y * width;
+		float *sig = frame->sig + y * width;
+
+		for (x = 0; x < width; ++x) {
+			long xl = x > 0 ? x - 1 : 0;
+			long xr = x < width - 1 ? x + 1 : width - 1;
+			float p2 = 2.0f * mid[x];
+			float lp = CR_MAX(p2 - mid[xl] - up[x], 0.0f) + CR_MAX(p2 - mid[xr] - up[x], 0.0f)
+						+ CR_MAX(p2 - mid[xl] - down[x], 0.0f) + CR_MAX(p2 - mid[xr] - down[x], 0.0f);
+			float noise = sqrtf(gain * CR_MAX(med[x], CR_MIN_NOISE) + rn2) / gain;
+
+			lp *= 0.25f;
+			lplus[x] = lp;
+			sig[x] = lp / (2.0f * noise);
+		}
+	}
+
+	return 0;
+}
+
+static long band_median_sig(cr_frame_t *frame, long y0, long y1)
+{
+	median3x3_rows(frame->sig, frame->tmp, frame->width, frame->height, y0, y1);
+	return 0;
+}
+
+/* removes the large scale structure from the significance image */
+static long band_sig_structure(cr_frame_t *frame, long y0, long y1)
+{
+	long x, y;
+	long width = frame->width;
+
+	for (y = y0; y < y1; ++y) {
+		const float *up = frame->tmp + clamp_row(y - 1, frame->height) * width;
+		const float *mid = frame->tmp + y * width;
+		const float *down = frame->tmp + clamp_row(y + 1, frame->height) * width;
+		float *sig = frame->sig + y * width;
+
+		for (x = 0; x < width; ++x) {
+			sig[x] -= median3x3_at(up, mid, down, x, width);
+		}
+	}
+
+	return 0;
+}
+
+static long band_median_fine(cr_frame_t *frame, long y0, long y1)
+{
+	median3x3_rows(frame->noise, frame->tmp, frame->width, frame->height, y0, y1);
+	return 0;
+}
+
+/*
+ * Fine structure image: the 3x3 median minus its ~7x7 median, chained
+ * from three 3x3 passes. Also marks the initial cosmic ray candidates.
+ */
+static long band_candidates(cr_frame_t *frame, long y0, long y1)
+{
+	long x, y;
+	long width = frame->width;
+	float sigclip = (float)frame->params->sigclip;
+	float objlim = (float)frame->params->objlim;
+	long count = 0;
+
+	for (y = y0; y < y1; ++y) {
+		const float *up = frame->tmp + clamp_row(y - 1, frame->height) * width;
+		const float *mid = frame->tmp + y * width;
+		const float *down = frame->tmp + clamp_row(y + 1, frame->height) * width;
+		const float *sig = frame->sig + y * width;
+		const float *lplus = frame->lplus + y * width;
+		float *fine = frame->fine + y * width;
+		unsigned char *mask = frame->mask + y * width;
+
+		for (x = 0; x < width; ++x) {
+			float f = fine[x] - median3x3_at(up, mid, down, x, width);
+
+			f = CR_MAX(f, CR_MIN_FINE);
+			fine[x] = f;
+			mask[x] = (sig[x] > sigclip) && (lplus[x] / f > objlim);
+			count += mask[x];
+		}
+	}
+
+	return count;
+}
+
+static long grow_mask(cr_frame_t *frame, const unsigned char *src, unsigned char *dst,
+						float limit, long y0, long y1)
+{
+	long x, y;
+	long width = frame->width;
+	long count = 0;
+
+	for (y = y0; y < y1; ++y) {
+		const unsigned char *up = src + clamp_row(y - 1, frame->height) * width;
+		const unsigned char *mid = src + y * width;
+		const unsigned char *down = src + clamp_row(y + 1, frame->height) * width;
+		const float *sig = frame->sig + y * width;
+		unsigned char *out = dst + y * width;
+
+		for (x = 0; x < width; ++x) {
+			long xl = x > 0 ? x - 1 : 0;
+			long xr = x < width - 1 ? x + 1 : width - 1;
+			unsigned char near = up[xl] | up[x] | up[xr] | mid[xl] | mid[xr]
+									| down[xl] | down[x] | down[xr];
+
+			out[x] = mid[x] | (near & (sig[x] > limit));
+			count += out[x];
+		}
+	}
+
+	return count;
+}
+
+static long band_grow(cr_frame_t *frame, long y0, long y1)
+{
+	return grow_mask(frame, frame->mask, frame->grown, (float)frame->params->sigclip, y0, y1);
+}
+
+static long band_grow_faint(cr_frame_t *frame, long y0, long y1)
+{
+	return grow_mask(frame, frame->grown, frame->mask,
+						(float)(frame->params->sigclip * frame->params->sigfrac), y0, y1);
+}
+
+/*
+ * Replaces every masked pixel by the median of the unmasked pixels around it.
+ * Only masked pixels are written and only unmasked are read, so the bands
+ * never see each other's updates.
+ */
+static long band_replace(cr_frame_t *frame, long y0, long y1)
+{
+	float window[(2 * CR_REPLACE_RADIUS + 1) * (2 * CR_REPLACE_RADIUS + 1)];
+	long width = frame->width;
+	long x, y, i, j, n;
+	long count = 0;
+
+	for (y = y0; y < y1; ++y) {
+		for (x = 0; x < width; ++x) {
+			if (!frame->mask[y * width + x]) {
+				continue;
+			}
+
+			n = 0;
+
+			for (j = y - CR_REPLACE_RADIUS; j <= y + CR_REPLACE_RADIUS; ++j) {
+				if (j < 0 || j >= frame->height) {
+					continue;
+				}
+
+				for (i = x - CR_REPLACE_RADIUS; i <= x + CR_REPLACE_RADIUS; ++i) {
+					long k;
+					float v;
+
+					if (i < 0 || i >= width || frame->mask[j * width + i]) {
+						continue;
+					}
+
+					/* insertion sort, the window is tiny */
+					v = frame->image[j * width + i];
+
+					for (k = n; k > 0 && window[k - 1] > v; --k) {
+						window[k] = window[k - 1];
+					}
+
+					window[k] = v;
+					++n;
+				}
+			}
+
+			if (n) {
+				frame->image[y * width + x] = (n & 1) ? window[n / 2]
+										: 0.5f * (window[n / 2 - 1] + window[n / 2]);
+				++count;
+			}
+		}
+	}
+
+	return count;
+}
+
+static void* band_task_func(void *arg)
+{
+	cr_band_t *band = (cr_band_t*)arg;
+
+	band->count = band->func(band->frame, band->y0, band->y1);
+
+	return NULL;
+}
+
+/*
+ * Runs one pass over the whole frame, split into bands of rows processed
+ * by the thread pool. Returns the sum of the bands results.
+ */
+static long run_pass(thread_pool_t *pool, cr_band_t *bands, long band_count, cr_band_func func)
+{
+	thread_group_t group;
+	long i;
+	long total = 0;
+
+	thread_group_init(&group, pool);
+
+	for (i = 0; i < band_count; ++i) {
+		bands[i].func = func;
+		bands[i].count = 0;
+
+		if (band_count == 1) {
+			band_task_func(&bands[i]);
+		} else {
+			thread_pool_add_group_task(&group, band_task_func, &bands[i]);
+		}
+	}
+
+	if (band_count > 1) {
+		thread_pool_wait_group(&group);
+	}
+
+	for (i = 0; i < band_count; ++i) {
+		total += bands[i].count;
+	}
+
+	return total;
+}
+
+long cr_reject(fits_handle_t *image, const cr_params_t *params, thread_pool_t *pool)
+{
+	cr_frame_t frame;
+	cr_band_t *bands;
+	float *planes;
+	size_t pixels;
+	long band_count;
+	long i, iter;
+	long cleaned = 0;
+
+	if (!image->image || image->width < 3 || image->height < 3 || params->sigclip <= 0) {
+		return 0;
+	}
+
+	pixels = (size_t)image->width * image->height;
+	band_count = (image->height + CR_BAND_ROWS - 1) / CR_BAND_ROWS;
+
+	planes = (float*)malloc(5 * pixels * sizeof(float));
+	frame.mask = (unsigned char*)malloc(2 * pixels);
+	bands = (cr_band_t*)calloc(band_count, sizeof(cr_band_t));
+
+	if (!planes || !frame.mask || !bands) {
+		free(planes);
+		free(frame.mask);
+		free(bands);
+		return -ENOMEM;
+	}
+
+	frame.params = params;
+	frame.width = image->width;
+	frame.height = image->height;
+	frame.image = image->image;
+	frame.fine = planes;
+	frame.noise = planes + pixels;
+	frame.lplus = planes + 2 * pixels;
+	frame.sig = planes + 3 * pixels;
+	frame.tmp = planes + 4 * pixels;
+	frame.grown = frame.mask + pixels;
+
+	for (i = 0; i < band_count; ++i) {
+		bands[i].frame = &frame;
+		bands[i].y0 = i * CR_BAND_ROWS;
+		bands[i].y1 = CR_MIN((i + 1) * CR_BAND_ROWS, frame.height);
+	}
+
+	for (iter = 0; iter < params->iterations; ++iter) {
+		long found;
+
+		run_pass(pool, bands, band_count, band_median_image);
+		run_pass(pool, bands, band_count, band_median_noise);
+		run_pass(pool, bands, band_count, band_laplacian);
+		run_pass(pool, bands, band_count, band_median_sig);
+		run_pass(pool, bands, band_count, band_sig_structure);
+		run_pass(pool, bands, band_count, band_median_fine);
+
+		if (!run_pass(pool, bands, band_count, band_candidates)) {
+			break;
+		}
+
+		run_pass(pool, bands, band_count, band_grow);
+		run_pass(pool, bands, band_count, band_grow_faint);
+
+		found = run_pass(pool, bands, band_count, band_replace);
+
+		if (!found) {
+			break;
+		}
+
+		cleaned += found;
+	}
+
+	free(planes);
+	free(frame.mask);
+	free(bands);
+
+	return cleaned;
+}
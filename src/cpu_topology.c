@@ -0,0 +1,224 @@
+/* 
+   cpu_topology.c
+    - NUMA nodes discovery and node-local memory helpers
+
+   Copyright 2022  Oleg Kutkov <contact@olegkutkov.me>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include "cpu_topology.h"
+
+#define SYSFS_NODE_CPULIST "/sys/devices/system/node/node%i/cpulist"
+
+static int nodes_count = 0;
+static int cpu_node_map[CPU_SETSIZE];
+static int allowed_count = 0;
+
+/* CPUs ordered so that consecutive slots alternate between NUMA nodes */
+static int cpu_order[CPU_SETSIZE];
+static int cpu_order_len = 0;
+
+static pthread_once_t topology_once = PTHREAD_ONCE_INIT;
+
+static int parse_cpulist(const char *str, int node)
+{
+	int first, last, cpu, count = 0;
+	char *end;
+
+	while (*str) {
+		first = strtol(str, &end, 10);
+
+		if (end == str) {
+			break;
+		}
+
+		last = first;
+
+		if (*end == '-') {
+			str = end + 1;
+			last = strtol(str, &end, 10);
+		}
+
+		for (cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu) {
+			cpu_node_map[cpu] = node;
+			count++;
+		}
+
+		str = end;
+
+		if (*str == ',') {
+			str++;
+		} else {
+			break;
+		}
+	}
+
+	return count;
+}
+
+static void build_cpu_order()
+{
+	int round, node, cpu, seen, added = 1;
+
+	for (round = 0; added; ++round) {
+		added = 0;
+
+		for (node = 0; node < nodes_count; ++node) {
+			seen = 0;
+
+			for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+				if (cpu_node_map[cpu] != node) {
+					continue;
+				}
+
+				if (seen++ == round) {
+					cpu_order[cpu_order_len++] = cpu;
+					added = 1;
+					break;
+				}
+			}
+		}
+	}
+}
+
+static void topology_discover()
+{
+	FILE *fp;
+	char path[64];
+	char cpulist[1024];
+	int node, cpu;
+	long online;
+	cpu_set_t allowed;
+
+	for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		cpu_node_map[cpu] = -1;
+	}
+
+	for (node = 0; node < CPU_TOPOLOGY_MAX_NODES; ++node) {
+		snprintf(path, sizeof(path), SYSFS_NODE_CPULIST, node);
+
+		fp = fopen(path, "r");
+
+		if (!fp) {
+			break;
+		}
+
+		if (fgets(cpulist, sizeof(cpulist), fp) && parse_cpulist(cpulist, node) > 0) {
+			nodes_count = node + 1;
+		}
+
+		fclose(fp);
+	}
+
+	if (nodes_count == 0) {
+		online = sysconf(_SC_NPROCESSORS_ONLN);
+
+		for (cpu = 0; cpu < online && cpu < CPU_SETSIZE; ++cpu) {
+			cpu_node_map[cpu] = 0;
+		}
+
+		nodes_count = 1;
+	}
+
+	/* cpuset of the cgroup or taskset may leave only a part of the CPUs to the process */
+	if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed) == 0) {
+		for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+			if (!CPU_ISSET(cpu, &allowed)) {
+				cpu_node_map[cpu] = -1;
+			} else if (cpu_node_map[cpu] < 0) {
+				cpu_node_map[cpu] = 0;
+			}
+		}
+	}
+
+	build_cpu_order();
+
+	allowed_count = cpu_order_len;
+}
+
+void cpu_topology_init()
+{
+	pthread_once(&topology_once, topology_discover);
+}
+
+int cpu_topology_nodes_count()
+{
+	cpu_topology_init();
+
+	return nodes_count;
+}
+
+/* CPUs the process is allowed to run on */
+int cpu_topology_cpus_count()
+{
+	cpu_topology_init();
+
+	return allowed_count > 0 ? allowed_count : 1;
+}
+
+int cpu_topology_node_of_cpu(int cpu)
+{
+	cpu_topology_init();
+
+	if (cpu < 0 || cpu >= CPU_SETSIZE || cpu_node_map[cpu] < 0) {
+		return 0;
+	}
+
+	return cpu_node_map[cpu];
+}
+
+int cpu_topology_current_node()
+{
+	return cpu_topology_node_of_cpu(sched_getcpu());
+}
+
+int cpu_topology_cpu_for_slot(int slot)
+{
+	cpu_topology_init();
+
+	if (cpu_order_len == 0) {
+		return slot;
+	}
+
+	return cpu_order[slot % cpu_order_len];
+}
+
+/*
+ * Linux places a page on the node of the thread which touches it first,
+ *  so writing every page from the calling (pinned) thread makes the whole
+ *  buffer local to that thread's node.
+ */
+void *node_local_alloc(size_t size)
+{
+	size_t i, page = sysconf(_SC_PAGESIZE);
+	char *buf = (char *) malloc(size);
+
+	if (!buf) {
+		return NULL;
+	}
+
+	for (i = 0; i < size; i += page) {
+		buf[i] = 0;
+	}
+
+	return buf;
+}
@@ -18,10 +18,28 @@
    along with this program.  If not, see <http://www.gnu.org/licenses/>.  
  */
 
+#define _GNU_SOURCE
+
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "version.h"
+#include "cpu_topology.h"
 #include "fits_handler.h"
+#include "kernels.h"
+#include "fits_header.h"
+#include "raw_io.h"
+
+/* pixels are converted to the output integer type by chunks of this size */
+#define OUTPUT_CHUNK_PIXELS 65536
+
+/* written pages are sent to the disk by this amount with the write-behind */
+#define WRITE_BEHIND_BYTES (8 << 20)
 
 fits_handle_t *fits_handler_mem_new(int *status)
 {
@@ -47,12 +65,390 @@ fits_handle_t *fits_handler_new(const char *filepath, int *status)
 
 	fits_open_file(&hdl->src_fptr, filepath, READONLY, status);
 
+	hdl->hdu = 1;
+
 	return hdl;
 }
 
+/*
+ * Data units of the plain uncompressed files can be read past cfitsio,
+ *  by the large batched requests instead of its small internal buffers.
+ *  Other files and HDUs are read by cfitsio as before
+ */
+void fits_set_raw_io(fits_handle_t *handle, int mode)
+{
+	handle->raw.mode = mode;
+}
+
+/*
+ * Science frames are read once and the results are written once,
+ *  with the drop their pages don't push the calibration frames out of the page cache.
+ *  Write-behind sends the output to the disk while it's written, not all at once by the kernel
+ */
+void fits_set_cache_policy(fits_handle_t *handle, int drop, int write_behind)
+{
+	handle->cache.drop = drop;
+	handle->cache.write_behind = write_behind;
+}
+
+/* calibration frame is read ahead while the previous one is combined */
+void fits_prefetch_file(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0) {
+		return;
+	}
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+
+	close(fd);
+}
+
+/* only the current HDU is dropped, the other HDUs of the file may be read by the other handles */
+static void drop_source_pages(fits_handle_t *handle)
+{
+	int fd, status = 0;
+	LONGLONG headstart = 0, dataend = 0;
+	char path[FLEN_FILENAME];
+
+	fits_get_hduaddrll(handle->src_fptr, &headstart, NULL, &dataend, &status);
+	fits_file_name(handle->src_fptr, path, &status);
+
+	if (status != 0 || dataend <= headstart) {
+		return;
+	}
+
+	fd = handle->raw.opened ? handle->raw.fd : open(path, O_RDONLY);
+
+	if (fd < 0) {
+		return;
+	}
+
+	posix_fadvise(fd, headstart, dataend - headstart, POSIX_FADV_DONTNEED);
+
+	if (!handle->raw.opened) {
+		close(fd);
+	}
+}
+
+static unsigned char *raw_buffer(fits_raw_unit_t *raw, size_t size)
+{
+	if (raw->buffer_size < size) {
+		free(raw->buffer);
+
+		raw->buffer = (unsigned char*) raw_io_alloc(size);
+		raw->buffer_size = raw->buffer ? size : 0;
+	}
+
+	return raw->buffer;
+}
+
+static void release_raw_unit(fits_raw_unit_t *raw)
+{
+	if (raw->opened) {
+		close(raw->fd);
+		raw->opened = 0;
+	}
+
+	free(raw->buffer);
+
+	raw->buffer = NULL;
+	raw->buffer_size = 0;
+	raw->usable = 0;
+}
+
+/* cfitsio opens the gzipped and remote files too, those are left to it */
+static int open_raw_file(fits_handle_t *handle)
+{
+	int status = 0;
+	ssize_t n;
+	struct stat st;
+	char path[FLEN_FILENAME];
+	fits_raw_unit_t *raw = &handle->raw;
+
+	fits_file_name(handle->src_fptr, path, &status);
+
+	if (status != 0) {
+		return status;
+	}
+
+	raw->fd = raw_io_open(path, O_RDONLY);
+
+	if (raw->fd < 0) {
+		return raw->fd;
+	}
+
+	raw->opened = 1;
+
+	if (fstat(raw->fd, &st) != 0) {
+		return -errno;
+	}
+
+	raw->file_size = st.st_size;
+
+	/* cfitsio descriptor isn't reachable, the hint works for the own one only */
+	if (handle->cache.drop) {
+		posix_fadvise(raw->fd, 0, 0, POSIX_FADV_NOREUSE);
+	}
+
+	if (!raw_buffer(raw, RAW_IO_ALIGN)) {
+		return -ENOMEM;
+	}
+
+	n = raw_io_read(raw->mode, raw->fd, raw->buffer, RAW_IO_ALIGN, 0);
+
+	if (n < 0) {
+		return n;
+	}
+
+	return n >= 9 && memcmp(raw->buffer, "SIMPLE  =", 9) == 0 ? 0 : -EINVAL;
+}
+
+/*
+ * Layout of the current HDU data unit, it's read directly when
+ *  the pixels are stored as is in the file
+ */
+static void setup_raw_unit(fits_handle_t *handle)
+{
+	int status = 0;
+	LONGLONG datastart = 0, dataend = 0;
+	fits_raw_unit_t *raw = &handle->raw;
+
+	raw->usable = 0;
+
+	if (raw->mode == RAW_IO_NONE || !handle->src_fptr) {
+		return;
+	}
+
+	if (!raw->opened && open_raw_file(handle) != 0) {
+		release_raw_unit(raw);
+		raw->mode = RAW_IO_NONE;
+		return;
+	}
+
+	/* tile compressed image is a binary table in the file */
+	if (fits_is_compressed_image(handle->src_fptr, &status) || status != 0) {
+		return;
+	}
+
+	fits_get_hduaddrll(handle->src_fptr, NULL, &datastart, &dataend, &status);
+	fits_get_img_type(handle->src_fptr, &raw->bitpix, &status);
+
+	if (status != 0) {
+		return;
+	}
+
+	raw->bzero = 0;
+	raw->bscale = 1;
+
+	fits_read_key(handle->src_fptr, TDOUBLE, "BZERO", &raw->bzero, NULL, &status);
+	status = 0;
+
+	fits_read_key(handle->src_fptr, TDOUBLE, "BSCALE", &raw->bscale, NULL, &status);
+	status = 0;
+
+	switch (raw->bitpix) {
+		case BYTE_IMG:
+		case SHORT_IMG:
+		case LONG_IMG:
+		case FLOAT_IMG:
+		case DOUBLE_IMG:
+			break;
+
+		default:
+			return;
+	}
+
+	if (dataend > raw->file_size
+			|| datastart + (long long) handle->width * handle->height * handle->planes * (abs(raw->bitpix) / 8) > dataend) {
+		return;
+	}
+
+	raw->offset = datastart;
+	raw->usable = 1;
+}
+
+static uint16_t get_be16(const unsigned char *p)
+{
+	return (uint16_t) (p[0] << 8 | p[1]);
+}
+
+static uint32_t get_be32(const unsigned char *p)
+{
+	return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+static uint64_t get_be64(const unsigned char *p)
+{
+	return (uint64_t) get_be32(p) << 32 | get_be32(p + 4);
+}
+
+static double raw_value(const unsigned char *p, int bitpix)
+{
+	uint32_t u32;
+	uint64_t u64;
+	float f;
+	double d;
+
+	switch (bitpix) {
+		case BYTE_IMG:
+			return p[0];
+
+		case SHORT_IMG:
+			return (int16_t) get_be16(p);
+
+		case LONG_IMG:
+			return (int32_t) get_be32(p);
+
+		case FLOAT_IMG:
+			u32 = get_be32(p);
+			memcpy(&f, &u32, sizeof(f));
+			return f;
+
+		default:
+			u64 = get_be64(p);
+			memcpy(&d, &u64, sizeof(d));
+			return d;
+	}
+}
+
+/* same arithmetic as cfitsio, the scaling is done in double */
+static void raw_to_float(const fits_raw_unit_t *raw, const unsigned char *src, float *dst, long n)
+{
+	long i;
+	int bytes = abs(raw->bitpix) / 8;
+
+	if (raw->bscale == 1 && raw->bzero == 0) {
+		for (i = 0; i < n; ++i) {
+			dst[i] = (float) raw_value(src + i * bytes, raw->bitpix);
+		}
+	} else {
+		for (i = 0; i < n; ++i) {
+			dst[i] = (float) (raw_value(src + i * bytes, raw->bitpix) * raw->bscale + raw->bzero);
+		}
+	}
+}
+
+/* file type is given to the type specialized kernels without the scaling */
+static int raw_native_size(const fits_raw_unit_t *raw, int datatype)
+{
+	if (raw->bscale != 1) {
+		return 0;
+	}
+
+	switch (datatype) {
+		case TUSHORT:
+			return (raw->bitpix == SHORT_IMG && raw->bzero == 32768)
+					|| (raw->bitpix == BYTE_IMG && raw->bzero == 0) ? sizeof(uint16_t) : 0;
+
+		case TSHORT:
+			return raw->bitpix == SHORT_IMG && raw->bzero == 0 ? sizeof(int16_t) : 0;
+
+		case TINT:
+			return raw->bitpix == LONG_IMG && raw->bzero == 0 ? sizeof(int32_t) : 0;
+
+		case TFLOAT:
+			return raw->bitpix == FLOAT_IMG && raw->bzero == 0 ? sizeof(float) : 0;
+
+		default:
+			return 0;
+	}
+}
+
+static void raw_to_native(const fits_raw_unit_t *raw, const unsigned char *src, void *dst, long n)
+{
+	long i;
+	uint16_t *u16 = (uint16_t*) dst;
+	uint32_t *u32 = (uint32_t*) dst;
+
+	switch (raw->bitpix) {
+		case BYTE_IMG:
+			for (i = 0; i < n; ++i) {
+				u16[i] = src[i];
+			}
+			break;
+
+		case SHORT_IMG:
+			/* unsigned 16-bit is stored with the sign bit flipped, BZERO 32768 */
+			for (i = 0; i < n; ++i) {
+				u16[i] = get_be16(src + i * 2) ^ (raw->bzero != 0 ? 0x8000 : 0);
+			}
+			break;
+
+		default:
+			for (i = 0; i < n; ++i) {
+				u32[i] = get_be32(src + i * 4);
+			}
+			break;
+	}
+}
+
+/*
+ * Reads [first, first + size) bytes of the data unit by the aligned request,
+ *  returns the first byte in the bounce buffer
+ */
+static unsigned char *read_raw_span(fits_raw_unit_t *raw, long long first, size_t size, int *status)
+{
+	long long start = raw->offset + first;
+	long long aligned = start & ~((long long) RAW_IO_ALIGN - 1);
+	size_t head = start - aligned;
+	size_t len = (head + size + RAW_IO_ALIGN - 1) & ~((size_t) RAW_IO_ALIGN - 1);
+	ssize_t n;
+
+	if (!raw_buffer(raw, len)) {
+		*status = -ENOMEM;
+		return NULL;
+	}
+
+	n = raw_io_read(raw->mode, raw->fd, raw->buffer, len, aligned);
+
+	if (n < 0 || (size_t) n < head + size) {
+		*status = n < 0 ? n : -EIO;
+		return NULL;
+	}
+
+	return raw->buffer + head;
+}
+
+/* rows of the untrimmed plane, as floats or in the file type when native_size is set */
+static int read_raw_rows(fits_handle_t *handle, long plane, int first_row, int rows,
+				int native_size, void *pixels)
+{
+	int status = 0;
+	fits_raw_unit_t *raw = &handle->raw;
+	int bytes = abs(raw->bitpix) / 8;
+	long long first = ((long long) plane * handle->height + first_row) * handle->width;
+	long npixels = (long) handle->width * rows;
+	long done, chunk;
+	unsigned char *src;
+
+	for (done = 0; done < npixels && status == 0; done += chunk) {
+		chunk = npixels - done;
+
+		if (chunk > RAW_IO_SPAN / bytes) {
+			chunk = RAW_IO_SPAN / bytes;
+		}
+
+		src = read_raw_span(raw, (first + done) * bytes, (size_t) chunk * bytes, &status);
+
+		if (!src) {
+			break;
+		}
+
+		if (native_size) {
+			raw_to_native(raw, src, (char*) pixels + done * native_size, chunk);
+		} else {
+			raw_to_float(raw, src, (float*) pixels + done, chunk);
+		}
+	}
+
+	return status;
+}
+
 int fits_create_image_mem(fits_handle_t *handle, int width, int height)
 {
-	handle->image = (long*) malloc(width * height * sizeof(long));
+	handle->image = (float*) node_local_alloc((size_t) width * height * sizeof(float));
 
 	if (!handle->image) {
 		return -errno;
@@ -60,6 +456,7 @@ int fits_create_image_mem(fits_handle_t *handle, int width, int height)
 
 	handle->width = width;
 	handle->height = height;
+	handle->planes = 1;
 
 	return 0;
 }
@@ -74,119 +471,757 @@ int fits_copy_image(fits_handle_t *handle, fits_handle_t *src)
 		return -ENOMEM;
 	}
 
-	memcpy(handle->image, src->image, src->width * src->height * sizeof(long));
+	memcpy(handle->image, src->image, (size_t) src->width * src->height * sizeof(float));
 
 	return 0;
 }
 
-int fits_add_image_matrix(fits_handle_t *handle, fits_handle_t *src)
+/*
+ * Least squares scale of the dark current, which gives minimal variance
+ *  of the (image - bias - scale * dark_current) on the every step-th pixel of every step-th row
+ */
+double fits_fit_dark_scale(fits_handle_t *handle, fits_handle_t *bias, fits_handle_t *dark_current, int step)
 {
-	long i;
+	long x, y, idx, n = 0;
+	double dc, val, sum_x = 0, sum_y = 0, sum_xx = 0, sum_xy = 0, var;
 
-	if (!handle || !src || !src->image) {
-		return -EFAULT;
+	if (!handle || !handle->image || !bias || !bias->image || !dark_current || !dark_current->image) {
+		return NAN;
 	}
 
-	if (!handle->image) {
-		return -ENOMEM;
+	if (step < 1) {
+		step = 1;
 	}
 
-	if (handle->width != src->width || handle->height != src->height) {
+	for (y = step / 2; y < handle->height; y += step) {
+		for (x = step / 2; x < handle->width; x += step) {
+			idx = y * handle->width + x;
+
+			dc = dark_current->image[idx];
+			val = handle->image[idx] - bias->image[idx];
+
+			sum_x += dc;
+			sum_y += val;
+			sum_xx += dc * dc;
+			sum_xy += dc * val;
+			n++;
+		}
+	}
+
+	if (n < 2) {
+		return NAN;
+	}
+
+	var = sum_xx - sum_x * sum_x / n;
+
+	if (var <= 0) {
+		return NAN;
+	}
+
+	return (sum_xy - sum_x * sum_y / n) / var;
+}
+
+static float select_nth(float *values, long n, long k)
+{
+	long left = 0, right = n - 1, i, j;
+	float pivot, tmp;
+
+	while (left < right) {
+		pivot = values[(left + right) / 2];
+		i = left;
+		j = right;
+
+		while (i <= j) {
+			while (values[i] < pivot) {
+				i++;
+			}
+
+			while (values[j] > pivot) {
+				j--;
+			}
+
+			if (i <= j) {
+				tmp = values[i];
+				values[i] = values[j];
+				values[j] = tmp;
+				i++;
+				j--;
+			}
+		}
+
+		if (k <= j) {
+			right = j;
+		} else if (k >= i) {
+			left = i;
+		} else {
+			break;
+		}
+	}
+
+	return values[k];
+}
+
+/*
+ * Sparse sorted list of the hot (above median + hot_sigma * robust sigma)
+ *  and dead (below dead_fraction * median) pixels of the master frame.
+ *  Zero threshold disables the check. Returns count of the bad pixels or negative error
+ */
+long fits_find_bad_pixels(fits_handle_t *handle, double hot_sigma, double dead_fraction)
+{
+	long i, n, count = 0;
+	float *tmp, median, sigma;
+	double hot_level = INFINITY, dead_level = -INFINITY;
+
+	if (!handle || !handle->image) {
 		return -EFAULT;
 	}
 
-	for (i = 0; i < handle->width * handle->height; ++i) {
-		handle->image[i] += src->image[i];
+	n = (long) handle->width * handle->height;
+
+	tmp = (float *) malloc(n * sizeof(float));
+
+	if (!tmp) {
+		return -errno;
+	}
+
+	memcpy(tmp, handle->image, n * sizeof(float));
+
+	median = select_nth(tmp, n, n / 2);
+
+	for (i = 0; i < n; ++i) {
+		tmp[i] = fabsf(handle->image[i] - median);
+	}
+
+	/* MAD of the normal distribution is 0.6745 sigma */
+	sigma = 1.4826 * select_nth(tmp, n, n / 2);
+
+	free(tmp);
+
+	if (hot_sigma > 0 && sigma > 0) {
+		hot_level = median + hot_sigma * sigma;
+	}
+
+	if (dead_fraction > 0 && median > 0) {
+		dead_level = dead_fraction * median;
+	}
+
+	for (i = 0; i < n; ++i) {
+		if (handle->image[i] > hot_level || handle->image[i] < dead_level) {
+			count++;
+		}
+	}
+
+	free(handle->bad_pixels);
+
+	handle->bad_pixels = NULL;
+	handle->bad_count = 0;
+
+	if (count == 0) {
+		return 0;
+	}
+
+	handle->bad_pixels = (uint32_t *) malloc(count * sizeof(uint32_t));
+
+	if (!handle->bad_pixels) {
+		return -errno;
+	}
+
+	for (i = 0; i < n; ++i) {
+		if (handle->image[i] > hot_level || handle->image[i] < dead_level) {
+			handle->bad_pixels[handle->bad_count++] = i;
+		}
+	}
+
+	return count;
+}
+
+int fits_copy_bad_pixels(fits_handle_t *handle, fits_handle_t *src)
+{
+	if (!src->bad_count) {
+		return 0;
+	}
+
+	handle->bad_pixels = (uint32_t *) malloc(src->bad_count * sizeof(uint32_t));
+
+	if (!handle->bad_pixels) {
+		return -errno;
 	}
 
+	memcpy(handle->bad_pixels, src->bad_pixels, src->bad_count * sizeof(uint32_t));
+
+	handle->bad_count = src->bad_count;
+
 	return 0;
 }
 
-int fits_divide_image_matrix(fits_handle_t *handle, int divider)
+/*
+ * Only the listed pixels are touched. Image can be a strip of the frame which starts from first_row,
+ *  so the runs of bad pixels are interpolated between the good neighbours of the same row
+ */
+void fits_correct_bad_pixels(fits_handle_t *handle, fits_handle_t *mask, int first_row, int mode)
 {
-	long i;
+	long lo, hi, mid, i, j, k, run_row, left, right;
+	long width = handle->width;
+	long begin = (long) first_row * width, end = begin + (long) handle->height * width;
+	const uint32_t *bad = mask->bad_pixels;
+	float *pix = handle->image - begin;
+	float v_left, v_right;
+
+	if (mode == BADPIX_NONE || !mask->bad_count) {
+		return;
+	}
 
-	if (!handle) {
-		return -EFAULT;
+	lo = 0;
+	hi = mask->bad_count;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+
+		if (bad[mid] < begin) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	for (i = lo; i < mask->bad_count && bad[i] < end; i = j) {
+		run_row = bad[i] / width;
+
+		j = i + 1;
+
+		while (j < mask->bad_count && bad[j] == bad[j - 1] + 1 && bad[j] / width == run_row) {
+			j++;
+		}
+
+		left = (bad[i] % width) ? (long) bad[i] - 1 : -1;
+		right = (long) bad[j - 1] + 1;
+
+		if (right >= end || right / width != run_row) {
+			right = -1;
+		}
+
+		if (mode == BADPIX_FLAG || (left < 0 && right < 0)) {
+			for (k = i; k < j; ++k) {
+				pix[bad[k]] = NAN;
+			}
+
+			continue;
+		}
+
+		v_left = left >= 0 ? pix[left] : pix[right];
+		v_right = right >= 0 ? pix[right] : pix[left];
+
+		for (k = i; k < j; ++k) {
+			pix[bad[k]] = v_left + (v_right - v_left) * (float) (k - i + 1) / (j - i + 1);
+		}
+	}
+}
+
+/*
+ * IRAF style section [x1:x2,y1:y2], 1-based and inclusive
+ */
+static int read_section(fits_handle_t *handle, const char *key, fits_section_t *sec)
+{
+	int status = 0, x0, x1, y0, y1, tmp;
+	char value[FLEN_VALUE] = { 0 };
+
+	fits_read_key(handle->src_fptr, TSTRING, key, value, NULL, &status);
+
+	if (status != 0 || sscanf(value, "[%i:%i,%i:%i]", &x0, &x1, &y0, &y1) != 4) {
+		return 0;
+	}
+
+	if (x0 > x1) {
+		tmp = x0;
+		x0 = x1;
+		x1 = tmp;
+	}
+
+	if (y0 > y1) {
+		tmp = y0;
+		y0 = y1;
+		y1 = tmp;
+	}
+
+	if (x0 < 1 || y0 < 1 || x1 > handle->naxes[0] || y1 > handle->naxes[1]) {
+		return 0;
+	}
+
+	sec->x0 = x0 - 1;
+	sec->x1 = x1;
+	sec->y0 = y0 - 1;
+	sec->y1 = y1;
+
+	return 1;
+}
+
+/*
+ * Image is trimmed to TRIMSEC (or DATASEC) and its geometry is changed to the trimmed one,
+ *  overscan levels are measured later for every plane
+ */
+static void setup_overscan(fits_handle_t *handle)
+{
+	free(handle->overscan_level);
+
+	handle->overscan_level = NULL;
+	handle->overscan_plane = -1;
+	handle->has_overscan = 0;
+	handle->trimmed = 0;
+
+	if (!handle->overscan || handle->overscan->mode == OVERSCAN_NONE) {
+		return;
+	}
+
+	handle->has_overscan = read_section(handle, "BIASSEC", &handle->bias_sec);
+
+	handle->trimmed = read_section(handle, "TRIMSEC", &handle->trim_sec)
+					|| read_section(handle, "DATASEC", &handle->trim_sec);
+
+	if (handle->trimmed) {
+		handle->width = handle->trim_sec.x1 - handle->trim_sec.x0;
+		handle->height = handle->trim_sec.y1 - handle->trim_sec.y0;
+	} else {
+		handle->trim_sec.x0 = 0;
+		handle->trim_sec.x1 = handle->width;
+		handle->trim_sec.y0 = 0;
+		handle->trim_sec.y1 = handle->height;
+	}
+
+	/* serial overscan is a strip of columns at the end of every row, so its level is taken by rows */
+	handle->overscan_by_rows = (handle->bias_sec.x1 - handle->bias_sec.x0)
+					< (handle->bias_sec.y1 - handle->bias_sec.y0);
+}
+
+int fits_get_hdus_count(fits_handle_t *handle)
+{
+	int status = 0, hdus = 0;
+
+	fits_get_num_hdus(handle->src_fptr, &hdus, &status);
+
+	return status == 0 ? hdus : 0;
+}
+
+int fits_select_hdu(fits_handle_t *handle, int hdu)
+{
+	int status = 0;
+
+	fits_movabs_hdu(handle->src_fptr, hdu, NULL, &status);
+
+	if (status != 0) {
+		return status;
+	}
+
+	handle->hdu = hdu;
+
+	return fits_get_image_size(handle);
+}
+
+/*
+ * Only images of two or more axes are calibrated,
+ *  header-only primary HDUs and tables are copied as is
+ */
+int fits_is_image_hdu(fits_handle_t *handle)
+{
+	int status = 0, hdutype = ANY_HDU;
+
+	fits_get_hdu_type(handle->src_fptr, &hdutype, &status);
+
+	return status == 0 && hdutype == IMAGE_HDU && handle->naxis >= 2;
+}
+
+int fits_get_image_size(fits_handle_t *handle)
+{
+	int i, status = 0;
+
+	handle->naxis = 0;
+
+	for (i = 0; i < FITS_MAX_AXES; i++) {
+		handle->naxes[i] = 1;
+	}
+
+	fits_get_img_dim(handle->src_fptr, &handle->naxis, &status);
+
+	if (handle->naxis > FITS_MAX_AXES) {
+		handle->naxis = FITS_MAX_AXES;
+	}
+
+	fits_get_img_size(handle->src_fptr, FITS_MAX_AXES, handle->naxes, &status);
+
+	handle->width = handle->naxis > 0 ? handle->naxes[0] : 0;
+	handle->height = handle->naxis > 1 ? handle->naxes[1] : 0;
+	handle->planes = 1;
+
+	for (i = 2; i < handle->naxis; i++) {
+		handle->planes *= handle->naxes[i];
+	}
+
+	/* unsigned and scaled data are reported with their equivalent type, e.g. USHORT_IMG */
+	fits_get_img_equivtype(handle->src_fptr, &handle->bitpix, &status);
+
+	if (status == 0 && handle->naxis >= 2) {
+		setup_overscan(handle);
+		setup_raw_unit(handle);
 	}
 
+	return status;
+}
+
+int fits_get_image_w(fits_handle_t *handle)
+{
+	return handle->width;
+}
+
+int fits_get_image_h(fits_handle_t *handle)
+{
+	return handle->height;
+}
+
+/*
+ * Plane is the index of the 2D frame in the data cube,
+ *  it's split to the coordinates of the higher axes
+ */
+static void plane_first_pixel(fits_handle_t *handle, long plane, int first_row, long *fpx)
+{
+	int i;
+
+	fpx[0] = 1L;
+	fpx[1] = first_row + 1L;
+
+	for (i = 2; i < FITS_MAX_AXES; i++) {
+		fpx[i] = plane % handle->naxes[i] + 1;
+		plane /= handle->naxes[i];
+	}
+}
+
+/*
+ * Loads one frame of the current HDU, the buffer is reused for the next planes
+ */
+int fits_load_plane(fits_handle_t *handle, long plane)
+{
 	if (!handle->image) {
+		handle->image = (float*) malloc((size_t) handle->width * handle->height * sizeof(float));
+
+		if (!handle->image) {
+			return -errno;
+		}
+	}
+
+	return fits_read_rows(handle, plane, 0, handle->height, handle->image);
+}
+
+static int read_section_pixels(fits_handle_t *handle, long plane, const fits_section_t *sec, float *pixels)
+{
+	int i, status = 0;
+	long fpx[FITS_MAX_AXES], lpx[FITS_MAX_AXES], inc[FITS_MAX_AXES];
+
+	plane_first_pixel(handle, plane, sec->y0, fpx);
+	plane_first_pixel(handle, plane, sec->y1 - 1, lpx);
+
+	fpx[0] = sec->x0 + 1;
+	lpx[0] = sec->x1;
+
+	for (i = 0; i < FITS_MAX_AXES; i++) {
+		inc[i] = 1;
+	}
+
+	fits_read_subset(handle->src_fptr, TFLOAT, fpx, lpx, inc, NULL, pixels, NULL, &status);
+
+	return status;
+}
+
+static int compare_floats(const void *a, const void *b)
+{
+	float fa = *(const float *) a, fb = *(const float *) b;
+
+	return (fa > fb) - (fa < fb);
+}
+
+static float overscan_estimate(const fits_overscan_t *overscan, float *values, long n)
+{
+	long i;
+	double sum = 0;
+
+	if (overscan->mode == OVERSCAN_MEDIAN) {
+		qsort(values, n, sizeof(float), compare_floats);
+
+		return n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+	}
+
+	for (i = 0; i < n; ++i) {
+		sum += values[i];
+	}
+
+	return sum / n;
+}
+
+/*
+ * Least squares polynomial of the levels, x is normalized to [-1, 1] for the stable solution.
+ *  Fitted values for the positions out[i] = x_first + i are stored to the out
+ */
+static int fit_overscan_levels(const float *levels, int n, int x_first_level, int order,
+				float *out, int n_out, int x_first_out)
+{
+	double a[FITS_OVERSCAN_MAX_ORDER + 1][FITS_OVERSCAN_MAX_ORDER + 2] = { { 0 } };
+	double coef[FITS_OVERSCAN_MAX_ORDER + 1], pw[2 * FITS_OVERSCAN_MAX_ORDER + 1];
+	double center = x_first_level + (n - 1) / 2.0, half = (n > 1) ? (n - 1) / 2.0 : 1;
+	double t, factor, value, tmp;
+	int i, j, k, pivot, size;
+
+	if (order > FITS_OVERSCAN_MAX_ORDER) {
+		order = FITS_OVERSCAN_MAX_ORDER;
+	}
+
+	if (order > n - 1) {
+		order = n - 1;
+	}
+
+	size = order + 1;
+
+	for (i = 0; i < n; ++i) {
+		t = (x_first_level + i - center) / half;
+
+		pw[0] = 1;
+
+		for (j = 1; j <= 2 * order; ++j) {
+			pw[j] = pw[j - 1] * t;
+		}
+
+		for (j = 0; j < size; ++j) {
+			for (k = 0; k < size; ++k) {
+				a[j][k] += pw[j + k];
+			}
+
+			a[j][size] += pw[j] * levels[i];
+		}
+	}
+
+	/* gaussian elimination with the partial pivoting */
+	for (i = 0; i < size; ++i) {
+		pivot = i;
+
+		for (j = i + 1; j < size; ++j) {
+			if (fabs(a[j][i]) > fabs(a[pivot][i])) {
+				pivot = j;
+			}
+		}
+
+		if (a[pivot][i] == 0) {
+			return -EDOM;
+		}
+
+		for (k = 0; k <= size; ++k) {
+			tmp = a[i][k];
+			a[i][k] = a[pivot][k];
+			a[pivot][k] = tmp;
+		}
+
+		for (j = i + 1; j < size; ++j) {
+			factor = a[j][i] / a[i][i];
+
+			for (k = i; k <= size; ++k) {
+				a[j][k] -= factor * a[i][k];
+			}
+		}
+	}
+
+	for (i = size - 1; i >= 0; --i) {
+		coef[i] = a[i][size];
+
+		for (k = i + 1; k < size; ++k) {
+			coef[i] -= a[i][k] * coef[k];
+		}
+
+		coef[i] /= a[i][i];
+	}
+
+	for (i = 0; i < n_out; ++i) {
+		t = (x_first_out + i - center) / half;
+		value = 0;
+
+		for (j = order; j >= 0; --j) {
+			value = value * t + coef[j];
+		}
+
+		out[i] = value;
+	}
+
+	return 0;
+}
+
+/*
+ * Overscan level of every row (or column) of the trimmed image,
+ *  only pixels of the BIASSEC are read for that
+ */
+static int measure_overscan(fits_handle_t *handle, long plane)
+{
+	const fits_section_t *bias = &handle->bias_sec;
+	long bias_w = bias->x1 - bias->x0, bias_h = bias->y1 - bias->y0;
+	int i, j, n_levels, n_out, level_first, out_first, idx, status;
+	float *region, *levels, *column;
+
+	n_levels = handle->overscan_by_rows ? bias_h : bias_w;
+	n_out = handle->overscan_by_rows ? handle->height : handle->width;
+	level_first = handle->overscan_by_rows ? bias->y0 : bias->x0;
+	out_first = handle->overscan_by_rows ? handle->trim_sec.y0 : handle->trim_sec.x0;
+
+	if (!handle->overscan_level) {
+		handle->overscan_level = (float *) malloc(n_out * sizeof(float));
+	}
+
+	region = (float *) malloc(bias_w * bias_h * sizeof(float));
+	levels = (float *) malloc(n_levels * sizeof(float));
+	column = (float *) malloc(bias_h * sizeof(float));
+
+	if (!handle->overscan_level || !region || !levels || !column) {
+		free(region);
+		free(levels);
+		free(column);
 		return -ENOMEM;
 	}
 
-	for (i = 0; i < handle->width * handle->height; ++i) {
-		handle->image[i] = handle->image[i] / (long)divider;
-	}
+	status = read_section_pixels(handle, plane, bias, region);
+
+	for (i = 0; i < n_levels && status == 0; ++i) {
+		if (handle->overscan_by_rows) {
+			levels[i] = overscan_estimate(handle->overscan, region + i * bias_w, bias_w);
+		} else {
+			for (j = 0; j < bias_h; ++j) {
+				column[j] = region[j * bias_w + i];
+			}
+
+			levels[i] = overscan_estimate(handle->overscan, column, bias_h);
+		}
+	}
+
+	if (status == 0 && handle->overscan->fit_order >= 0) {
+		status = fit_overscan_levels(levels, n_levels, level_first, handle->overscan->fit_order,
+						handle->overscan_level, n_out, out_first);
+	} else if (status == 0) {
+		/* rows (columns) out of the overscan take the level of the nearest one */
+		for (i = 0; i < n_out; ++i) {
+			idx = out_first + i - level_first;
+			idx = idx < 0 ? 0 : (idx >= n_levels ? n_levels - 1 : idx);
+
+			handle->overscan_level[i] = levels[idx];
+		}
+	}
+
+	if (status == 0) {
+		handle->overscan_plane = plane;
+	}
+
+	free(region);
+	free(levels);
+	free(column);
 
-	return 0;
+	return status;
 }
 
-int fits_substract_image_matrix(fits_handle_t *handle, fits_handle_t *sb)
+static int substract_overscan(fits_handle_t *handle, long plane, int first_row, int rows, float *pixels)
 {
-	long i;
+	long x, y, width = handle->width;
+	const float *restrict level;
+	float *restrict pix;
+	float row_level;
+	int status;
 
-	if (!handle || !sb || !sb->image) {
-		return -EFAULT;
-	}
+	if (handle->overscan_plane != plane) {
+		status = measure_overscan(handle, plane);
 
-	if (!handle->image) {
-		return -ENOMEM;
+		if (status != 0) {
+			return status;
+		}
 	}
 
-	if (handle->width != sb->width || handle->height != sb->height) {
-		return -EFAULT;
-	}
+	level = handle->overscan_level;
 
-	for (i = 0; i < handle->width * handle->height; ++i) {
-		handle->image[i] -= sb->image[i];
+	for (y = 0; y < rows; ++y) {
+		pix = pixels + y * width;
+
+		if (handle->overscan_by_rows) {
+			row_level = level[first_row + y];
+
+			for (x = 0; x < width; ++x) {
+				pix[x] -= row_level;
+			}
+		} else {
+			for (x = 0; x < width; ++x) {
+				pix[x] -= level[x];
+			}
+		}
 	}
 
 	return 0;
 }
 
-int fits_get_image_size(fits_handle_t *handle)
+/*
+ * Rows are in the trimmed image coordinates,
+ *  overscan level is removed right after the load while the rows are in the cache
+ */
+static void count_saturated(fits_handle_t *handle, const float *pixels, long npixels)
 {
-	int status = 0;
-	long anaxes[2] = { 1, 1 };
-
-	fits_get_img_size(handle->src_fptr, 2, anaxes, &status);
-
-	handle->width = anaxes[0];
-	handle->height = anaxes[1];
+	long i, count = 0;
+	float level = handle->saturation;
 
-	fits_get_img_type(handle->src_fptr, &handle->bitpix, &status);
+	for (i = 0; i < npixels; ++i) {
+		count += pixels[i] >= level;
+	}
 
-	return status;
+	handle->saturated += count;
 }
 
-int fits_get_image_w(fits_handle_t *handle)
+int fits_read_rows(fits_handle_t *handle, long plane, int first_row, int rows, float *pixels)
 {
-	return handle->width;
-}
+	int status = 0;
+	long firstpix[FITS_MAX_AXES];
+	fits_section_t sec;
+
+	if (handle->trimmed) {
+		sec.x0 = handle->trim_sec.x0;
+		sec.x1 = handle->trim_sec.x1;
+		sec.y0 = handle->trim_sec.y0 + first_row;
+		sec.y1 = sec.y0 + rows;
+
+		status = read_section_pixels(handle, plane, &sec, pixels);
+	} else if (handle->raw.usable) {
+		status = read_raw_rows(handle, plane, first_row, rows, 0, pixels);
+	} else {
+		plane_first_pixel(handle, plane, first_row, firstpix);
 
-int fits_get_image_h(fits_handle_t *handle)
-{
-	return handle->height;
-}
+		fits_read_pix(handle->src_fptr, TFLOAT, firstpix,
+						(long) handle->width * rows, NULL, pixels, NULL, &status);
+	}
 
-int fits_load_image(fits_handle_t *handle)
-{
-	int status = 0;
-	long firstpix[2] = { 1, 1 };
-	long npixels;
+	/* saturation is checked on the raw values, before the overscan is subtracted */
+	if (status == 0 && handle->saturation > 0) {
+		count_saturated(handle, pixels, (long) handle->width * rows);
+	}
+
+	if (status == 0 && handle->has_overscan) {
+		status = substract_overscan(handle, plane, first_row, rows, pixels);
+	}
 
-	fits_get_image_size(handle);
+	return status;
+}
 
-	npixels = handle->width * handle->height;
+/*
+ * Rows of the untrimmed image in the file type, for the type specialized kernels.
+ *  Overscan isn't subtracted here.
+ */
+int fits_read_rows_raw(fits_handle_t *handle, long plane, int first_row, int rows, int datatype, void *pixels)
+{
+	int status = 0, native_size;
+	long firstpix[FITS_MAX_AXES];
 
-	handle->image = (long*) malloc(npixels * sizeof(long));
+	native_size = handle->raw.usable ? raw_native_size(&handle->raw, datatype) : 0;
 
-	if (!handle->image) {
-		return -errno;
+	if (native_size) {
+		return read_raw_rows(handle, plane, first_row, rows, native_size, pixels);
 	}
 
-	fits_read_pix(handle->src_fptr, TLONG, firstpix,
-					npixels, NULL, handle->image, NULL, &status);
+	plane_first_pixel(handle, plane, first_row, firstpix);
+
+	fits_read_pix(handle->src_fptr, datatype, firstpix, (long) handle->width * rows, NULL, pixels, NULL, &status);
 
 	return status;
 }
@@ -197,9 +1232,16 @@ void fits_free_image(fits_handle_t *handle)
 		return;
 	}
 
-	if (handle->image) {
+	if (handle->mapped_base) {
+		/* bad pixels list of the mapped master is in the same mapping */
+		munmap(handle->mapped_base, handle->mapped_size);
+	} else {
 		free(handle->image);
+		free(handle->bad_pixels);
 	}
+
+	handle->bad_pixels = NULL;
+	handle->bad_count = 0;
 }
 
 time_t fits_get_observation_dt(fits_handle_t *handle)
@@ -209,9 +1251,6 @@ time_t fits_get_observation_dt(fits_handle_t *handle)
 	size_t date_len;
 	int year = 0, month = 1, day = 0, hour = 0, minute = 0;
 	double second = 0;
-	struct tm timeval;
-
-	memset(&timeval, 0, sizeof(struct tm));
 
 	fits_read_key(handle->src_fptr, TSTRING, "DATE-OBS", date, NULL, &status);
 
@@ -232,14 +1271,8 @@ time_t fits_get_observation_dt(fits_handle_t *handle)
 
 	fits_str2time(date, &year, &month, &day, &hour, &minute, &second, &status);
 
-	timeval.tm_year = year - 1900;
-	timeval.tm_mon = month - 1;
-	timeval.tm_mday = day;
-	timeval.tm_hour = hour;
-	timeval.tm_min = minute;
-	timeval.tm_sec = (int) second;
-
-	return mktime(&timeval);
+	/* DATE-OBS is UTC, the conversion doesn't depend on TZ of the process */
+	return (time_t) floor(fits_utc_time(year, month, day, hour, minute, second));
 }
 
 int fits_get_object_name(fits_handle_t *handle, char *buf)
@@ -251,13 +1284,100 @@ int fits_get_object_name(fits_handle_t *handle, char *buf)
 	return status;
 }
 
+/* missing EXPTIME is zero, so it's rejected where the exposure is required */
 double fits_get_object_exptime(fits_handle_t *handle)
 {
 	int status = 0;
-	float result;
+	float result = 0;
 
 	fits_read_key(handle->src_fptr, TFLOAT, "EXPTIME", &result, NULL, &status);
 
+	return status == 0 ? result : 0;
+}
+
+double fits_get_ccd_temperature(fits_handle_t *handle)
+{
+	int status = 0;
+	double result;
+
+	fits_read_key(handle->src_fptr, TDOUBLE, "CCD-TEMP", &result, NULL, &status);
+
+	if (status != 0) {
+		return NAN;
+	}
+
+	return result;
+}
+
+double fits_get_gain(fits_handle_t *handle)
+{
+	int status = 0;
+	double result;
+
+	fits_read_key(handle->src_fptr, TDOUBLE, "GAIN", &result, NULL, &status);
+
+	if (status != 0 || result <= 0) {
+		return NAN;
+	}
+
+	return result;
+}
+
+/*
+ * SATURATE key when present, otherwise the max value of the integer data type
+ */
+double fits_get_saturation(fits_handle_t *handle)
+{
+	int status = 0;
+	double result;
+
+	fits_read_key(handle->src_fptr, TDOUBLE, "SATURATE", &result, NULL, &status);
+
+	if (status == 0 && result > 0) {
+		return result;
+	}
+
+	switch (handle->bitpix) {
+		case BYTE_IMG:
+			return 255;
+
+		case SBYTE_IMG:
+			return 127;
+
+		case SHORT_IMG:
+			return 32767;
+
+		case USHORT_IMG:
+			return 65535;
+
+		case LONG_IMG:
+			return 2147483647.0;
+
+		case ULONG_IMG:
+			return 4294967295.0;
+
+		default:
+			return NAN;
+	}
+}
+
+/* both spellings of the read noise key are common */
+double fits_get_readnoise(fits_handle_t *handle)
+{
+	int status = 0;
+	double result;
+
+	fits_read_key(handle->src_fptr, TDOUBLE, "RDNOISE", &result, NULL, &status);
+
+	if (status != 0) {
+		status = 0;
+		fits_read_key(handle->src_fptr, TDOUBLE, "READNOIS", &result, NULL, &status);
+	}
+
+	if (status != 0 || result < 0) {
+		return NAN;
+	}
+
 	return result;
 }
 
@@ -366,37 +1486,375 @@ int fits_copy_header_custom(fitsfile *src, fitsfile *dst)
 	return status;
 }
 
-int fits_save_as_new_file(fits_handle_t *handle, const char *filepath, const char *comment)
+static void resolve_output_format(fits_handle_t *handle, const fits_output_format_t *format,
+				int *bitpix, double *bzero, double *bscale)
+{
+	*bzero = 0;
+	*bscale = 1;
+
+	if (format && format->bitpix != 0) {
+		*bitpix = format->bitpix;
+
+		if (*bitpix > 0) {
+			*bzero = format->bzero;
+			*bscale = format->bscale != 0 ? format->bscale : 1;
+		}
+
+		return;
+	}
+
+	/* keep the representation of the source image */
+	switch (handle->bitpix) {
+		case USHORT_IMG:
+			*bitpix = SHORT_IMG;
+			*bzero = 32768;
+			break;
+
+		case ULONG_IMG:
+			*bitpix = LONG_IMG;
+			*bzero = 2147483648.0;
+			break;
+
+		case 0:
+			*bitpix = FLOAT_IMG;
+			break;
+
+		default:
+			*bitpix = handle->bitpix;
+			break;
+	}
+}
+
+/*
+ * cfitsio truncates floats written to the unscaled integer images,
+ *  so values are scaled, rounded half up and clamped here
+ *  and stored as is
+ */
+static int write_scaled_pixels(fits_handle_t *handle, long plane, long first_pixel, long npixels,
+				const float *pixels, int *status)
+{
+	long offset, chunk;
+	long fpx[FITS_MAX_AXES];
+	output_kernel_t kernel;
+	void *buf;
+
+	output_kernel_select(&kernel, handle->out_bitpix);
+
+	buf = malloc(OUTPUT_CHUNK_PIXELS * kernel.pixel_size);
+
+	if (!buf) {
+		return -errno;
+	}
+
+	for (offset = 0; offset < npixels && *status == 0; offset += chunk) {
+		chunk = npixels - offset;
+
+		if (chunk > OUTPUT_CHUNK_PIXELS) {
+			chunk = OUTPUT_CHUNK_PIXELS;
+		}
+
+		kernel.convert(pixels + offset, buf, handle->out_bzero, handle->out_bscale, handle->out_blank, chunk);
+
+		plane_first_pixel(handle, plane, (first_pixel + offset) / handle->width, fpx);
+		fpx[0] = (first_pixel + offset) % handle->width + 1;
+
+		fits_write_pix(handle->new_fptr, kernel.datatype, fpx, chunk, buf, status);
+	}
+
+	free(buf);
+
+	return *status;
+}
+
+int fits_create_new_file(fits_handle_t *handle, const char *filepath)
 {
-	unsigned int naxis = 2;
-	long naxes[2] = { handle->width, handle->height };
 	int status = 0;
+	fits_cache_policy_t *cache = &handle->cache;
 
 	fits_create_file(&handle->new_fptr, filepath, &status);
 
-	fits_create_img(handle->new_fptr, handle->bitpix, naxis, naxes, &status);
+	/* cfitsio descriptor isn't reachable, own one is used for the page cache control */
+	if (status == 0 && (cache->drop || cache->write_behind)) {
+		cache->out_fd = open(filepath[0] == '!' ? filepath + 1 : filepath, O_WRONLY);
+		cache->out_opened = cache->out_fd >= 0;
+		cache->pending = 0;
+	}
+
+	return status;
+}
+
+static void copy_extension_name(fitsfile *src, fitsfile *dst)
+{
+	int status = 0, extver;
+	char card[FLEN_CARD] = { 0 };
+
+	fits_read_key(src, TSTRING, "EXTNAME", card, NULL, &status);
+
+	if (status == 0) {
+		fits_write_key(dst, TSTRING, "EXTNAME", card, "Extension name", &status);
+	}
+
+	status = 0;
+
+	fits_read_key(src, TINT, "EXTVER", &extver, NULL, &status);
+
+	if (status == 0) {
+		fits_write_key(dst, TINT, "EXTVER", &extver, "Extension version", &status);
+	}
+}
+
+/*
+ * Appends HDU of the same geometry as the current source HDU to the new file,
+ *  HDUs which aren't calibrated are copied as is
+ */
+int fits_add_new_hdu(fits_handle_t *handle, const char *comment, const fits_output_format_t *format)
+{
+	int status = 0;
+	long naxes[FITS_MAX_AXES];
+	char history[FLEN_CARD] = { 0 };
+	output_kernel_t kernel;
+
+	if (!handle->new_fptr) {
+		return -EFAULT;
+	}
+
+	if (handle->src_fptr && !fits_is_image_hdu(handle)) {
+		fits_copy_hdu(handle->src_fptr, handle->new_fptr, 0, &status);
+
+		if (handle->hdu == 1) {
+			fits_write_comment(handle->new_fptr, comment, &status);
+		}
+
+		handle->out_bitpix = 0;
+
+		return status;
+	}
+
+	resolve_output_format(handle, format, &handle->out_bitpix, &handle->out_bzero, &handle->out_bscale);
+
+	/* flagged bad pixels are NaN, the integer images can't store them otherwise */
+	handle->out_blank = format && format->blank && handle->out_bitpix > 0;
+
+	if (handle->naxis < 2) {
+		handle->naxis = 2;
+	}
+
+	/* trimmed image is smaller than the source one */
+	memcpy(naxes, handle->naxes, sizeof(naxes));
+
+	naxes[0] = handle->width;
+	naxes[1] = handle->height;
+
+	fits_create_img(handle->new_fptr, handle->out_bitpix, handle->naxis, naxes, &status);
+
+	if (handle->out_bitpix > 0 && (handle->out_bzero != 0 || handle->out_bscale != 1)) {
+		fits_write_key(handle->new_fptr, TDOUBLE, "BSCALE", &handle->out_bscale, "Physical = BZERO + BSCALE * stored", &status);
+		fits_write_key(handle->new_fptr, TDOUBLE, "BZERO", &handle->out_bzero, "Physical = BZERO + BSCALE * stored", &status);
+	}
+
+	if (handle->out_blank) {
+		output_kernel_select(&kernel, handle->out_bitpix);
+		fits_write_key(handle->new_fptr, TLONG, "BLANK", &kernel.blank, "Stored value of the undefined pixels", &status);
+	}
 
 	if (handle->src_fptr) {
+		if (handle->hdu > 1) {
+			copy_extension_name(handle->src_fptr, handle->new_fptr);
+		}
+
 		fits_copy_header_custom(handle->src_fptr, handle->new_fptr);
 		fits_write_comment(handle->new_fptr, comment,  &status);
 	}
 
-	long fpx[2] = { 1L, 1L };
+	if (handle->has_overscan) {
+		snprintf(history, sizeof(history), "Overscan [%i:%i,%i:%i] %s subtracted",
+				handle->bias_sec.x0 + 1, handle->bias_sec.x1, handle->bias_sec.y0 + 1, handle->bias_sec.y1,
+				handle->overscan->mode == OVERSCAN_MEDIAN ? "median" : "mean");
+		fits_write_history(handle->new_fptr, history, &status);
+	}
+
+	if (handle->trimmed) {
+		snprintf(history, sizeof(history), "Trimmed to [%i:%i,%i:%i]",
+				handle->trim_sec.x0 + 1, handle->trim_sec.x1, handle->trim_sec.y0 + 1, handle->trim_sec.y1);
+		fits_write_history(handle->new_fptr, history, &status);
+	}
+
+	if (handle->out_bitpix > 0) {
+		/* stored values are prepared by write_scaled_pixels() */
+		fits_set_bscale(handle->new_fptr, 1.0, 0.0, &status);
+	}
+
+	return status;
+}
+
+/*
+ * New file can be shared by the handles of the different HDUs,
+ *  so the HDU is selected and its format is read back on every write.
+ *  Caller serializes the writes to the shared file
+ */
+static int select_new_hdu(fits_handle_t *handle)
+{
+	int status = 0, hdu = 0;
+	long blank;
+	double bzero = 0, bscale = 1;
+
+	fits_get_hdu_num(handle->new_fptr, &hdu);
+
+	if (hdu == (handle->hdu > 0 ? handle->hdu : 1) && handle->out_bitpix != 0) {
+		return 0;
+	}
+
+	fits_movabs_hdu(handle->new_fptr, handle->hdu > 0 ? handle->hdu : 1, NULL, &status);
+	fits_get_img_type(handle->new_fptr, &handle->out_bitpix, &status);
+
+	if (status != 0) {
+		return status;
+	}
+
+	if (handle->out_bitpix > 0) {
+		fits_read_key(handle->new_fptr, TDOUBLE, "BZERO", &bzero, NULL, &status);
+		status = 0;
+
+		fits_read_key(handle->new_fptr, TDOUBLE, "BSCALE", &bscale, NULL, &status);
+		status = 0;
+
+		fits_read_key(handle->new_fptr, TLONG, "BLANK", &blank, NULL, &status);
+		handle->out_blank = status == 0;
+		status = 0;
+
+		fits_set_bscale(handle->new_fptr, 1.0, 0.0, &status);
+	}
+
+	handle->out_bzero = bzero;
+	handle->out_bscale = bscale;
 
-	fits_write_pix(handle->new_fptr, TLONG, fpx, handle->width * handle->height, handle->image, &status);
+	return status;
+}
+
+int fits_write_rows(fits_handle_t *handle, long plane, int first_row, int rows, float *pixels)
+{
+	int status = 0;
+	long fpx[FITS_MAX_AXES];
+	long npixels = (long) handle->width * rows;
+
+	if (!handle->new_fptr) {
+		return -EFAULT;
+	}
+
+	status = select_new_hdu(handle);
+
+	if (status != 0) {
+		return status;
+	}
+
+	if (handle->out_bitpix < 0) {
+		plane_first_pixel(handle, plane, first_row, fpx);
+
+		fits_write_pix(handle->new_fptr, TFLOAT, fpx, npixels, pixels, &status);
+	} else {
+		write_scaled_pixels(handle, plane, (long) handle->width * first_row, npixels, pixels, &status);
+	}
+
+	fits_write_behind(handle, (size_t) npixels * (abs(handle->out_bitpix) / 8));
+
+	return status;
+}
+
+/*
+ * Starts the writeback of the output after every WRITE_BEHIND_BYTES,
+ *  pages written back since the previous call are clean and dropped with the drop policy
+ */
+void fits_write_behind(fits_handle_t *handle, size_t bytes)
+{
+	fits_cache_policy_t *cache = &handle->cache;
+
+	if (!cache->out_opened || !cache->write_behind) {
+		return;
+	}
+
+	cache->pending += bytes;
+
+	if (cache->pending < WRITE_BEHIND_BYTES) {
+		return;
+	}
+
+	cache->pending = 0;
+
+	if (cache->drop) {
+		posix_fadvise(cache->out_fd, 0, 0, POSIX_FADV_DONTNEED);
+	}
+
+	sync_file_range(cache->out_fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+}
+
+/* dirty pages can't be dropped, so with the drop the close waits for the writeback */
+static void release_output_pages(fits_cache_policy_t *cache)
+{
+	if (cache->drop) {
+		sync_file_range(cache->out_fd, 0, 0,
+				SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+		posix_fadvise(cache->out_fd, 0, 0, POSIX_FADV_DONTNEED);
+	} else {
+		sync_file_range(cache->out_fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+	}
+
+	close(cache->out_fd);
 
-	fits_close_file(handle->new_fptr, &status);
+	cache->out_opened = 0;
+}
+
+/*
+ * Every HDU gets DATASUM and CHECKSUM, DATASUM depends only on the data,
+ *  so the copies of the result can be verified on any host
+ */
+static int write_checksums(fitsfile *fptr)
+{
+	int hdu, hdus = 0, status = 0;
+
+	fits_get_num_hdus(fptr, &hdus, &status);
+
+	for (hdu = 1; hdu <= hdus && status == 0; hdu++) {
+		fits_movabs_hdu(fptr, hdu, NULL, &status);
+		fits_write_chksum(fptr, &status);
+	}
 
 	return status;
 }
 
+int fits_close_new_file(fits_handle_t *handle)
+{
+	int status = 0, close_status = 0;
+
+	if (!handle->new_fptr) {
+		return -EFAULT;
+	}
+
+	status = write_checksums(handle->new_fptr);
+
+	fits_close_file(handle->new_fptr, &close_status);
+
+	handle->new_fptr = NULL;
+
+	if (handle->cache.out_opened) {
+		release_output_pages(&handle->cache);
+	}
+
+	return status ? status : close_status;
+}
+
 void fits_release_file(fits_handle_t *handle)
 {
 	int status = 0;
 
+	if (handle->cache.drop) {
+		drop_source_pages(handle);
+	}
+
 	fits_close_file(handle->src_fptr, &status);
 
 	handle->src_fptr = NULL;
+
+	release_raw_unit(&handle->raw);
 }
 
 void fits_handler_free(fits_handle_t *handle)
@@ -406,6 +1864,10 @@ void fits_handler_free(fits_handle_t *handle)
 			fits_release_file(handle);
 		}
 
+		free(handle->overscan_level);
+
+		release_raw_unit(&handle->raw);
+
 		free(handle);
 		handle = NULL;
 	}
@@ -414,7 +1876,7 @@ void fits_handler_free(fits_handle_t *handle)
 void fits_get_status_code_msg(int status, char *buf)
 {
 	if (status < 0) {
-		buf = strerror(errno);
+		snprintf(buf, FLEN_STATUS, "%s", strerror(-status));
 	} else {
 		fits_get_errstatus(status, buf);
 	}
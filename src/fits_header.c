@@ -0,0 +1,367 @@
+/* 
+   fits_header.c
+    - fast scan of the primary header without opening the file by cfitsio
+
+   Copyright 2022  Oleg Kutkov <contact@olegkutkov.me>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "fits_header.h"
+
+/* blocks read by one pread, most of the headers fit */
+#define SCAN_BLOCKS 4
+
+/*
+ * Days since 1970-01-01 of the proleptic Gregorian date,
+ *  the algorithm of H. Hinnant, works without TZ and the libc tables
+ */
+static long days_from_civil(long y, int m, int d)
+{
+	long era, yoe, doy, doe;
+
+	y -= m <= 2;
+	era = (y >= 0 ? y : y - 399) / 400;
+	yoe = y - era * 400;
+	doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+	return era * 146097 + doe - 719468;
+}
+
+/*
+ * Seconds since the Unix epoch of the UTC date and time, same as timegm()
+ *  with the fractional seconds, reentrant and without the libc locks
+ */
+double fits_utc_time(int year, int month, int day, int hour, int minute, double second)
+{
+	return (double) days_from_civil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second;
+}
+
+/*
+ * DATE-OBS is YYYY-MM-DD[Thh:mm:ss[.s]] or the old DD/MM/YY,
+ *  time of the date without it is taken from TIME-OBS
+ */
+time_t fits_parse_date_obs(const char *date, const char *time_obs)
+{
+	int year = 0, month = 1, day = 1, hour = 0, minute = 0;
+	double second = 0;
+	const char *t;
+
+	if (!date || !*date) {
+		return 0;
+	}
+
+	if (strchr(date, '/')) {
+		if (sscanf(date, "%d/%d/%d", &day, &month, &year) != 3) {
+			return 0;
+		}
+
+		year += 1900;
+	} else if (sscanf(date, "%d-%d-%d", &year, &month, &day) != 3) {
+		return 0;
+	}
+
+	t = strchr(date, 'T');
+	t = t ? t + 1 : time_obs;
+
+	if (t) {
+		sscanf(t, "%d:%d:%lf", &hour, &minute, &second);
+	}
+
+	return (time_t) floor(fits_utc_time(year, month, day, hour, minute, second));
+}
+
+/* string value without quotes, doubled quotes are unescaped and the trailing spaces dropped */
+static void card_string(const char *card, char *dst, size_t size)
+{
+	const char *p = card + 10;
+	size_t n = 0;
+
+	while (p < card + FITS_CARD_SIZE && *p == ' ') {
+		p++;
+	}
+
+	if (p >= card + FITS_CARD_SIZE || *p != '\'') {
+		dst[0] = '\0';
+		return;
+	}
+
+	for (p++; p < card + FITS_CARD_SIZE && n + 1 < size; p++) {
+		if (*p == '\'') {
+			if (p + 1 < card + FITS_CARD_SIZE && p[1] == '\'') {
+				p++;
+			} else {
+				break;
+			}
+		}
+
+		dst[n++] = *p;
+	}
+
+	while (n > 0 && dst[n - 1] == ' ') {
+		n--;
+	}
+
+	dst[n] = '\0';
+}
+
+static double card_number(const char *card)
+{
+	char value[FITS_CARD_SIZE];
+	char *end;
+	double result;
+
+	memcpy(value, card + 10, FITS_CARD_SIZE - 10);
+	value[FITS_CARD_SIZE - 10] = '\0';
+
+	/* Fortran exponent is allowed by the standard */
+	for (end = value; *end && *end != '/'; end++) {
+		if (*end == 'D' || *end == 'd') {
+			*end = 'E';
+		}
+	}
+
+	*end = '\0';
+
+	result = strtod(value, &end);
+
+	return end == value ? NAN : result;
+}
+
+static int card_is(const char *card, const char *key)
+{
+	size_t len = strlen(key);
+
+	return memcmp(card, key, len) == 0 && (len == 8 || card[len] == ' ') && card[8] == '=';
+}
+
+static void parse_card(const char *card, fits_header_info_t *info, char *date, char *time_obs)
+{
+	int axis;
+
+	if (card_is(card, "BITPIX")) {
+		info->bitpix = (int) card_number(card);
+	} else if (card_is(card, "NAXIS")) {
+		info->naxis = (int) card_number(card);
+	} else if (memcmp(card, "NAXIS", 5) == 0 && card[8] == '=') {
+		axis = atoi(card + 5);
+
+		if (axis >= 1 && axis <= FITS_MAX_AXES) {
+			info->naxes[axis - 1] = (long) card_number(card);
+		}
+	} else if (card_is(card, "DATE-OBS")) {
+		card_string(card, date, FITS_CARD_SIZE);
+	} else if (card_is(card, "TIME-OBS")) {
+		card_string(card, time_obs, FITS_CARD_SIZE);
+	} else if (card_is(card, "EXPTIME")) {
+		info->exptime = card_number(card);
+	} else if (card_is(card, "CCD-TEMP")) {
+		info->ccd_temp = card_number(card);
+	}
+}
+
+/* compressed files and anything else the scanner doesn't parse go through cfitsio */
+static int scan_by_cfitsio(const char *path, fits_header_info_t *info)
+{
+	fits_handle_t *handle;
+	int status = 0;
+
+	handle = fits_handler_new(path, &status);
+
+	if (status == 0) {
+		info->obs_time = fits_get_observation_dt(handle);
+		info->exptime = fits_get_object_exptime(handle);
+		info->ccd_temp = fits_get_ccd_temperature(handle);
+
+		fits_get_img_param(handle->src_fptr, FITS_MAX_AXES, &info->bitpix, &info->naxis, info->naxes, &status);
+	}
+
+	fits_handler_free(handle);
+
+	return status;
+}
+
+typedef void (*card_cb) (const char *card, void *arg);
+
+typedef struct scan_ctx {
+	fits_header_info_t *info;
+	char date[FITS_CARD_SIZE];
+	char time_obs[FITS_CARD_SIZE];
+} scan_ctx_t;
+
+/*
+ * Reads the primary header by the blocks of 2880 bytes until the END card,
+ *  returns -EINVAL when the END card isn't found
+ */
+static int read_header(const char *path, card_cb cb, void *arg)
+{
+	char buf[SCAN_BLOCKS * FITS_BLOCK_SIZE];
+	off_t offset = 0;
+	ssize_t len;
+	long i;
+	int fd, status = -EINVAL, done = 0;
+
+	fd = open(path, O_RDONLY);
+
+	if (fd < 0) {
+		return -errno;
+	}
+
+	while (!done && offset < FITS_HEADER_MAX_BLOCKS * FITS_BLOCK_SIZE) {
+		len = pread(fd, buf, sizeof(buf), offset);
+
+		if (len < 0) {
+			status = -errno;
+			break;
+		}
+
+		len -= len % FITS_BLOCK_SIZE;
+
+		if (len == 0) {
+			break;
+		}
+
+		if (offset == 0 && memcmp(buf, "SIMPLE  =", 9) != 0) {
+			break;
+		}
+
+		for (i = 0; i < len; i += FITS_CARD_SIZE) {
+			if (memcmp(buf + i, "END     ", 8) == 0) {
+				done = 1;
+				break;
+			}
+
+			cb(buf + i, arg);
+		}
+
+		offset += len;
+	}
+
+	close(fd);
+
+	return done ? 0 : status;
+}
+
+static void scan_card(const char *card, void *arg)
+{
+	scan_ctx_t *ctx = (scan_ctx_t *) arg;
+
+	parse_card(card, ctx->info, ctx->date, ctx->time_obs);
+}
+
+/*
+ * No state is shared, so the files can be scanned in parallel
+ */
+int fits_header_scan(const char *path, fits_header_info_t *info)
+{
+	scan_ctx_t ctx;
+	int status;
+
+	memset(info, 0, sizeof(fits_header_info_t));
+	memset(&ctx, 0, sizeof(scan_ctx_t));
+
+	info->exptime = 0;
+	info->ccd_temp = NAN;
+
+	ctx.info = info;
+
+	status = read_header(path, scan_card, &ctx);
+
+	if (status != 0) {
+		return status == -EINVAL ? scan_by_cfitsio(path, info) : status;
+	}
+
+	if (isnan(info->exptime)) {
+		info->exptime = 0;
+	}
+
+	info->obs_time = fits_parse_date_obs(ctx.date, ctx.time_obs[0] ? ctx.time_obs : NULL);
+
+	return 0;
+}
+
+typedef struct key_ctx {
+	const char *key;
+	char *value;
+	size_t size;
+	int found;
+} key_ctx_t;
+
+static void key_card(const char *card, void *arg)
+{
+	key_ctx_t *ctx = (key_ctx_t *) arg;
+	const char *p, *end;
+	size_t n;
+
+	if (ctx->found || !card_is(card, ctx->key)) {
+		return;
+	}
+
+	ctx->found = 1;
+
+	card_string(card, ctx->value, ctx->size);
+
+	if (ctx->value[0]) {
+		return;
+	}
+
+	/* not a string, the value is taken as is up to the comment */
+	p = card + 10;
+
+	while (p < card + FITS_CARD_SIZE && *p == ' ') {
+		p++;
+	}
+
+	end = p;
+
+	while (end < card + FITS_CARD_SIZE && *end != '/') {
+		end++;
+	}
+
+	while (end > p && end[-1] == ' ') {
+		end--;
+	}
+
+	n = (size_t) (end - p) < ctx->size - 1 ? (size_t) (end - p) : ctx->size - 1;
+
+	memcpy(ctx->value, p, n);
+	ctx->value[n] = '\0';
+}
+
+/*
+ * Value of the primary header key as text, -ENOENT when the key is missing
+ */
+int fits_header_key(const char *path, const char *key, char *value, size_t size)
+{
+	key_ctx_t ctx = { key, value, size, 0 };
+	int status;
+
+	value[0] = '\0';
+
+	status = read_header(path, key_card, &ctx);
+
+	if (status != 0) {
+		return status;
+	}
+
+	return ctx.found ? 0 : -ENOENT;
+}
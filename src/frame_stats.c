@@ -0,0 +1,314 @@
+/* 
+   frame_stats.c
+    - quality statistics of the calibrated frames, accumulated strip by strip
+
+   Copyright 2022  Oleg Kutkov <contact@olegkutkov.me>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include "frame_stats.h"
+
+/* MAD of the normal distribution to its sigma */
+#define MAD_TO_SIGMA 1.4826
+
+static const char *qa_keys[][2] = {
+	{ "QAMEAN", "Mean of the calibrated pixels" },
+	{ "QAMEDIAN", "Median of the calibrated pixels" },
+	{ "QASIGMA", "Robust sigma, 1.4826 * MAD" },
+	{ "QAMIN", "Min of the calibrated pixels" },
+	{ "QAMAX", "Max of the calibrated pixels" },
+	{ "QANSAT", "Saturated pixels count" },
+	{ NULL, NULL }
+};
+
+static int is_short_integer(int bitpix)
+{
+	return bitpix == BYTE_IMG || bitpix == SBYTE_IMG || bitpix == SHORT_IMG || bitpix == USHORT_IMG;
+}
+
+/*
+ * Integer frames up to 16 bits are binned by 1 ADU, the median and MAD come
+ *  from the histogram. Other frames keep the every sample_step-th pixel.
+ */
+int frame_stats_init(frame_stats_t *stats, fits_handle_t *image)
+{
+	long total;
+
+	memset(stats, 0, sizeof(frame_stats_t));
+
+	stats->min = INFINITY;
+	stats->max = -INFINITY;
+
+	if (is_short_integer(image->bitpix)) {
+		stats->hist = (uint32_t*) calloc(STATS_HIST_BINS, sizeof(uint32_t));
+
+		return stats->hist ? 0 : -ENOMEM;
+	}
+
+	total = (long) image->width * image->height * (image->planes > 0 ? image->planes : 1);
+
+	stats->sample_step = total / STATS_MAX_SAMPLES + 1;
+	stats->samples = (float*) malloc(((total + stats->sample_step - 1) / stats->sample_step + 1) * sizeof(float));
+
+	return stats->samples ? 0 : -ENOMEM;
+}
+
+/*
+ * Sum is carried from strip to strip with the Kahan compensation,
+ *  so the mean doesn't depend on the strip size
+ */
+void frame_stats_add(frame_stats_t *stats, const float *pixels, long npixels)
+{
+	long i, bin, count = 0;
+	double sum = stats->sum, comp = stats->sum_comp, y, t;
+	float v, min = stats->min, max = stats->max;
+
+	for (i = 0; i < npixels; ++i) {
+		v = pixels[i];
+
+		/* flagged bad pixels are NaN */
+		if (isnan(v)) {
+			continue;
+		}
+
+		count++;
+
+		y = v - comp;
+		t = sum + y;
+		comp = (t - sum) - y;
+		sum = t;
+
+		min = v < min ? v : min;
+		max = v > max ? v : max;
+
+		if (stats->hist) {
+			bin = (long) floorf(v) + STATS_HIST_OFFSET;
+			bin = bin < 0 ? 0 : (bin >= STATS_HIST_BINS ? STATS_HIST_BINS - 1 : bin);
+
+			stats->hist[bin]++;
+		}
+	}
+
+	if (stats->samples) {
+		for (i = stats->sample_skip; i < npixels; i += stats->sample_step) {
+			if (!isnan(pixels[i])) {
+				stats->samples[stats->sample_count++] = pixels[i];
+			}
+		}
+
+		stats->sample_skip = i - npixels;
+	}
+
+	stats->count += count;
+	stats->sum = sum;
+	stats->sum_comp = comp;
+	stats->min = min;
+	stats->max = max;
+}
+
+static int compare_floats(const void *a, const void *b)
+{
+	float fa = *(const float *) a, fb = *(const float *) b;
+
+	return (fa > fb) - (fa < fb);
+}
+
+static double sorted_median(const float *values, long n)
+{
+	return n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2.0;
+}
+
+/*
+ * Median is interpolated inside its bin. Deviations of the bins grow in both
+ *  directions from the median bin, so the MAD is found by merging the two sides.
+ */
+static void histogram_median_mad(frame_stats_t *stats, double *median, double *mad)
+{
+	double half = stats->count / 2.0, cum = 0, dl, dr;
+	long b, l, r;
+
+	for (b = 0; b < STATS_HIST_BINS - 1 && cum + stats->hist[b] < half; ++b) {
+		cum += stats->hist[b];
+	}
+
+	*median = b - STATS_HIST_OFFSET + (stats->hist[b] ? (half - cum) / stats->hist[b] : 0.5);
+
+	cum = 0;
+	l = b;
+	r = b + 1;
+
+	while (1) {
+		dl = l >= 0 ? *median - (l - STATS_HIST_OFFSET + 0.5) : INFINITY;
+		dr = r < STATS_HIST_BINS ? (r - STATS_HIST_OFFSET + 0.5) - *median : INFINITY;
+
+		if (isinf(dl) && isinf(dr)) {
+			*mad = 0;
+			return;
+		}
+
+		if (dl <= dr) {
+			cum += stats->hist[l--];
+			*mad = fabs(dl);
+		} else {
+			cum += stats->hist[r++];
+			*mad = fabs(dr);
+		}
+
+		if (cum >= half) {
+			return;
+		}
+	}
+}
+
+static void samples_median_mad(frame_stats_t *stats, double *median, double *mad)
+{
+	long i, n = stats->sample_count;
+
+	qsort(stats->samples, n, sizeof(float), compare_floats);
+
+	*median = sorted_median(stats->samples, n);
+
+	for (i = 0; i < n; ++i) {
+		stats->samples[i] = fabsf(stats->samples[i] - (float) *median);
+	}
+
+	qsort(stats->samples, n, sizeof(float), compare_floats);
+
+	*mad = sorted_median(stats->samples, n);
+}
+
+void frame_stats_finish(frame_stats_t *stats)
+{
+	double median = NAN, mad = NAN;
+
+	if (stats->count == 0) {
+		stats->mean = stats->median = stats->sigma = NAN;
+		stats->min = stats->max = NAN;
+		return;
+	}
+
+	if (stats->hist) {
+		histogram_median_mad(stats, &median, &mad);
+	} else if (stats->sample_count > 0) {
+		samples_median_mad(stats, &median, &mad);
+	}
+
+	stats->mean = (stats->sum - stats->sum_comp) / stats->count;
+	stats->median = median;
+	stats->sigma = MAD_TO_SIGMA * mad;
+}
+
+void frame_stats_free(frame_stats_t *stats)
+{
+	free(stats->hist);
+	free(stats->samples);
+
+	stats->hist = NULL;
+	stats->samples = NULL;
+}
+
+/*
+ * Keys are written without values when the HDU is created, so filling them
+ *  after the data doesn't grow the header and move the next HDUs
+ */
+int frame_stats_reserve_keys(fits_handle_t *output)
+{
+	int i, status = 0;
+
+	for (i = 0; qa_keys[i][0]; ++i) {
+		fits_write_key_null(output->new_fptr, qa_keys[i][0], qa_keys[i][1], &status);
+	}
+
+	return status;
+}
+
+/* comments of the reserved keys are kept */
+int frame_stats_write_keys(fits_handle_t *output, int hdu, const frame_stats_t *stats)
+{
+	int status = 0;
+	double min = stats->min, max = stats->max;
+
+	if (stats->count == 0) {
+		return 0;
+	}
+
+	fits_movabs_hdu(output->new_fptr, hdu, NULL, &status);
+
+	fits_update_key(output->new_fptr, TDOUBLE, "QAMEAN", (void*) &stats->mean, NULL, &status);
+	fits_update_key(output->new_fptr, TDOUBLE, "QAMEDIAN", (void*) &stats->median, NULL, &status);
+	fits_update_key(output->new_fptr, TDOUBLE, "QASIGMA", (void*) &stats->sigma, NULL, &status);
+	fits_update_key(output->new_fptr, TDOUBLE, "QAMIN", &min, NULL, &status);
+	fits_update_key(output->new_fptr, TDOUBLE, "QAMAX", &max, NULL, &status);
+	fits_update_key(output->new_fptr, TLONG, "QANSAT", (void*) &stats->saturated, NULL, &status);
+
+	return status;
+}
+
+static void print_quoted(FILE *f, const char *str, int json)
+{
+	fputc('"', f);
+
+	for (; *str; ++str) {
+		if (json && (*str == '"' || *str == '\\')) {
+			fputc('\\', f);
+		} else if (!json && *str == '"') {
+			fputc('"', f);
+		}
+
+		fputc(*str, f);
+	}
+
+	fputc('"', f);
+}
+
+void frame_stats_print_header(FILE *f, int json)
+{
+	fputs(json ? "[\n" : "file,hdu,pixels,mean,median,sigma,min,max,saturated\n", f);
+}
+
+void frame_stats_print(FILE *f, int json, int first, const char *file, int hdu, const frame_stats_t *stats)
+{
+	if (json) {
+		fputs(first ? "  { \"file\": " : ",\n  { \"file\": ", f);
+		print_quoted(f, file, 1);
+		fprintf(f, ", \"hdu\": %i, \"pixels\": %li, ", hdu, stats->count);
+
+		if (stats->count == 0) {
+			fprintf(f, "\"mean\": null, \"median\": null, \"sigma\": null, \"min\": null, \"max\": null, ");
+		} else {
+			fprintf(f, "\"mean\": %.6g, \"median\": %.6g, \"sigma\": %.6g, \"min\": %.6g, \"max\": %.6g, ",
+					stats->mean, stats->median, stats->sigma, stats->min, stats->max);
+		}
+
+		fprintf(f, "\"saturated\": %li }", stats->saturated);
+	} else {
+		print_quoted(f, file, 0);
+		fprintf(f, ",%i,%li,%.6g,%.6g,%.6g,%.6g,%.6g,%li\n", hdu, stats->count,
+				stats->mean, stats->median, stats->sigma, stats->min, stats->max, stats->saturated);
+	}
+
+	fflush(f);
+}
+
+void frame_stats_print_footer(FILE *f, int json)
+{
+	if (json) {
+		fputs("\n]\n", f);
+	}
+}
@@ -0,0 +1,300 @@
+/* 
+   io_limiter.c
+    - bounded and adaptive concurrency of the file reads and writes, per device
+
+   Copyright 2022  Oleg Kutkov <contact@olegkutkov.me>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "io_limiter.h"
+
+/* adaptive permits are changed by one after every window of the measurements */
+#define IO_WINDOW_SEC 0.5
+#define IO_WINDOW_MIN_OPS 4
+/* changes of the rate within this fraction are the noise */
+#define IO_RATE_TOLERANCE 0.05
+/* latency grown this much without the rate gain means the device is overloaded */
+#define IO_LATENCY_RISE 1.5
+
+typedef struct io_queue {
+	int in_use;
+	int limit;
+	int max_limit;
+	int adaptive;
+	int direction;
+	struct timespec window_start;
+	size_t window_bytes;
+	long window_ops;
+	double window_latency;
+	double last_rate;
+	double last_latency;
+} io_queue_t;
+
+struct io_device {
+	dev_t dev;
+	io_queue_t queue[IO_KINDS];
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct io_device *next;
+};
+
+struct io_limiter {
+	int permits[IO_KINDS];
+	int adaptive;
+	io_device_t *devices;
+	pthread_mutex_t lock;
+};
+
+static double seconds_since(const struct timespec *start, const struct timespec *now)
+{
+	return (now->tv_sec - start->tv_sec) + (now->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+ * Zero permits is unlimited, unless the permits are adaptive
+ */
+io_limiter_t *io_limiter_new(int read_permits, int write_permits, int adaptive)
+{
+	io_limiter_t *limiter = (io_limiter_t *) calloc(1, sizeof(io_limiter_t));
+
+	if (!limiter) {
+		return NULL;
+	}
+
+	limiter->permits[IO_READ] = read_permits;
+	limiter->permits[IO_WRITE] = write_permits;
+	limiter->adaptive = adaptive;
+
+	pthread_mutex_init(&limiter->lock, NULL);
+
+	return limiter;
+}
+
+void io_limiter_free(io_limiter_t *limiter)
+{
+	io_device_t *next;
+
+	if (!limiter) {
+		return;
+	}
+
+	while (limiter->devices) {
+		next = limiter->devices->next;
+
+		pthread_cond_destroy(&limiter->devices->cond);
+		pthread_mutex_destroy(&limiter->devices->lock);
+		free(limiter->devices);
+
+		limiter->devices = next;
+	}
+
+	pthread_mutex_destroy(&limiter->lock);
+
+	free(limiter);
+}
+
+static void init_queue(io_queue_t *queue, int permits, int adaptive)
+{
+	queue->adaptive = adaptive;
+	queue->direction = 1;
+
+	if (adaptive) {
+		queue->max_limit = permits > 0 ? permits : IO_DEFAULT_MAX_PERMITS;
+		queue->limit = queue->max_limit > 1 ? queue->max_limit / 2 : 1;
+	} else {
+		queue->max_limit = permits > 0 ? permits : INT_MAX;
+		queue->limit = queue->max_limit;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &queue->window_start);
+}
+
+/* file which isn't created yet is on the device of its directory */
+static int path_device(const char *path, dev_t *dev)
+{
+	struct stat st;
+	const char *slash;
+	char *dir;
+	int status;
+
+	if (stat(path, &st) == 0) {
+		*dev = st.st_dev;
+		return 0;
+	}
+
+	slash = strrchr(path, '/');
+
+	if (!slash) {
+		status = stat(".", &st);
+	} else {
+		dir = strndup(path, slash > path ? (size_t) (slash - path) : 1);
+
+		if (!dir) {
+			return -1;
+		}
+
+		status = stat(dir, &st);
+
+		free(dir);
+	}
+
+	*dev = st.st_dev;
+
+	return status;
+}
+
+/*
+ * Permits are counted by the device of the path, so the files of one disk share them.
+ *  Returns NULL without the limiter, io_begin() and io_end() do nothing then
+ */
+io_device_t *io_limiter_device(io_limiter_t *limiter, const char *path)
+{
+	io_device_t *device;
+	dev_t dev;
+	int kind;
+
+	if (!limiter || path_device(path, &dev) != 0) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&limiter->lock);
+
+	for (device = limiter->devices; device; device = device->next) {
+		if (device->dev == dev) {
+			break;
+		}
+	}
+
+	if (!device) {
+		device = (io_device_t *) calloc(1, sizeof(io_device_t));
+
+		if (device) {
+			device->dev = dev;
+
+			for (kind = 0; kind < IO_KINDS; ++kind) {
+				init_queue(&device->queue[kind], limiter->permits[kind], limiter->adaptive);
+			}
+
+			pthread_mutex_init(&device->lock, NULL);
+			pthread_cond_init(&device->cond, NULL);
+
+			device->next = limiter->devices;
+			limiter->devices = device;
+		}
+	}
+
+	pthread_mutex_unlock(&limiter->lock);
+
+	return device;
+}
+
+void io_begin(io_device_t *device, int kind, struct timespec *start)
+{
+	io_queue_t *queue;
+
+	if (!device) {
+		return;
+	}
+
+	queue = &device->queue[kind];
+
+	pthread_mutex_lock(&device->lock);
+
+	while (queue->in_use >= queue->limit) {
+		pthread_cond_wait(&device->cond, &device->lock);
+	}
+
+	queue->in_use++;
+
+	pthread_mutex_unlock(&device->lock);
+
+	clock_gettime(CLOCK_MONOTONIC, start);
+}
+
+/*
+ * Hill climbing on the throughput: permits keep moving the same way while the rate grows,
+ *  and turn back when it falls or the latency grows without the rate gain.
+ *  Must be called with the device lock held
+ */
+static void adapt_limit(io_queue_t *queue, const struct timespec *now)
+{
+	double elapsed = seconds_since(&queue->window_start, now);
+	double rate, latency;
+
+	if (elapsed < IO_WINDOW_SEC || queue->window_ops < IO_WINDOW_MIN_OPS) {
+		return;
+	}
+
+	rate = queue->window_bytes / elapsed;
+	latency = queue->window_latency / queue->window_ops;
+
+	if (queue->last_rate > 0) {
+		if (rate < queue->last_rate * (1 - IO_RATE_TOLERANCE)
+				|| (latency > queue->last_latency * IO_LATENCY_RISE && rate < queue->last_rate * (1 + IO_RATE_TOLERANCE))) {
+			queue->direction = -queue->direction;
+		}
+	}
+
+	queue->limit += queue->direction;
+
+	if (queue->limit < 1 || queue->limit > queue->max_limit) {
+		queue->limit = queue->limit < 1 ? 1 : queue->max_limit;
+		queue->direction = -queue->direction;
+	}
+
+	queue->last_rate = rate;
+	queue->last_latency = latency;
+
+	queue->window_start = *now;
+	queue->window_bytes = 0;
+	queue->window_ops = 0;
+	queue->window_latency = 0;
+}
+
+void io_end(io_device_t *device, int kind, const struct timespec *start, size_t bytes)
+{
+	struct timespec now;
+	io_queue_t *queue;
+
+	if (!device) {
+		return;
+	}
+
+	queue = &device->queue[kind];
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	pthread_mutex_lock(&device->lock);
+
+	queue->in_use--;
+
+	if (queue->adaptive) {
+		queue->window_bytes += bytes;
+		queue->window_ops++;
+		queue->window_latency += seconds_since(start, &now);
+
+		adapt_limit(queue, &now);
+	}
+
+	pthread_cond_broadcast(&device->cond);
+
+	pthread_mutex_unlock(&device->lock);
+}
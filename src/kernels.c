@@ -0,0 +1,190 @@
+/* 
+   kernels.c
+    - calibration and output conversion kernels, specialized by the pixel types
+
+   Copyright 2022  Oleg Kutkov <contact@olegkutkov.me>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  
+ */
+
+#include <stdint.h>
+#include <limits.h>
+#include <math.h>
+#include "kernels.h"
+
+/*
+ * Every combination of the input type and the calibration steps is a separate
+ *  function without branches in the loop, the kernel is picked from the table
+ *  once per frame
+ */
+#define DEFINE_CALIB_KERNELS(name, type) \
+static void calib_dark_##name(const void *in_pix, float *out, const float *restrict bias, \
+						const float *restrict dark, float scale, long n) \
+{ \
+	const type *in = (const type *) in_pix; \
+	long i; \
+	\
+	for (i = 0; i < n; ++i) { \
+		out[i] = (float) in[i] - dark[i]; \
+	} \
+} \
+\
+static void calib_scaled_dark_##name(const void *in_pix, float *out, const float *restrict bias, \
+						const float *restrict dark, float scale, long n) \
+{ \
+	const type *in = (const type *) in_pix; \
+	long i; \
+	\
+	for (i = 0; i < n; ++i) { \
+		out[i] = (float) in[i] - (bias[i] + dark[i] * scale); \
+	} \
+} \
+\
+static long count_saturated_##name(const void *in_pix, float level, long n) \
+{ \
+	const type *in = (const type *) in_pix; \
+	long i, count = 0; \
+	\
+	for (i = 0; i < n; ++i) { \
+		count += (float) in[i] >= level; \
+	} \
+	\
+	return count; \
+}
+
+DEFINE_CALIB_KERNELS(u16, uint16_t)
+DEFINE_CALIB_KERNELS(i16, int16_t)
+DEFINE_CALIB_KERNELS(i32, int32_t)
+DEFINE_CALIB_KERNELS(f32, float)
+
+/*
+ * Same rounding and clipping as cfitsio does for the integer images,
+ *  only the limits and the stored type differ.
+ *  With blank the minimum is kept for NaN (BLANK) and the values are clipped above it
+ */
+#define DEFINE_OUTPUT_KERNEL(name, type, min_value, max_value) \
+static void output_##name(const float *restrict in, void *restrict out_pix, double bzero, double bscale, \
+				int blank, long n) \
+{ \
+	type *out = (type *) out_pix; \
+	double value, lower = blank ? (double) (min_value) + 1 : (min_value); \
+	long i; \
+	\
+	for (i = 0; i < n; ++i) { \
+		if (blank && isnan(in[i])) { \
+			out[i] = (min_value); \
+			continue; \
+		} \
+		\
+		value = floor((in[i] - bzero) / bscale + 0.5); \
+		\
+		if (!(value > lower)) { \
+			value = lower; \
+		} else if (value > (max_value)) { \
+			value = (max_value); \
+		} \
+		\
+		out[i] = (type) value; \
+	} \
+}
+
+DEFINE_OUTPUT_KERNEL(u8, unsigned char, 0, UCHAR_MAX)
+DEFINE_OUTPUT_KERNEL(i16, short, SHRT_MIN, SHRT_MAX)
+DEFINE_OUTPUT_KERNEL(i32, int, INT_MIN, INT_MAX)
+
+static const calib_kernel_fn calib_kernels[KERNEL_INPUTS][KERNEL_OPS_COUNT] = {
+	[KERNEL_IN_U16] = { calib_dark_u16, calib_scaled_dark_u16 },
+	[KERNEL_IN_I16] = { calib_dark_i16, calib_scaled_dark_i16 },
+	[KERNEL_IN_I32] = { calib_dark_i32, calib_scaled_dark_i32 },
+	[KERNEL_IN_F32] = { calib_dark_f32, calib_scaled_dark_f32 },
+};
+
+static const saturation_kernel_fn saturation_kernels[KERNEL_INPUTS] = {
+	[KERNEL_IN_U16] = count_saturated_u16,
+	[KERNEL_IN_I16] = count_saturated_i16,
+	[KERNEL_IN_I32] = count_saturated_i32,
+	[KERNEL_IN_F32] = count_saturated_f32,
+};
+
+static const int input_datatypes[KERNEL_INPUTS] = {
+	[KERNEL_IN_U16] = TUSHORT,
+	[KERNEL_IN_I16] = TSHORT,
+	[KERNEL_IN_I32] = TINT,
+	[KERNEL_IN_F32] = TFLOAT,
+};
+
+static const size_t input_sizes[KERNEL_INPUTS] = {
+	[KERNEL_IN_U16] = sizeof(uint16_t),
+	[KERNEL_IN_I16] = sizeof(int16_t),
+	[KERNEL_IN_I32] = sizeof(int32_t),
+	[KERNEL_IN_F32] = sizeof(float),
+};
+
+/*
+ * Equivalent BITPIX after BZERO/BSCALE, the types which don't fit
+ *  the integer kernels exactly are read as float by cfitsio
+ */
+int kernel_input_for_bitpix(int bitpix)
+{
+	switch (bitpix) {
+		case BYTE_IMG:
+		case USHORT_IMG:
+			return KERNEL_IN_U16;
+
+		case SBYTE_IMG:
+		case SHORT_IMG:
+			return KERNEL_IN_I16;
+
+		case LONG_IMG:
+			return KERNEL_IN_I32;
+
+		default:
+			return KERNEL_IN_F32;
+	}
+}
+
+void calib_kernel_select(calib_kernel_t *kernel, int input, int ops)
+{
+	kernel->input = input;
+	kernel->datatype = input_datatypes[input];
+	kernel->pixel_size = input_sizes[input];
+	kernel->apply = calib_kernels[input][ops];
+	kernel->count_saturated = saturation_kernels[input];
+}
+
+void output_kernel_select(output_kernel_t *kernel, int out_bitpix)
+{
+	switch (out_bitpix) {
+		case BYTE_IMG:
+			kernel->datatype = TBYTE;
+			kernel->pixel_size = sizeof(unsigned char);
+			kernel->convert = output_u8;
+			kernel->blank = 0;
+			break;
+
+		case SHORT_IMG:
+			kernel->datatype = TSHORT;
+			kernel->pixel_size = sizeof(short);
+			kernel->convert = output_i16;
+			kernel->blank = SHRT_MIN;
+			break;
+
+		default:
+			kernel->datatype = TINT;
+			kernel->pixel_size = sizeof(int);
+			kernel->convert = output_i32;
+			kernel->blank = INT_MIN;
+			break;
+	}
+}
@@ -25,9 +25,14 @@
 #include <unistd.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <errno.h>
 #include "version.h"
 #include "file_utils.h"
 #include "calibrator.h"
+#include "preview.h"
+#include "service.h"
+#include "work_claim.h"
+#include "raw_io.h"
 
 static volatile int RUN_FLAG = 0;
 
@@ -44,6 +49,40 @@ static struct option cmd_long_options[] =
 	{"min-calfiles", required_argument, 0, 'n'},
 	{"max-calfiles", required_argument, 0, 'm'},
 	{"jobs", required_argument, 0, 'j'},
+	{"affinity", no_argument, 0, 'a'},
+	{"cache-mem", required_argument, 0, 'c'},
+	{"cache-dir", required_argument, 0, 's'},
+	{"cache-size", required_argument, 0, 'z'},
+	{"out-bitpix", required_argument, 0, 'p'},
+	{"bzero", required_argument, 0, 'Z'},
+	{"bscale", required_argument, 0, 'S'},
+	{"dark-scale", no_argument, 0, 'x'},
+	{"dark-fit", no_argument, 0, 'F'},
+	{"temp-diff", required_argument, 0, 'T'},
+	{"strip-rows", required_argument, 0, 'r'},
+	{"overscan", required_argument, 0, 'O'},
+	{"overscan-fit", required_argument, 0, 'P'},
+	{"badpix", required_argument, 0, 'B'},
+	{"hot-sigma", required_argument, 0, 'H'},
+	{"dead-frac", required_argument, 0, 'D'},
+	{"crreject", required_argument, 0, 'C'},
+	{"qa-summary", required_argument, 0, 'Q'},
+	{"preview", required_argument, 0, 'v'},
+	{"preview-size", required_argument, 0, 'w'},
+	{"serve", required_argument, 0, 'L'},
+	{"manifest", required_argument, 0, 'M'},
+	{"shard", required_argument, 0, 'k'},
+	{"claim-dir", required_argument, 0, 'K'},
+	{"claim-timeout", required_argument, 0, 'g'},
+	{"priority", required_argument, 0, 'R'},
+	{"deadline", required_argument, 0, 'E'},
+	{"io-read", required_argument, 0, 'I'},
+	{"io-write", required_argument, 0, 'W'},
+	{"io-adaptive", no_argument, 0, 'A'},
+	{"raw-io", required_argument, 0, 'u'},
+	{"drop-cache", no_argument, 0, 'G'},
+	{"write-behind", no_argument, 0, 'Y'},
+	{"incremental", no_argument, 0, 'U'},
 	{0, 0, 0, 0}
 };
 
@@ -63,6 +102,40 @@ void show_help()
 	printf("\t-n, --min-calfiles\tSet minumum requred num of calibration files to process image (default is 2)\n");
 	printf("\t-m, --max-calfiles\tSet maximum requred num of calibration files to process image (default is 17)\n");
 	printf("\t-j, --jobs\t\tSet threads count per CPU\n");
+	printf("\t-a, --affinity\t\tPin worker threads to CPUs, spreading them over all NUMA nodes\n");
+	printf("\t-c, --cache-mem\t\tSet memory limit of the master frames cache in MB (default is 1024)\n");
+	printf("\t-s, --cache-dir\t\tKeep master frames in this directory, shared with other processes and later runs\n");
+	printf("\t-z, --cache-size\tSet size limit of the cache directory in MB (default is 8192, 0 is unlimited)\n");
+	printf("\t-p, --out-bitpix\tSet BITPIX of resulting files: -32, 8, 16 or 32 (default is same as source)\n");
+	printf("\t-Z, --bzero\t\tSet BZERO of the integer resulting files (default is 0)\n");
+	printf("\t-S, --bscale\t\tSet BSCALE of the integer resulting files (default is 1)\n");
+	printf("\t-x, --dark-scale\tScale bias-subtracted darks of any exposure to the image exposure, requires bias\n");
+	printf("\t-F, --dark-fit\t\tFit the dark scale for the minimal image noise (with --dark-scale)\n");
+	printf("\t-T, --temp-diff\t\tSet max CCD-TEMP diff between image and calibration file in C (default is 0, not checked)\n");
+	printf("\t-r, --strip-rows\tProcess images by strips of this many rows, 0 picks the strip size by the L2 cache size\n");
+	printf("\t-O, --overscan\t\tSubtract BIASSEC overscan level (mean or median) and trim to TRIMSEC/DATASEC\n");
+	printf("\t-P, --overscan-fit\tFit overscan levels with the polynomial of this order (default is no fit)\n");
+	printf("\t-B, --badpix\t\tCorrect bad pixels of the master dark: flag (set to NaN, BLANK in the integer results) or interp (from the row neighbours)\n");
+	printf("\t-H, --hot-sigma\t\tSet hot pixel threshold above the master dark median in robust sigmas (default is 5)\n");
+	printf("\t-D, --dead-frac\t\tSet dead pixel threshold as a fraction of the master dark median (default is 0.5, 0 is off)\n");
+	printf("\t-C, --crreject\t\tClean cosmic rays with L.A.Cosmic alike filter, value is the detection limit in sigmas (4.5 is typical)\n");
+	printf("\t-Q, --qa-summary\tWrite quality statistics of every calibrated HDU to the headers and to this CSV file (JSON for *.json)\n");
+	printf("\t-v, --preview\t\tSave zscale stretched 8-bit preview next to every resulting file: png or pgm\n");
+	printf("\t-w, --preview-size\tSet max width and height of the preview in pixels (default is 512)\n");
+	printf("\t-M, --manifest\t\tCalibrate the jobs of this CSV file instead of the input directory: input,output,darks,biases\n");
+	printf("\t-k, --shard\t\tCalibrate only the files of this shard, i/n of n instances, split by the file name hash\n");
+	printf("\t-K, --claim-dir\t\tClaim every file in this shared directory first, so several instances can take the same input\n");
+	printf("\t-g, --claim-timeout\tSet age of the claim in seconds after which it's taken over as stale (default is 3600)\n");
+	printf("\t-R, --priority\t\tCalibrate first the files matching the rule KEY=pattern:priority or age<seconds:priority, may be repeated\n");
+	printf("\t-E, --deadline\t\tOrder the files of the same priority by deadline, which is the file time plus this many seconds\n");
+	printf("\t-I, --io-read\t\tLimit the concurrent reads of every storage device to this many threads (default is unlimited)\n");
+	printf("\t-W, --io-write\t\tLimit the concurrent writes of every storage device to this many threads (default is unlimited)\n");
+	printf("\t-A, --io-adaptive\tTune the read and write limits of every device by the measured throughput, the limits are the maximum\n");
+	printf("\t-u, --raw-io\t\tRead the uncompressed data units past cfitsio by the batched direct requests: uring or pread\n");
+	printf("\t-G, --drop-cache\tDrop the science frames and results from the page cache after use, read ahead the calibration frames\n");
+	printf("\t-Y, --write-behind\tSend the results to the disk while they are written\n");
+	printf("\t-U, --incremental\tUpdate the previous master by the added and removed calibration frames instead of the full rebuild (not bit reproducible, updated masters aren't saved to --cache-dir)\n");
+	printf("\t-L, --serve\t\tRun as the calibration service on this unix socket, input and output are set by the requests\n");
 }
 
 void logger_msg(char *fmt, ...)
@@ -87,19 +160,37 @@ void calibration_done(void)
 
 int main(int argc, char **argv)
 {
-	int c;
+	int c, status = 0;
 	calibrator_params_t cparams;
+	calibrator_session_t *session;
 	char *indir = NULL, *outdir = NULL,
-		 *darkdir = NULL, *biasdir = NULL, *flatdir = NULL;
+		 *darkdir = NULL, *biasdir = NULL, *flatdir = NULL,
+		 *cachedir = NULL, *qafile = NULL, *servesock = NULL,
+		 *manifest = NULL, *claimdir = NULL;
 
 	long int timediff_max = 86400;
 	double expdiff_min = 65;
 	int calfiles_min = 2, calfiles_max = 17, jobs_count = 1;
+	int pin_threads = 0;
+	long cache_mem_mb = 1024, cache_disk_mb = 8192;
+	int out_bitpix = 0, dark_scaling = 0, dark_fit = 0, strip_rows = -1;
+	double out_bzero = 0, out_bscale = 1, tempdiff_max = 0;
+	int overscan_mode = OVERSCAN_NONE, overscan_fit = -1;
+	int badpix_mode = BADPIX_NONE;
+	double hot_sigma = 5, dead_fraction = 0.5, cr_sigclip = 0;
+	int preview_format = PREVIEW_NONE, preview_size = PREVIEW_DEFAULT_SIZE;
+	int shard_index = 0, shard_count = 1;
+	long claim_timeout = WORK_CLAIM_DEFAULT_TIMEOUT;
+	int io_read = 0, io_write = 0, io_adaptive = 0, raw_io = RAW_IO_NONE;
+	int drop_cache = 0, write_behind = 0, incremental = 0;
+	priority_rules_t priority_rules;
+
+	memset(&priority_rules, 0, sizeof(priority_rules_t));
 
 	while (1) {
 		int option_index = 0;
 
-		c = getopt_long(argc, argv, "hi:o:d:b:f:t:e:n:m:j:", cmd_long_options, &option_index);
+		c = getopt_long(argc, argv, "hi:o:d:b:f:t:e:n:m:j:ac:s:z:p:Z:S:xFT:r:O:P:B:H:D:C:Q:v:w:L:M:k:K:g:R:E:I:W:Au:GYU", cmd_long_options, &option_index);
 
 		if (c == -1) {
 			break;
@@ -150,6 +241,202 @@ int main(int argc, char **argv)
 				jobs_count = atoi(optarg);
 				break;
 
+			case 'a':
+				pin_threads = 1;
+				break;
+
+			case 'c':
+				cache_mem_mb = atol(optarg);
+				break;
+
+			case 's':
+				cachedir = optarg;
+				break;
+
+			case 'z':
+				cache_disk_mb = atol(optarg);
+				break;
+
+			case 'p':
+				out_bitpix = atoi(optarg);
+				break;
+
+			case 'Z':
+				out_bzero = atof(optarg);
+				break;
+
+			case 'S':
+				out_bscale = atof(optarg);
+				break;
+
+			case 'x':
+				dark_scaling = 1;
+				break;
+
+			case 'F':
+				dark_fit = 1;
+				break;
+
+			case 'T':
+				tempdiff_max = atof(optarg);
+				break;
+
+			case 'r':
+				strip_rows = atoi(optarg);
+				break;
+
+			case 'O':
+				if (strcmp(optarg, "mean") == 0) {
+					overscan_mode = OVERSCAN_MEAN;
+				} else if (strcmp(optarg, "median") == 0) {
+					overscan_mode = OVERSCAN_MEDIAN;
+				} else {
+					fprintf(stderr, "Unsupported overscan estimator %s, use mean or median\n\n", optarg);
+					show_help();
+					return -1;
+				}
+
+				break;
+
+			case 'P':
+				overscan_fit = atoi(optarg);
+				break;
+
+			case 'B':
+				if (strcmp(optarg, "flag") == 0) {
+					badpix_mode = BADPIX_FLAG;
+				} else if (strcmp(optarg, "interp") == 0) {
+					badpix_mode = BADPIX_INTERPOLATE;
+				} else {
+					fprintf(stderr, "Unsupported bad pixels correction %s, use flag or interp\n\n", optarg);
+					show_help();
+					return -1;
+				}
+
+				break;
+
+			case 'H':
+				hot_sigma = atof(optarg);
+				break;
+
+			case 'D':
+				dead_fraction = atof(optarg);
+				break;
+
+			case 'C':
+				cr_sigclip = atof(optarg);
+
+				if (cr_sigclip <= 0) {
+					fprintf(stderr, "Cosmic rays detection limit must be positive\n\n");
+					show_help();
+					return -1;
+				}
+
+				break;
+
+			case 'Q':
+				qafile = optarg;
+				break;
+
+			case 'v':
+				if (strcmp(optarg, "png") == 0) {
+					preview_format = PREVIEW_PNG;
+				} else if (strcmp(optarg, "pgm") == 0) {
+					preview_format = PREVIEW_PGM;
+				} else {
+					fprintf(stderr, "Unsupported preview format %s, use png or pgm\n\n", optarg);
+					show_help();
+					return -1;
+				}
+
+				break;
+
+			case 'w':
+				preview_size = atoi(optarg);
+
+				if (preview_size < 1) {
+					fprintf(stderr, "Preview size must be positive\n\n");
+					show_help();
+					return -1;
+				}
+
+				break;
+
+			case 'L':
+				servesock = optarg;
+				break;
+
+			case 'M':
+				manifest = optarg;
+				break;
+
+			case 'k':
+				if (sscanf(optarg, "%i/%i", &shard_index, &shard_count) != 2
+						|| shard_count < 1 || shard_index < 0 || shard_index >= shard_count) {
+					fprintf(stderr, "Shard must be i/n with 0 <= i < n\n\n");
+					show_help();
+					return -1;
+				}
+
+				break;
+
+			case 'K':
+				claimdir = optarg;
+				break;
+
+			case 'g':
+				claim_timeout = atol(optarg);
+				break;
+
+			case 'R':
+				if (priority_rule_parse(&priority_rules, optarg) != 0) {
+					fprintf(stderr, "Invalid priority rule %s, use KEY=pattern:priority or age<seconds:priority (max %i rules)\n\n",
+								optarg, PRIORITY_MAX_RULES);
+					show_help();
+					return -1;
+				}
+
+				break;
+
+			case 'E':
+				priority_rules.deadline = atol(optarg);
+				break;
+
+			case 'I':
+				io_read = atoi(optarg);
+				break;
+
+			case 'W':
+				io_write = atoi(optarg);
+				break;
+
+			case 'A':
+				io_adaptive = 1;
+				break;
+
+			case 'u':
+				raw_io = raw_io_mode_parse(optarg);
+
+				if (raw_io < 0) {
+					fprintf(stderr, "Invalid raw I/O mode %s, use uring or pread\n\n", optarg);
+					show_help();
+					return -1;
+				}
+
+				break;
+
+			case 'G':
+				drop_cache = 1;
+				break;
+
+			case 'Y':
+				write_behind = 1;
+				break;
+
+			case 'U':
+				incremental = 1;
+				break;
+
 			case '?':
 				show_help();
 				return -1;
@@ -159,32 +446,72 @@ int main(int argc, char **argv)
 		}
 	}
 
-	if (indir == NULL || outdir == NULL) {
+	if (servesock == NULL && manifest == NULL && (indir == NULL || outdir == NULL)) {
 		fprintf(stderr, "Please set input and output directories\n\n");
 		show_help();
 		return -1;
 	}
 
-	if (darkdir == NULL && biasdir == NULL && flatdir == NULL) {
+	/* manifest may pin the calibration frames of every job */
+	if (manifest == NULL && darkdir == NULL && biasdir == NULL && flatdir == NULL) {
 		fprintf(stderr, "Please set at least one of the directories: dark, bias, flat\n\n");
 		show_help();
 		return -1;
 	}
 
-	if (!is_file_exist(indir)) {
+	if (indir != NULL && !is_file_exist(indir)) {
 		fprintf(stderr, "Path %s doesn't exists\n", indir);
 		return -1;
 	}
 
-	if (!is_file_exist(outdir)) {
+	if (outdir != NULL && !is_file_exist(outdir)) {
 		fprintf(stderr, "Path %s doesn't exists\n", outdir);
 		return -1;
 	}
 
+	if (dark_scaling && manifest == NULL && (darkdir == NULL || biasdir == NULL)) {
+		fprintf(stderr, "Dark scaling requires both dark and bias directories\n\n");
+		show_help();
+		return -1;
+	}
+
+	if (out_bitpix != 0 && out_bitpix != -32 && out_bitpix != 8
+			&& out_bitpix != 16 && out_bitpix != 32) {
+		fprintf(stderr, "Unsupported output BITPIX %i\n\n", out_bitpix);
+		show_help();
+		return -1;
+	}
+
+	if (overscan_fit > FITS_OVERSCAN_MAX_ORDER) {
+		fprintf(stderr, "Max order of the overscan fit is %i\n\n", FITS_OVERSCAN_MAX_ORDER);
+		show_help();
+		return -1;
+	}
+
+	if (cachedir != NULL && !is_file_exist(cachedir)) {
+		fprintf(stderr, "Path %s doesn't exists\n", cachedir);
+		return -1;
+	}
+
+	if (claimdir != NULL && (!is_file_exist(claimdir) || strlen(claimdir) >= sizeof(cparams.claimpath))) {
+		fprintf(stderr, "Path %s doesn't exists\n", claimdir);
+		return -1;
+	}
+
+	if (qafile != NULL && strlen(qafile) >= sizeof(cparams.qapath)) {
+		fprintf(stderr, "QA summary path is too long\n");
+		return -1;
+	}
+
 	memset(&cparams, 0, sizeof(calibrator_params_t));
 
-	strcpy(cparams.inpath, indir);
-	strcpy(cparams.outpath, outdir);
+	if (indir != NULL) {
+		strcpy(cparams.inpath, indir);
+	}
+
+	if (outdir != NULL) {
+		strcpy(cparams.outpath, outdir);
+	}
 
 	if (darkdir != NULL) {
 		strcpy(cparams.darkpath, darkdir);
@@ -198,6 +525,18 @@ int main(int argc, char **argv)
 		strcpy(cparams.flatpath, flatdir);
 	}
 
+	if (cachedir != NULL) {
+		strcpy(cparams.cachepath, cachedir);
+	}
+
+	if (qafile != NULL) {
+		strcpy(cparams.qapath, qafile);
+	}
+
+	if (claimdir != NULL) {
+		strcpy(cparams.claimpath, claimdir);
+	}
+
 	RUN_FLAG = 1;
 	signal(SIGINT, interrupt_handler);
 
@@ -208,19 +547,87 @@ int main(int argc, char **argv)
 	cparams.max_calfiles = calfiles_max;
 	cparams.max_timediff = timediff_max;
 	cparams.min_exp_eq_percent = expdiff_min;
+	cparams.max_tempdiff = tempdiff_max;
+	cparams.dark_scaling = dark_scaling;
+	cparams.dark_fit = dark_fit;
 
 	cparams.jobs_count = jobs_count;
+	cparams.strip_rows = strip_rows;
+	cparams.pin_threads = pin_threads;
+	cparams.cache_mem_limit = (size_t) cache_mem_mb * 1024 * 1024;
+	cparams.cache_disk_limit = (size_t) cache_disk_mb * 1024 * 1024;
+	cparams.incremental = incremental;
+
+	cparams.out_format.bitpix = out_bitpix;
+	cparams.out_format.bzero = out_bzero;
+	cparams.out_format.bscale = out_bscale;
+	cparams.out_format.blank = badpix_mode != BADPIX_NONE;
+
+	cparams.overscan.mode = overscan_mode;
+	cparams.overscan.fit_order = overscan_fit;
+
+	cparams.badpix.mode = badpix_mode;
+	cparams.badpix.hot_sigma = hot_sigma;
+	cparams.badpix.dead_fraction = dead_fraction;
+
+	cparams.preview_format = preview_format;
+	cparams.preview_size = preview_size;
+
+	cparams.shard_index = shard_index;
+	cparams.shard_count = shard_count;
+	cparams.claim_timeout = claim_timeout;
+
+	cparams.io_read_permits = io_read;
+	cparams.io_write_permits = io_write;
+	cparams.io_adaptive = io_adaptive;
+	cparams.raw_io = raw_io;
+	cparams.drop_cache = drop_cache;
+	cparams.write_behind = write_behind;
+
+	cparams.priority = priority_rules;
+
+	cparams.crreject.sigclip = cr_sigclip;
+	cparams.crreject.sigfrac = CR_DEFAULT_SIGFRAC;
+	cparams.crreject.objlim = CR_DEFAULT_OBJLIM;
+	cparams.crreject.iterations = CR_DEFAULT_ITERATIONS;
 
 	cparams.run_flag = 1;
 
-	calibrate_files(&cparams);
+	session = calibrator_session_new(&cparams);
+
+	if (!session) {
+		printf("Unable to start calibrator: %s\n", strerror(errno));
+		return 1;
+	}
 
-	while (RUN_FLAG) {
-		sleep(1);
+	if (servesock != NULL) {
+		signal(SIGTERM, interrupt_handler);
+
+		status = calibrator_serve(session, servesock, &RUN_FLAG);
+
+		if (status != 0) {
+			fprintf(stderr, "Unable to serve on %s: %s\n", servesock, strerror(-status));
+		}
+	} else if (manifest != NULL) {
+		status = calibrate_manifest(session, manifest);
+
+		if (status < 0) {
+			fprintf(stderr, "Unable to read manifest %s: %s\n", manifest, strerror(-status));
+		} else {
+			status = 0;
+
+			while (RUN_FLAG) {
+				sleep(1);
+			}
+		}
+	} else if (calibrate_files(session) > 0) {
+		while (RUN_FLAG) {
+			sleep(1);
+		}
 	}
 
-	calibrator_stop(&cparams);
+	calibrator_session_free(session);
 
-    return 0;
+    return status ? 1 : 0;
 }
 
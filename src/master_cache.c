@@ -0,0 +1,751 @@
+/* 
+   master_cache.c
+    - in-run cache of the master calibration frames
+
+   Copyright 2022  Oleg Kutkov <contact@olegkutkov.me>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "cpu_topology.h"
+#include "shared_cache.h"
+#include "master_cache.h"
+
+/* Remote node must use a master this many times before it gets own replica */
+#define MASTER_REPLICA_MIN_HITS 2
+
+enum {
+	MASTER_BUILDING = 0,
+	MASTER_READY,
+	MASTER_FAILED
+};
+
+struct master_entry {
+	uint64_t key;
+	uint64_t group;
+	int state;
+	int refs;
+	int home_node;
+	unsigned long last_use;
+	size_t image_bytes;
+	unsigned int node_hits[CPU_TOPOLOGY_MAX_NODES];
+	fits_handle_t *replica[CPU_TOPOLOGY_MAX_NODES];
+	master_stack_t *stack;
+	size_t stack_bytes;
+	master_cache_t *cache;
+	struct master_entry *next;
+};
+
+struct master_cache {
+	master_entry_t *entries;
+	size_t cache_bytes;
+	size_t cache_max_bytes;
+	unsigned long use_tick;
+	int replicas_enabled;
+	int incremental;
+	char shared_dir[256];
+	size_t shared_max_size;
+	uint64_t key_variant;
+
+	pthread_mutex_t cache_lock;
+	pthread_cond_t cache_cond;
+};
+
+static void free_master_image(fits_handle_t *master)
+{
+	if (master) {
+		fits_free_image(master);
+		fits_handler_free(master);
+	}
+}
+
+static void free_entry(master_cache_t *cache, master_entry_t *entry)
+{
+	int node;
+
+	for (node = 0; node < CPU_TOPOLOGY_MAX_NODES; ++node) {
+		if (entry->replica[node]) {
+			free_master_image(entry->replica[node]);
+			cache->cache_bytes -= entry->image_bytes;
+		}
+	}
+
+	if (entry->stack) {
+		master_stack_free(entry->stack);
+		cache->cache_bytes -= entry->stack_bytes;
+	}
+
+	free(entry);
+}
+
+/* must be called with cache_lock held */
+static void unlink_entry(master_cache_t *cache, master_entry_t *entry)
+{
+	master_entry_t **pos;
+
+	for (pos = &cache->entries; *pos; pos = &(*pos)->next) {
+		if (*pos == entry) {
+			*pos = entry->next;
+			break;
+		}
+	}
+}
+
+/* must be called with cache_lock held */
+static void evict_unused(master_cache_t *cache)
+{
+	master_entry_t **pos, **lru, *victim;
+
+	while (cache->cache_bytes > cache->cache_max_bytes) {
+		lru = NULL;
+
+		for (pos = &cache->entries; *pos; pos = &(*pos)->next) {
+			if ((*pos)->refs > 0 || (*pos)->state != MASTER_READY) {
+				continue;
+			}
+
+			if (!lru || (*pos)->last_use < (*lru)->last_use) {
+				lru = pos;
+			}
+		}
+
+		if (!lru) {
+			break;
+		}
+
+		victim = *lru;
+		*lru = victim->next;
+
+		free_entry(cache, victim);
+	}
+}
+
+/*
+ * Variant identifies the processing of the frames before they are combined,
+ *  masters of the different variants are kept apart.
+ *  Incremental cache keeps the running sums of the masters for the next ones of the same group
+ */
+master_cache_t *master_cache_new(size_t max_bytes, int numa_replicas, const char *shared_path, size_t shared_max_bytes,
+				uint64_t variant, int incremental)
+{
+	master_cache_t *cache = (master_cache_t *) calloc(1, sizeof(master_cache_t));
+
+	if (!cache) {
+		return NULL;
+	}
+
+	cache->key_variant = variant;
+	cache->incremental = incremental;
+
+	cache->cache_max_bytes = max_bytes;
+	cache->replicas_enabled = numa_replicas && cpu_topology_nodes_count() > 1;
+
+	snprintf(cache->shared_dir, sizeof(cache->shared_dir), "%s", shared_path ? shared_path : "");
+	cache->shared_max_size = shared_max_bytes;
+
+	pthread_mutex_init(&cache->cache_lock, NULL);
+	pthread_cond_init(&cache->cache_cond, NULL);
+
+	return cache;
+}
+
+void master_cache_free(master_cache_t *cache)
+{
+	master_entry_t *next;
+
+	if (!cache) {
+		return;
+	}
+
+	while (cache->entries) {
+		next = cache->entries->next;
+		free_entry(cache, cache->entries);
+		cache->entries = next;
+	}
+
+	pthread_cond_destroy(&cache->cache_cond);
+	pthread_mutex_destroy(&cache->cache_lock);
+
+	free(cache);
+}
+
+static uint64_t hash_mix(uint64_t hash)
+{
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+
+	return hash;
+}
+
+static uint64_t hash_string(const char *str)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	while (*str) {
+		hash ^= (unsigned char) *str++;
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+/* identity of the file is its real path, size and modification time */
+uint64_t master_cache_file_id(const char *path)
+{
+	char real_path[PATH_MAX];
+	uint64_t file_hash;
+	struct stat st;
+
+	if (!realpath(path, real_path)) {
+		snprintf(real_path, sizeof(real_path), "%s", path);
+	}
+
+	file_hash = hash_string(real_path);
+
+	if (stat(real_path, &st) == 0) {
+		file_hash ^= hash_mix((uint64_t) st.st_size);
+		file_hash ^= hash_mix((uint64_t) st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec) >> 1;
+	}
+
+	return file_hash;
+}
+
+/*
+ * Group is everything in the key except the files,
+ *  masters of one group differ only by the frames they are made of
+ */
+static uint64_t master_group(master_cache_t *cache, int kind, int hdu, uint64_t depends)
+{
+	uint64_t group = 0;
+
+	/* same files combined in a different way give a different master */
+	if (kind != MASTER_MEAN) {
+		group ^= hash_mix(0x9e3779b97f4a7c15ULL * kind);
+	}
+
+	/* keys of the primary HDU masters are the same as for the single image files */
+	if (hdu > 1) {
+		group ^= hash_mix(0xc2b2ae3d27d4eb4fULL * hdu);
+	}
+
+	if (cache->key_variant) {
+		group ^= hash_mix(0x165667b19e3779f9ULL * cache->key_variant);
+	}
+
+	/* master made with the help of another one, e.g. dark current of the master bias */
+	if (depends) {
+		group ^= hash_mix(0x27d4eb2f165667c5ULL ^ depends);
+	}
+
+	return group;
+}
+
+/*
+ * Key identifies contents of the files, so it's the same in every process
+ *  and it changes when any of the calibration files is replaced.
+ *  Key doesn't depend on order of the files,
+ *  master frame is the same for any permutation of the input set.
+ *  Every image HDU of the multi-extension files has its own master
+ */
+uint64_t master_cache_key(master_cache_t *cache, list_node_t *files, int kind, int hdu, uint64_t depends)
+{
+	uint64_t key = 0;
+	list_node_t *tmp;
+
+	for (tmp = files; tmp; tmp = tmp->next) {
+		key += hash_mix(master_cache_file_id(tmp->object));
+	}
+
+	return key ^ master_group(cache, kind, hdu, depends);
+}
+
+static const char *file_name(const char *path)
+{
+	const char *name = strrchr(path, '/');
+
+	return name ? name + 1 : path;
+}
+
+static int compare_files(const void *a, const void *b)
+{
+	const char *path_a = *(const char **) a;
+	const char *path_b = *(const char **) b;
+	int ret = strcmp(file_name(path_a), file_name(path_b));
+
+	return ret ? ret : strcmp(path_a, path_b);
+}
+
+/*
+ * Frames are combined in the order of the file names, the directories don't matter,
+ *  so the master is the same bit by bit for any order of the input set, in every process and host
+ */
+static list_node_t *sorted_files(list_node_t *files)
+{
+	list_node_t *sorted = NULL, *tmp;
+	char **paths;
+	int i, count = 0;
+
+	for (tmp = files; tmp; tmp = tmp->next) {
+		count++;
+	}
+
+	paths = (char **) malloc((count + 1) * sizeof(char *));
+
+	if (!paths) {
+		return NULL;
+	}
+
+	for (i = 0, tmp = files; tmp; tmp = tmp->next) {
+		paths[i++] = tmp->object;
+	}
+
+	qsort(paths, count, sizeof(char *), compare_files);
+
+	/* list is built from the tail */
+	for (i = count - 1; i >= 0; --i) {
+		sorted = add_object_to_list(sorted, paths[i]);
+	}
+
+	free(paths);
+
+	return sorted;
+}
+
+/*
+ * Group may have the sums of the different sets, e.g. darks of every exposure,
+ *  the one with most of the new files moves to the new master, must be called with cache_lock held
+ */
+static master_stack_t *take_stack(master_cache_t *cache, uint64_t group, const uint64_t *ids, int ids_count,
+				uint64_t *taken_key)
+{
+	master_entry_t *entry, *best = NULL;
+	master_stack_t *stack;
+	int overlap, best_overlap = 0;
+
+	for (entry = cache->entries; entry; entry = entry->next) {
+		if (!entry->stack || entry->group != group) {
+			continue;
+		}
+
+		overlap = master_stack_overlap(entry->stack, ids, ids_count);
+
+		if (overlap > best_overlap || (overlap > 0 && overlap == best_overlap && entry->last_use > best->last_use)) {
+			best = entry;
+			best_overlap = overlap;
+		}
+	}
+
+	if (!best) {
+		return NULL;
+	}
+
+	stack = best->stack;
+	*taken_key = best->key;
+
+	cache->cache_bytes -= best->stack_bytes;
+	best->stack = NULL;
+	best->stack_bytes = 0;
+
+	return stack;
+}
+
+static uint64_t *files_ids(list_node_t *files, int *count)
+{
+	list_node_t *tmp;
+	uint64_t *ids;
+	int i = 0;
+
+	for (tmp = files; tmp; tmp = tmp->next) {
+		i++;
+	}
+
+	ids = (uint64_t *) malloc((i + 1) * sizeof(uint64_t));
+
+	if (!ids) {
+		return NULL;
+	}
+
+	for (i = 0, tmp = files; tmp; tmp = tmp->next) {
+		ids[i++] = master_cache_file_id(tmp->object);
+	}
+
+	*count = i;
+
+	return ids;
+}
+
+/*
+ * Previous master of the group is updated when fewer files changed than there are in the new set:
+ *  the removed frames are subtracted and the new ones added.
+ *  Otherwise, or if the update fails half way, all the files are stacked from scratch
+ *  and *updated is left 0
+ */
+static master_stack_t *update_stack(master_cache_t *cache, uint64_t group, list_node_t *files,
+				master_stack_cb stack_files, void *build_arg, uint64_t *taken_key, int *updated)
+{
+	master_stack_t *stack = NULL;
+	list_node_t *added, *removed;
+	uint64_t *ids = NULL;
+	int changed, files_count = 0;
+
+	files = sorted_files(files);
+
+	if (!files) {
+		return NULL;
+	}
+
+	if (cache->incremental) {
+		ids = files_ids(files, &files_count);
+	}
+
+	if (ids) {
+		pthread_mutex_lock(&cache->cache_lock);
+		stack = take_stack(cache, group, ids, files_count, taken_key);
+		pthread_mutex_unlock(&cache->cache_lock);
+
+		if (!stack && cache->shared_dir[0]) {
+			stack = shared_cache_load_stack(cache->shared_dir, group, ids, files_count);
+		}
+
+		free(ids);
+	}
+
+	if (stack) {
+		changed = master_stack_diff(stack, files, &added, &removed);
+
+		if (changed < 0 || changed >= files_count
+				|| stack_files(build_arg, removed, -1, stack) != 0
+				|| stack_files(build_arg, added, 1, stack) != 0) {
+			master_stack_free(stack);
+			stack = NULL;
+		} else {
+			*updated = 1;
+		}
+
+		free_list(added);
+		free_list(removed);
+	}
+
+	if (!stack) {
+		stack = master_stack_new();
+
+		if (stack && stack_files(build_arg, files, 1, stack) != 0) {
+			master_stack_free(stack);
+			stack = NULL;
+		}
+	}
+
+	free_list(files);
+
+	return stack;
+}
+
+/* running sums are handed over to the entry only by the incremental cache */
+static fits_handle_t *combine_master(master_cache_t *cache, uint64_t key, uint64_t group, list_node_t *files,
+				master_stack_cb stack_files, master_finish_cb finish, void *build_arg,
+				int *count, master_stack_t **stack_out, int *updated)
+{
+	uint64_t taken_key = 0;
+	master_stack_t *stack = update_stack(cache, group, files, stack_files, build_arg, &taken_key, updated);
+	fits_handle_t *master;
+
+	if (!stack) {
+		return NULL;
+	}
+
+	master = master_stack_mean(stack);
+
+	*count = master ? stack->count : 0;
+
+	if (master && finish) {
+		finish(build_arg, master);
+	}
+
+	if (master && cache->incremental) {
+		/* sums moved from the master in memory are saved by the new key only */
+		if (cache->shared_dir[0]) {
+			shared_cache_publish_stack(cache->shared_dir, key, group, stack);
+
+			if (taken_key && taken_key != key) {
+				shared_cache_remove_stack(cache->shared_dir, taken_key);
+			}
+		}
+
+		*stack_out = stack;
+	} else {
+		master_stack_free(stack);
+	}
+
+	return master;
+}
+
+static fits_handle_t *build_master(master_cache_t *cache, uint64_t key, uint64_t group, list_node_t *files,
+				master_stack_cb stack_files, master_finish_cb finish, void *build_arg,
+				int *count, master_stack_t **stack_out)
+{
+	const char *shared_dir = cache->shared_dir;
+	fits_handle_t *master;
+	int lock_fd, updated = 0;
+
+	if (!shared_dir[0]) {
+		return combine_master(cache, key, group, files, stack_files, finish, build_arg, count, stack_out, &updated);
+	}
+
+	master = shared_cache_lookup(shared_dir, key, count);
+
+	if (master) {
+		return master;
+	}
+
+	lock_fd = shared_cache_lock(shared_dir, key);
+
+	/* another process could publish it while we were waiting for the lock */
+	master = shared_cache_lookup(shared_dir, key, count);
+
+	if (!master) {
+		master = combine_master(cache, key, group, files, stack_files, finish, build_arg, count, stack_out, &updated);
+
+		/*
+		 * Updated master depends on the history of the sums: the dark current terms aren't exact
+		 *  in double and the added frames follow the old sum, not the file names order.
+		 *  Only the masters stacked from scratch are shared, they are the same in every process
+		 */
+		if (master && !updated && lock_fd >= 0
+				&& shared_cache_publish(shared_dir, key, files, master, *count) == 0) {
+			shared_cache_evict(shared_dir, cache->shared_max_size);
+		}
+	}
+
+	shared_cache_unlock(shared_dir, key, lock_fd);
+
+	return master;
+}
+
+master_entry_t *master_cache_acquire(master_cache_t *cache, list_node_t *files, int kind, int hdu, uint64_t depends,
+				int node, master_stack_cb stack_files, master_finish_cb finish, void *build_arg)
+{
+	master_entry_t *entry;
+	master_stack_t *stack = NULL;
+	fits_handle_t *master;
+	int count = 0;
+	uint64_t group = master_group(cache, kind, hdu, depends);
+	uint64_t key = master_cache_key(cache, files, kind, hdu, depends);
+
+	if (node < 0 || node >= CPU_TOPOLOGY_MAX_NODES) {
+		node = 0;
+	}
+
+	pthread_mutex_lock(&cache->cache_lock);
+
+retry:
+	for (entry = cache->entries; entry; entry = entry->next) {
+		if (entry->key == key) {
+			break;
+		}
+	}
+
+	if (entry) {
+		entry->refs++;
+		entry->last_use = ++cache->use_tick;
+
+		while (entry->state == MASTER_BUILDING) {
+			pthread_cond_wait(&cache->cache_cond, &cache->cache_lock);
+		}
+
+		/* failed entry is already unlinked, the last waiter frees it and the key is built again */
+		if (entry->state == MASTER_FAILED) {
+			if (--entry->refs == 0) {
+				free_entry(cache, entry);
+			}
+
+			goto retry;
+		}
+
+		entry->node_hits[node]++;
+
+		pthread_mutex_unlock(&cache->cache_lock);
+
+		return entry;
+	}
+
+	entry = (master_entry_t *) calloc(1, sizeof(master_entry_t));
+
+	if (!entry) {
+		pthread_mutex_unlock(&cache->cache_lock);
+		return NULL;
+	}
+
+	entry->key = key;
+	entry->group = group;
+	entry->refs = 1;
+	entry->home_node = node;
+	entry->state = MASTER_BUILDING;
+	entry->last_use = ++cache->use_tick;
+	entry->node_hits[node] = 1;
+	entry->cache = cache;
+	entry->next = cache->entries;
+	cache->entries = entry;
+
+	pthread_mutex_unlock(&cache->cache_lock);
+
+	/* other users of this key are waiting on the entry until build is done */
+	master = build_master(cache, key, group, files, stack_files, finish, build_arg, &count, &stack);
+
+	pthread_mutex_lock(&cache->cache_lock);
+
+	if (!master) {
+		master_stack_free(stack);
+
+		unlink_entry(cache, entry);
+		entry->state = MASTER_FAILED;
+
+		if (--entry->refs == 0) {
+			free_entry(cache, entry);
+		}
+
+		pthread_cond_broadcast(&cache->cache_cond);
+		pthread_mutex_unlock(&cache->cache_lock);
+
+		return NULL;
+	}
+
+	entry->replica[node] = master;
+	entry->image_bytes = (size_t) master->width * master->height * sizeof(*master->image)
+				+ master->bad_count * sizeof(*master->bad_pixels);
+	cache->cache_bytes += entry->image_bytes;
+
+	if (stack) {
+		entry->stack = stack;
+		entry->stack_bytes = master_stack_bytes(stack);
+		cache->cache_bytes += entry->stack_bytes;
+	}
+
+	entry->state = MASTER_READY;
+
+	pthread_cond_broadcast(&cache->cache_cond);
+
+	evict_unused(cache);
+
+	pthread_mutex_unlock(&cache->cache_lock);
+
+	return entry;
+}
+
+static fits_handle_t *make_replica(fits_handle_t *src)
+{
+	int status = 0;
+	fits_handle_t *copy = fits_handler_mem_new(&status);
+
+	if (!copy) {
+		return NULL;
+	}
+
+	if (fits_create_image_mem(copy, src->width, src->height) != 0) {
+		fits_handler_free(copy);
+		return NULL;
+	}
+
+	copy->bitpix = src->bitpix;
+
+	fits_copy_image(copy, src);
+
+	if (fits_copy_bad_pixels(copy, src) != 0) {
+		free_master_image(copy);
+		return NULL;
+	}
+
+	return copy;
+}
+
+fits_handle_t *master_entry_image(master_entry_t *entry, int node)
+{
+	fits_handle_t *home, *local;
+	master_cache_t *cache;
+
+	if (!entry) {
+		return NULL;
+	}
+
+	cache = entry->cache;
+
+	pthread_mutex_lock(&cache->cache_lock);
+
+	home = entry->replica[entry->home_node];
+
+	if (!home || !cache->replicas_enabled || node < 0 || node >= CPU_TOPOLOGY_MAX_NODES) {
+		pthread_mutex_unlock(&cache->cache_lock);
+		return home;
+	}
+
+	local = entry->replica[node];
+
+	if (local || entry->node_hits[node] < MASTER_REPLICA_MIN_HITS) {
+		pthread_mutex_unlock(&cache->cache_lock);
+		return local ? local : home;
+	}
+
+	pthread_mutex_unlock(&cache->cache_lock);
+
+	/* copy is done by the calling thread, so the pages are placed on its node */
+	local = make_replica(home);
+
+	if (!local) {
+		return home;
+	}
+
+	pthread_mutex_lock(&cache->cache_lock);
+
+	if (entry->replica[node]) {
+		free_master_image(local);
+		local = entry->replica[node];
+	} else {
+		entry->replica[node] = local;
+		cache->cache_bytes += entry->image_bytes;
+	}
+
+	pthread_mutex_unlock(&cache->cache_lock);
+
+	return local;
+}
+
+uint64_t master_entry_key(master_entry_t *entry)
+{
+	return entry ? entry->key : 0;
+}
+
+void master_cache_release(master_entry_t *entry)
+{
+	master_cache_t *cache;
+
+	if (!entry) {
+		return;
+	}
+
+	cache = entry->cache;
+
+	pthread_mutex_lock(&cache->cache_lock);
+
+	entry->refs--;
+
+	evict_unused(cache);
+
+	pthread_mutex_unlock(&cache->cache_lock);
+}
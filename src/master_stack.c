@@ -0,0 +1,325 @@
+/* 
+   master_stack.c
+    - running sums of the calibration frames, updated when the set of files changes
+
+   Copyright 2022  Oleg Kutkov <contact@olegkutkov.me>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include "master_cache.h"
+#include "master_stack.h"
+
+/* pixels are added by blocks of this size */
+#define MASTER_STACK_BLOCK 1024
+
+master_stack_t *master_stack_new(void)
+{
+	return (master_stack_t *) calloc(1, sizeof(master_stack_t));
+}
+
+void master_stack_free(master_stack_t *stack)
+{
+	int i;
+
+	if (!stack) {
+		return;
+	}
+
+	for (i = 0; i < stack->files_count; ++i) {
+		free(stack->files[i].path);
+	}
+
+	free(stack->files);
+	free(stack->sum);
+	free(stack->comp);
+	free(stack);
+}
+
+size_t master_stack_bytes(master_stack_t *stack)
+{
+	size_t bytes = sizeof(master_stack_t) + stack->files_allocated * sizeof(master_stack_file_t);
+	int i;
+
+	if (stack->sum) {
+		bytes += (size_t) stack->width * stack->height * (sizeof(*stack->sum) + sizeof(*stack->comp));
+	}
+
+	for (i = 0; i < stack->files_count; ++i) {
+		bytes += strlen(stack->files[i].path) + 1;
+	}
+
+	return bytes;
+}
+
+/* Kahan summation, the pixels are independent, so the loop is vectorized */
+static void add_compensated(double *restrict sum, double *restrict comp, const double *restrict values, long n)
+{
+	long i;
+	double y, t;
+
+	for (i = 0; i < n; ++i) {
+		y = values[i] - comp[i];
+		t = sum[i] + y;
+		comp[i] = (t - sum[i]) - y;
+		sum[i] = t;
+	}
+}
+
+/*
+ * Adds (sign 1) or takes out (sign -1) one frame, the bias is subtracted and the difference
+ *  is scaled in float, so the term of the removed frame is the same as the one which was added.
+ *  First frame sets the size of the stack
+ */
+int master_stack_add(master_stack_t *stack, fits_handle_t *frame, fits_handle_t *bias, float scale, int sign)
+{
+	long i, start, n, npixels;
+	double values[MASTER_STACK_BLOCK];
+	const float *restrict frame_pix;
+	const float *restrict bias_pix;
+
+	if (!stack || !frame || !frame->image) {
+		return -EFAULT;
+	}
+
+	if (bias && (!bias->image || bias->width != frame->width || bias->height != frame->height)) {
+		return -EINVAL;
+	}
+
+	if (!stack->sum) {
+		stack->sum = (double *) calloc((size_t) frame->width * frame->height, sizeof(double));
+		stack->comp = (double *) calloc((size_t) frame->width * frame->height, sizeof(double));
+
+		if (!stack->sum || !stack->comp) {
+			free(stack->sum);
+			free(stack->comp);
+			stack->sum = stack->comp = NULL;
+
+			return -ENOMEM;
+		}
+
+		stack->width = frame->width;
+		stack->height = frame->height;
+		stack->bitpix = frame->bitpix;
+	}
+
+	if (stack->width != frame->width || stack->height != frame->height) {
+		return -EINVAL;
+	}
+
+	npixels = (long) stack->width * stack->height;
+	frame_pix = frame->image;
+	bias_pix = bias ? bias->image : NULL;
+
+	/* terms of a block are made first, so both loops stay simple enough to vectorize */
+	for (start = 0; start < npixels; start += n) {
+		n = npixels - start < MASTER_STACK_BLOCK ? npixels - start : MASTER_STACK_BLOCK;
+
+		if (bias_pix) {
+			for (i = 0; i < n; ++i) {
+				values[i] = sign * (double) ((frame_pix[start + i] - bias_pix[start + i]) * scale);
+			}
+		} else {
+			for (i = 0; i < n; ++i) {
+				values[i] = sign * (double) frame_pix[start + i];
+			}
+		}
+
+		add_compensated(stack->sum + start, stack->comp + start, values, n);
+	}
+
+	stack->count += sign;
+
+	return 0;
+}
+
+/* file is recorded by its identity, it can be taken out only while unchanged */
+int master_stack_track(master_stack_t *stack, const char *path, int frames)
+{
+	char real_path[PATH_MAX];
+	master_stack_file_t *files;
+
+	if (!realpath(path, real_path)) {
+		snprintf(real_path, sizeof(real_path), "%s", path);
+	}
+
+	if (stack->files_count == stack->files_allocated) {
+		stack->files_allocated = stack->files_allocated ? stack->files_allocated * 2 : 16;
+
+		files = (master_stack_file_t *) realloc(stack->files, stack->files_allocated * sizeof(master_stack_file_t));
+
+		if (!files) {
+			return -ENOMEM;
+		}
+
+		stack->files = files;
+	}
+
+	files = &stack->files[stack->files_count];
+
+	files->path = strdup(real_path);
+
+	if (!files->path) {
+		return -ENOMEM;
+	}
+
+	files->id = master_cache_file_id(real_path);
+	files->frames = frames;
+
+	stack->files_count++;
+
+	return 0;
+}
+
+int master_stack_find(master_stack_t *stack, const char *path)
+{
+	int i;
+
+	for (i = 0; i < stack->files_count; ++i) {
+		if (!strcmp(stack->files[i].path, path)) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+void master_stack_untrack(master_stack_t *stack, int index)
+{
+	if (index < 0 || index >= stack->files_count) {
+		return;
+	}
+
+	free(stack->files[index].path);
+
+	stack->files_count--;
+	stack->files[index] = stack->files[stack->files_count];
+}
+
+/* files of the stack which are in the ids list */
+int master_stack_overlap(master_stack_t *stack, const uint64_t *ids, int ids_count)
+{
+	int i, j, overlap = 0;
+
+	for (i = 0; i < stack->files_count; ++i) {
+		for (j = 0; j < ids_count; ++j) {
+			if (stack->files[i].id == ids[j]) {
+				overlap++;
+				break;
+			}
+		}
+	}
+
+	return overlap;
+}
+
+/*
+ * Splits the difference between the stack and the new set of files.
+ *  Returns the number of changed files, or -ESTALE if a file to take out
+ *  was modified since it was added, its frames can't be subtracted anymore
+ */
+int master_stack_diff(master_stack_t *stack, list_node_t *files, list_node_t **added, list_node_t **removed)
+{
+	char *kept = (char *) calloc(stack->files_count + 1, 1);
+	list_node_t *tmp;
+	uint64_t id;
+	int i, changed = 0;
+
+	*added = NULL;
+	*removed = NULL;
+
+	if (!kept) {
+		return -ENOMEM;
+	}
+
+	for (tmp = files; tmp; tmp = tmp->next) {
+		id = master_cache_file_id(tmp->object);
+
+		for (i = 0; i < stack->files_count; ++i) {
+			if (!kept[i] && stack->files[i].id == id) {
+				break;
+			}
+		}
+
+		if (i < stack->files_count) {
+			kept[i] = 1;
+		} else {
+			*added = add_object_to_list(*added, tmp->object);
+			changed++;
+		}
+	}
+
+	for (i = 0; i < stack->files_count; ++i) {
+		if (kept[i]) {
+			continue;
+		}
+
+		if (master_cache_file_id(stack->files[i].path) != stack->files[i].id) {
+			changed = -ESTALE;
+			break;
+		}
+
+		*removed = add_object_to_list(*removed, stack->files[i].path);
+		changed++;
+	}
+
+	free(kept);
+
+	if (changed < 0) {
+		free_list(*added);
+		free_list(*removed);
+
+		*added = NULL;
+		*removed = NULL;
+	}
+
+	return changed;
+}
+
+fits_handle_t *master_stack_mean(master_stack_t *stack)
+{
+	long i, npixels;
+	int status = 0;
+	fits_handle_t *master;
+
+	if (!stack->sum || stack->count <= 0) {
+		return NULL;
+	}
+
+	master = fits_handler_mem_new(&status);
+
+	if (!master) {
+		return NULL;
+	}
+
+	if (fits_create_image_mem(master, stack->width, stack->height) != 0) {
+		fits_handler_free(master);
+		return NULL;
+	}
+
+	master->bitpix = stack->bitpix;
+
+	npixels = (long) stack->width * stack->height;
+
+	for (i = 0; i < npixels; ++i) {
+		master->image[i] = (float) ((stack->sum[i] - stack->comp[i]) / stack->count);
+	}
+
+	return master;
+}
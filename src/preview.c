@@ -0,0 +1,451 @@
+/* 
+   preview.c
+    - block averaged 8-bit previews of the calibrated frames, PGM or PNG
+
+   Copyright 2022  Oleg Kutkov <contact@olegkutkov.me>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include "preview.h"
+
+/* zscale parameters, same as the IRAF defaults */
+#define ZSCALE_SAMPLES 1000
+#define ZSCALE_CONTRAST 0.25
+#define ZSCALE_KREJ 2.5
+#define ZSCALE_MAX_ITER 5
+#define ZSCALE_MIN_FRACTION 0.5
+
+/* max data of the stored deflate block */
+#define DEFLATE_STORED_MAX 65535
+
+int preview_init(preview_t *preview, int image_width, int image_height, int max_size)
+{
+	int longest = image_width > image_height ? image_width : image_height;
+	size_t pixels;
+
+	memset(preview, 0, sizeof(preview_t));
+
+	if (max_size < 1) {
+		max_size = PREVIEW_DEFAULT_SIZE;
+	}
+
+	preview->block = (longest + max_size - 1) / max_size;
+
+	if (preview->block < 1) {
+		preview->block = 1;
+	}
+
+	preview->image_width = image_width;
+	preview->width = (image_width + preview->block - 1) / preview->block;
+	preview->height = (image_height + preview->block - 1) / preview->block;
+
+	pixels = (size_t) preview->width * preview->height;
+
+	preview->sum = (float*) calloc(pixels, sizeof(float));
+	preview->count = (uint32_t*) calloc(pixels, sizeof(uint32_t));
+
+	if (!preview->sum || !preview->count) {
+		preview_free(preview);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/*
+ * Rows of the calibrated strip are added to the blocks they belong to,
+ *  NaN pixels are skipped without branches
+ */
+void preview_add_rows(preview_t *preview, const float *pixels, int first_row, int rows)
+{
+	int y, bx, x, x1;
+	int block = preview->block;
+
+	for (y = 0; y < rows; ++y) {
+		const float *row = pixels + (long) y * preview->image_width;
+		long offset = (long) ((first_row + y) / block) * preview->width;
+		float *sum = preview->sum + offset;
+		uint32_t *count = preview->count + offset;
+
+		for (bx = 0; bx < preview->width; ++bx) {
+			float s = 0;
+			uint32_t n = 0;
+
+			x1 = (bx + 1) * block;
+			x1 = x1 < preview->image_width ? x1 : preview->image_width;
+
+			for (x = bx * block; x < x1; ++x) {
+				float v = row[x];
+				int good = v == v;
+
+				s += good ? v : 0.0f;
+				n += good;
+			}
+
+			sum[bx] += s;
+			count[bx] += n;
+		}
+	}
+}
+
+static int compare_floats(const void *a, const void *b)
+{
+	float fa = *(const float *) a, fb = *(const float *) b;
+
+	return (fa > fb) - (fa < fb);
+}
+
+/*
+ * zscale of IRAF: the line is fitted to the sorted sample with the iterative
+ *  rejection, its slope divided by the contrast gives the display range
+ *  around the median
+ */
+static void zscale(const float *values, long n, float *z1, float *z2)
+{
+	float samples[ZSCALE_SAMPLES];
+	char rejected[ZSCALE_SAMPLES];
+	long i, ns = 0, step, good, min_good, center;
+	double sx, sy, sxx, sxy, det, a = 0, b = 0, resid, sigma;
+	double median;
+	int iter;
+
+	step = n / ZSCALE_SAMPLES + 1;
+
+	for (i = 0; i < n && ns < ZSCALE_SAMPLES; i += step) {
+		if (!isnan(values[i])) {
+			samples[ns++] = values[i];
+		}
+	}
+
+	if (ns == 0) {
+		*z1 = 0;
+		*z2 = 1;
+		return;
+	}
+
+	qsort(samples, ns, sizeof(float), compare_floats);
+
+	*z1 = samples[0];
+	*z2 = samples[ns - 1];
+
+	center = ns / 2;
+	median = ns % 2 ? samples[center] : (samples[center - 1] + samples[center]) / 2.0;
+
+	memset(rejected, 0, sizeof(rejected));
+
+	good = ns;
+	min_good = (long) (ns * ZSCALE_MIN_FRACTION);
+
+	if (min_good < 5) {
+		return;
+	}
+
+	for (iter = 0; iter < ZSCALE_MAX_ITER; ++iter) {
+		long rejected_now = 0;
+
+		sx = sy = sxx = sxy = 0;
+
+		for (i = 0; i < ns; ++i) {
+			if (!rejected[i]) {
+				sx += i;
+				sy += samples[i];
+				sxx += (double) i * i;
+				sxy += i * (double) samples[i];
+			}
+		}
+
+		det = good * sxx - sx * sx;
+
+		if (det == 0) {
+			return;
+		}
+
+		b = (good * sxy - sx * sy) / det;
+		a = (sy - b * sx) / good;
+
+		sigma = 0;
+
+		for (i = 0; i < ns; ++i) {
+			if (!rejected[i]) {
+				resid = samples[i] - (a + b * i);
+				sigma += resid * resid;
+			}
+		}
+
+		sigma = sqrt(sigma / good);
+
+		for (i = 0; i < ns; ++i) {
+			resid = samples[i] - (a + b * i);
+
+			if (!rejected[i] && fabs(resid) > ZSCALE_KREJ * sigma) {
+				rejected[i] = 1;
+				rejected_now++;
+			}
+		}
+
+		good -= rejected_now;
+
+		if (rejected_now == 0 || good < min_good) {
+			break;
+		}
+	}
+
+	if (good < min_good) {
+		return;
+	}
+
+	b /= ZSCALE_CONTRAST;
+
+	*z1 = fmax(*z1, median - center * b);
+	*z2 = fmin(*z2, median + (ns - center) * b);
+}
+
+static uint8_t *render_preview(preview_t *preview)
+{
+	long i, n = (long) preview->width * preview->height;
+	float *values, z1, z2, scale;
+	uint8_t *gray;
+
+	if (n <= 0) {
+		return NULL;
+	}
+
+	values = (float*) malloc(n * sizeof(float));
+	gray = (uint8_t*) malloc(n);
+
+	if (!values || !gray) {
+		free(values);
+		free(gray);
+		return NULL;
+	}
+
+	for (i = 0; i < n; ++i) {
+		values[i] = preview->count[i] ? preview->sum[i] / preview->count[i] : NAN;
+	}
+
+	zscale(values, n, &z1, &z2);
+
+	scale = z2 > z1 ? 255.0f / (z2 - z1) : 0;
+
+	for (i = 0; i < n; ++i) {
+		float v = (values[i] - z1) * scale;
+
+		v = v < 0 ? 0 : (v > 255 ? 255 : v);
+		gray[i] = isnan(values[i]) ? 0 : (uint8_t) (v + 0.5f);
+	}
+
+	free(values);
+
+	return gray;
+}
+
+static int write_pgm(FILE *f, const uint8_t *gray, int width, int height)
+{
+	fprintf(f, "P5\n%i %i\n255\n", width, height);
+
+	return fwrite(gray, 1, (size_t) width * height, f) == (size_t) width * height ? 0 : -EIO;
+}
+
+/* bitwise CRC-32 of PNG, previews are small enough to go without the table */
+static uint32_t crc32_update(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	size_t i;
+	int k;
+
+	for (i = 0; i < len; ++i) {
+		crc ^= buf[i];
+
+		for (k = 0; k < 8; ++k) {
+			crc = (crc >> 1) ^ (0xedb88320u & -(crc & 1));
+		}
+	}
+
+	return crc;
+}
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static int write_png_chunk(FILE *f, const char *type, const uint8_t *data, size_t len)
+{
+	uint8_t head[8], tail[4];
+	uint32_t crc;
+
+	put_be32(head, (uint32_t) len);
+	memcpy(head + 4, type, 4);
+
+	crc = crc32_update(0xffffffffu, head + 4, 4);
+	crc = crc32_update(crc, data, len) ^ 0xffffffffu;
+
+	put_be32(tail, crc);
+
+	if (fwrite(head, 1, 8, f) != 8 || (len && fwrite(data, 1, len, f) != len) || fwrite(tail, 1, 4, f) != 4) {
+		return -EIO;
+	}
+
+	return 0;
+}
+
+/*
+ * Grayscale PNG with the zlib stream of stored (not compressed) deflate blocks,
+ *  previews are small and this needs no zlib
+ */
+static int write_png(FILE *f, const uint8_t *gray, int width, int height)
+{
+	static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	uint8_t ihdr[13] = { 0 };
+	uint8_t *raw, *idat, *p, *src;
+	size_t raw_len, idat_len, left, len;
+	uint32_t s1 = 1, s2 = 0;
+	long y, i;
+	int status;
+
+	raw_len = (size_t) (width + 1) * height;
+	idat_len = 2 + raw_len + 5 * (raw_len / DEFLATE_STORED_MAX + 1) + 4;
+
+	raw = (uint8_t*) malloc(raw_len);
+	idat = (uint8_t*) malloc(idat_len);
+
+	if (!raw || !idat) {
+		free(raw);
+		free(idat);
+		return -ENOMEM;
+	}
+
+	/* every row starts with the filter type 0 */
+	for (y = 0; y < height; ++y) {
+		raw[y * (width + 1)] = 0;
+		memcpy(raw + y * (width + 1) + 1, gray + y * width, width);
+	}
+
+	for (i = 0; i < (long) raw_len; ++i) {
+		s1 = (s1 + raw[i]) % 65521;
+		s2 = (s2 + s1) % 65521;
+	}
+
+	p = idat;
+	*p++ = 0x78;
+	*p++ = 0x01;
+
+	src = raw;
+	left = raw_len;
+
+	do {
+		len = left > DEFLATE_STORED_MAX ? DEFLATE_STORED_MAX : left;
+
+		/* BFINAL on the last block, BTYPE 00 (stored), LEN and NLEN */
+		*p++ = left == len;
+		*p++ = len & 0xff;
+		*p++ = len >> 8;
+		*p++ = ~len & 0xff;
+		*p++ = (~len >> 8) & 0xff;
+
+		memcpy(p, src, len);
+
+		p += len;
+		src += len;
+		left -= len;
+	} while (left > 0);
+
+	put_be32(p, (s2 << 16) | s1);
+	p += 4;
+
+	put_be32(ihdr, width);
+	put_be32(ihdr + 4, height);
+	ihdr[8] = 8;
+
+	status = fwrite(signature, 1, sizeof(signature), f) == sizeof(signature) ? 0 : -EIO;
+
+	if (status == 0) {
+		status = write_png_chunk(f, "IHDR", ihdr, sizeof(ihdr));
+	}
+
+	if (status == 0) {
+		status = write_png_chunk(f, "IDAT", idat, p - idat);
+	}
+
+	if (status == 0) {
+		status = write_png_chunk(f, "IEND", NULL, 0);
+	}
+
+	free(raw);
+	free(idat);
+
+	return status;
+}
+
+int preview_save(preview_t *preview, const char *path, int format)
+{
+	uint8_t *gray;
+	FILE *f;
+	int status;
+
+	gray = render_preview(preview);
+
+	if (!gray) {
+		return -ENOMEM;
+	}
+
+	f = fopen(path, "wb");
+
+	if (!f) {
+		status = -errno;
+		free(gray);
+		return status;
+	}
+
+	if (format == PREVIEW_PNG) {
+		status = write_png(f, gray, preview->width, preview->height);
+	} else {
+		status = write_pgm(f, gray, preview->width, preview->height);
+	}
+
+	if (fclose(f) != 0 && status == 0) {
+		status = -errno;
+	}
+
+	if (status != 0) {
+		unlink(path);
+	}
+
+	free(gray);
+
+	return status;
+}
+
+void preview_free(preview_t *preview)
+{
+	free(preview->sum);
+	free(preview->count);
+
+	preview->sum = NULL;
+	preview->count = NULL;
+}
+
+const char *preview_file_ext(int format)
+{
+	return format == PREVIEW_PNG ? ".png" : ".pgm";
+}
@@ -0,0 +1,140 @@
+/* 
+   priority.c
+    - order of the science frames by the rules on the header and the file age
+
+   Copyright 2022  Oleg Kutkov <contact@olegkutkov.me>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "fits_header.h"
+#include "priority.h"
+
+/*
+ * KEY=pattern:priority or age<seconds:priority, pattern is the shell wildcard
+ *  matched without case, e.g. OBJECT=GRB*:10, IMAGETYP=flat:-5, age<600:20
+ */
+int priority_rule_parse(priority_rules_t *rules, const char *text)
+{
+	priority_rule_t *rule;
+	const char *colon = strrchr(text, ':');
+	const char *sep;
+	char *end;
+	size_t i, len;
+
+	if (rules->count >= PRIORITY_MAX_RULES) {
+		return -ENOSPC;
+	}
+
+	if (!colon) {
+		return -EINVAL;
+	}
+
+	rule = &rules->rule[rules->count];
+
+	memset(rule, 0, sizeof(priority_rule_t));
+
+	rule->priority = (int) strtol(colon + 1, &end, 10);
+
+	if (end == colon + 1 || *end) {
+		return -EINVAL;
+	}
+
+	if (strncmp(text, "age<", 4) == 0) {
+		rule->max_age = strtol(text + 4, &end, 10);
+
+		if (end != colon || rule->max_age <= 0) {
+			return -EINVAL;
+		}
+	} else {
+		sep = strchr(text, '=');
+
+		if (!sep || sep > colon || sep == text) {
+			return -EINVAL;
+		}
+
+		len = sep - text;
+
+		if (len >= PRIORITY_KEY_SIZE || (size_t) (colon - sep - 1) >= PRIORITY_PATTERN_SIZE) {
+			return -EINVAL;
+		}
+
+		for (i = 0; i < len; ++i) {
+			rule->key[i] = toupper((unsigned char) text[i]);
+		}
+
+		memcpy(rule->pattern, sep + 1, colon - sep - 1);
+	}
+
+	rules->count++;
+
+	return 0;
+}
+
+static int rule_matches(const priority_rule_t *rule, const char *path, const struct stat *st, int has_stat)
+{
+	char value[FITS_CARD_SIZE];
+
+	if (!rule->key[0]) {
+		return has_stat && difftime(time(NULL), st->st_mtime) < rule->max_age;
+	}
+
+	if (fits_header_key(path, rule->key, value, sizeof(value)) != 0) {
+		return 0;
+	}
+
+	return fnmatch(rule->pattern, value, FNM_CASEFOLD) == 0;
+}
+
+/*
+ * Priority is the highest of the matched rules, 0 when none matches.
+ *  Deadline is the file arrival (its modification time) plus rules->deadline, 0 without it
+ */
+void priority_of_file(const priority_rules_t *rules, const char *path, int *priority, long *deadline)
+{
+	struct stat st;
+	int i, matched = 0, has_stat = 0;
+
+	*priority = 0;
+	*deadline = 0;
+
+	if (rules->count == 0 && rules->deadline <= 0) {
+		return;
+	}
+
+	has_stat = stat(path, &st) == 0;
+
+	for (i = 0; i < rules->count; ++i) {
+		if (rule_matches(&rules->rule[i], path, &st, has_stat)) {
+			if (!matched || rules->rule[i].priority > *priority) {
+				*priority = rules->rule[i].priority;
+			}
+
+			matched = 1;
+		}
+	}
+
+	if (rules->deadline > 0 && has_stat) {
+		*deadline = (long) st.st_mtime + rules->deadline;
+	}
+}
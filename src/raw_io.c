@@ -0,0 +1,377 @@
+/* 
+   raw_io.c
+    - batched reads of the file ranges past cfitsio, io_uring or pread
+
+   Copyright 2022  Oleg Kutkov <contact@olegkutkov.me>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "raw_io.h"
+
+/* span is split to the requests of this size, all of them are submitted at once */
+#define RAW_IO_CHUNK (1 << 20)
+#define RAW_IO_QUEUE_DEPTH (RAW_IO_SPAN / RAW_IO_CHUNK)
+
+/* every thread has its own ring, so the submissions aren't locked */
+typedef struct raw_ring {
+	int fd;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_map;
+	void *cq_map;
+	size_t sq_map_size;
+	size_t cq_map_size;
+	size_t sqes_size;
+} raw_ring_t;
+
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+
+/* marks the threads where io_uring isn't available, e.g. old kernel or seccomp */
+static raw_ring_t ring_unavailable;
+
+int raw_io_mode_parse(const char *name)
+{
+	if (!strcmp(name, "uring")) {
+		return RAW_IO_URING;
+	}
+
+	if (!strcmp(name, "pread")) {
+		return RAW_IO_PREAD;
+	}
+
+	return -EINVAL;
+}
+
+/*
+ * Direct I/O bypasses the page cache, filesystems without it
+ *  (tmpfs, some network ones) get the buffered descriptor
+ */
+int raw_io_open(const char *path, int flags)
+{
+	int fd = open(path, flags | O_DIRECT);
+
+	if (fd < 0 && errno == EINVAL) {
+		fd = open(path, flags);
+	}
+
+	return fd < 0 ? -errno : fd;
+}
+
+void *raw_io_alloc(size_t size)
+{
+	void *buf = NULL;
+
+	if (posix_memalign(&buf, RAW_IO_ALIGN, size) != 0) {
+		return NULL;
+	}
+
+	return buf;
+}
+
+static void ring_free(raw_ring_t *ring)
+{
+	if (ring->sqes) {
+		munmap(ring->sqes, ring->sqes_size);
+	}
+
+	if (ring->cq_map) {
+		munmap(ring->cq_map, ring->cq_map_size);
+	}
+
+	if (ring->sq_map) {
+		munmap(ring->sq_map, ring->sq_map_size);
+	}
+
+	close(ring->fd);
+	free(ring);
+}
+
+static void ring_destroy(void *arg)
+{
+	if (arg != &ring_unavailable) {
+		ring_free((raw_ring_t*) arg);
+	}
+}
+
+static void ring_key_create(void)
+{
+	pthread_key_create(&ring_key, ring_destroy);
+}
+
+/* there is no liburing dependency, the ring is set up by the syscalls */
+static raw_ring_t *ring_new(void)
+{
+	struct io_uring_params p;
+	raw_ring_t *ring = (raw_ring_t*) calloc(1, sizeof(raw_ring_t));
+	char *sq, *cq;
+
+	if (!ring) {
+		return NULL;
+	}
+
+	memset(&p, 0, sizeof(p));
+
+	ring->fd = syscall(__NR_io_uring_setup, RAW_IO_QUEUE_DEPTH, &p);
+
+	if (ring->fd < 0) {
+		free(ring);
+		return NULL;
+	}
+
+	ring->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+					ring->fd, IORING_OFF_SQ_RING);
+	ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+					ring->fd, IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+					ring->fd, IORING_OFF_SQES);
+
+	if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED) {
+		ring->sq_map = ring->sq_map == MAP_FAILED ? NULL : ring->sq_map;
+		ring->cq_map = ring->cq_map == MAP_FAILED ? NULL : ring->cq_map;
+		ring->sqes = ring->sqes == MAP_FAILED ? NULL : ring->sqes;
+
+		ring_free(ring);
+		return NULL;
+	}
+
+	sq = (char*) ring->sq_map;
+	cq = (char*) ring->cq_map;
+
+	ring->sq_head = (unsigned*) (sq + p.sq_off.head);
+	ring->sq_tail = (unsigned*) (sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned*) (sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned*) (sq + p.sq_off.array);
+	ring->cq_head = (unsigned*) (cq + p.cq_off.head);
+	ring->cq_tail = (unsigned*) (cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned*) (cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+
+	return ring;
+}
+
+static raw_ring_t *thread_ring(void)
+{
+	raw_ring_t *ring;
+
+	pthread_once(&ring_once, ring_key_create);
+
+	ring = (raw_ring_t*) pthread_getspecific(ring_key);
+
+	if (!ring) {
+		ring = ring_new();
+
+		if (!ring) {
+			ring = &ring_unavailable;
+		}
+
+		pthread_setspecific(ring_key, ring);
+	}
+
+	return ring != &ring_unavailable ? ring : NULL;
+}
+
+/*
+ * Entries which the kernel didn't take are dropped, the taken ones are still waited for.
+ *  Without SQPOLL the kernel reads the submission queue only in io_uring_enter()
+ */
+static unsigned ring_submit(raw_ring_t *ring, unsigned tail, unsigned count, int *status)
+{
+	unsigned pending = tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	int ret;
+
+	while (pending > 0) {
+		ret = syscall(__NR_io_uring_enter, ring->fd, pending, 0, 0, NULL, 0);
+
+		if (ret < 0 && errno != EINTR) {
+			*status = -errno;
+			break;
+		}
+
+		pending = tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	}
+
+	__atomic_store_n(ring->sq_tail, tail - pending, __ATOMIC_RELEASE);
+
+	return count - pending;
+}
+
+/*
+ * Submits the chunks of one span and waits for all of them, also when the submission fails half way,
+ *  since the requests point to the buffer and to iov[] of this call.
+ *  Returns the bytes done from the start of the span up to the first short chunk
+ */
+static ssize_t ring_transfer(raw_ring_t *ring, int fd, char *buf, size_t len, off_t offset)
+{
+	struct iovec iov[RAW_IO_QUEUE_DEPTH];
+	int result[RAW_IO_QUEUE_DEPTH];
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	unsigned i, count, submitted, tail, head, index, completed = 0;
+	ssize_t done = 0;
+	int ret, status = 0;
+
+	count = (len + RAW_IO_CHUNK - 1) / RAW_IO_CHUNK;
+
+	tail = *ring->sq_tail;
+
+	for (i = 0; i < count; i++) {
+		iov[i].iov_base = buf + (size_t) i * RAW_IO_CHUNK;
+		iov[i].iov_len = i + 1 < count ? RAW_IO_CHUNK : len - (size_t) i * RAW_IO_CHUNK;
+
+		index = tail & *ring->sq_mask;
+		sqe = &ring->sqes[index];
+
+		memset(sqe, 0, sizeof(*sqe));
+
+		sqe->opcode = IORING_OP_READV;
+		sqe->fd = fd;
+		sqe->off = offset + (off_t) i * RAW_IO_CHUNK;
+		sqe->addr = (unsigned long) &iov[i];
+		sqe->len = 1;
+		sqe->user_data = i;
+
+		ring->sq_array[index] = index;
+		tail++;
+
+		result[i] = -ECANCELED;
+	}
+
+	__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+	submitted = ring_submit(ring, tail, count, &status);
+
+	while (completed < submitted) {
+		head = *ring->cq_head;
+
+		while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+			cqe = &ring->cqes[head & *ring->cq_mask];
+
+			/* all the requests of the ring are of this call */
+			if (cqe->user_data < count) {
+				result[cqe->user_data] = cqe->res;
+				completed++;
+			}
+
+			head++;
+		}
+
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+		if (completed == submitted) {
+			break;
+		}
+
+		/* after a failed wait the completions are polled, the ring stays usable once it's empty */
+		if (status != 0) {
+			sched_yield();
+			continue;
+		}
+
+		ret = syscall(__NR_io_uring_enter, ring->fd, 0, submitted - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+
+		if (ret < 0 && errno != EINTR) {
+			status = -errno;
+		}
+	}
+
+	if (status != 0) {
+		return status;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (result[i] < 0) {
+			return result[i];
+		}
+
+		done += result[i];
+
+		if ((size_t) result[i] < iov[i].iov_len) {
+			break;
+		}
+	}
+
+	return done;
+}
+
+/*
+ * Short read is the end of the file.
+ *  Without the ring the span goes by the plain syscalls of the calling worker thread
+ */
+static ssize_t transfer(int mode, int fd, char *buf, size_t len, off_t offset)
+{
+	raw_ring_t *ring = mode == RAW_IO_URING ? thread_ring() : NULL;
+	size_t span, done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		span = len - done;
+
+		if (span > RAW_IO_SPAN) {
+			span = RAW_IO_SPAN;
+		}
+
+		if (ring) {
+			n = ring_transfer(ring, fd, buf + done, span, offset + done);
+		} else {
+			n = pread(fd, buf + done, span, offset + done);
+		}
+
+		if (n < 0) {
+			if (!ring && errno == EINTR) {
+				continue;
+			}
+
+			return ring ? n : -errno;
+		}
+
+		done += n;
+
+		if ((size_t) n < span) {
+			break;
+		}
+	}
+
+	return done;
+}
+
+ssize_t raw_io_read(int mode, int fd, void *buf, size_t len, off_t offset)
+{
+	return transfer(mode, fd, (char*) buf, len, offset);
+}
@@ -0,0 +1,611 @@
+/* 
+   service.c
+    - local calibration service, requests come over the unix domain socket
+
+   Copyright 2022  Oleg Kutkov <contact@olegkutkov.me>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "frame_stats.h"
+#include "service.h"
+
+#define SERVICE_LINE_SIZE 4096
+#define SERVICE_MAX_ARGS 16
+#define SERVICE_POLL_MS 1000
+/* stats of the more image HDUs of one file wouldn't fit the reply line anyway */
+#define SERVICE_MAX_HDUS 64
+#define SERVICE_STATS_SIZE 128
+
+/* idle client is dropped after this time, so it can't hold its thread forever */
+#define SERVICE_IDLE_TIMEOUT_SEC 60
+
+typedef int (*service_handler) (calibrator_session_t *session, int fd, int argc, char **argv);
+
+typedef struct service {
+	calibrator_session_t *session;
+	volatile int *run_flag;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int connections;
+} service_t;
+
+typedef struct service_conn {
+	service_t *service;
+	int fd;
+	char line[SERVICE_LINE_SIZE];
+	size_t len;
+} service_conn_t;
+
+typedef struct service_hdu_stats {
+	int count;
+	int hdu[SERVICE_MAX_HDUS];
+	char stats[SERVICE_MAX_HDUS][SERVICE_STATS_SIZE];
+} service_hdu_stats_t;
+
+/* request is calibrated by the session worker while the connection thread waits for it */
+typedef struct service_request {
+	calibrator_session_t *session;
+	service_handler handler;
+	int fd;
+	int argc;
+	char **argv;
+	int status;
+	int done;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} service_request_t;
+
+static double elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/* client may be gone already, so no SIGPIPE */
+static void send_reply(int fd, const char *fmt, ...)
+{
+	char buf[SERVICE_LINE_SIZE];
+	va_list args;
+	ssize_t sent;
+	int len, pos = 0;
+
+	va_start(args, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+
+	if (len >= (int) sizeof(buf)) {
+		len = sizeof(buf) - 1;
+		buf[len - 1] = '\n';
+	}
+
+	while (pos < len) {
+		sent = send(fd, buf + pos, len - pos, MSG_NOSIGNAL);
+
+		if (sent < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (sent <= 0) {
+			return;
+		}
+
+		pos += sent;
+	}
+}
+
+static void send_error(int fd, int status)
+{
+	char err_buf[32] = { 0 };
+
+	fits_get_status_code_msg(status, err_buf);
+
+	send_reply(fd, "ERR %i %s\n", status, err_buf);
+}
+
+static int parse_pixel_type(const char *name)
+{
+	static const char *names[KERNEL_INPUTS] = { "u16", "i16", "i32", "f32" };
+	int i;
+
+	for (i = 0; i < KERNEL_INPUTS; ++i) {
+		if (strcmp(name, names[i]) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+static void format_stats(char *buf, size_t size, const frame_stats_t *stats)
+{
+	snprintf(buf, size, "%g %g %g %g %g", stats->mean, stats->median, stats->sigma,
+				stats->count ? stats->min : NAN, stats->count ? stats->max : NAN);
+}
+
+/* HDUs are calibrated in parallel, so their stats are inserted in the HDU order */
+static void collect_hdu_stats(void *arg, int hdu, const frame_stats_t *stats)
+{
+	service_hdu_stats_t *list = (service_hdu_stats_t *) arg;
+	int i;
+
+	if (list->count == SERVICE_MAX_HDUS) {
+		return;
+	}
+
+	for (i = list->count; i > 0 && list->hdu[i - 1] > hdu; --i) {
+		list->hdu[i] = list->hdu[i - 1];
+		memcpy(list->stats[i], list->stats[i - 1], sizeof(list->stats[0]));
+	}
+
+	list->hdu[i] = hdu;
+	format_stats(list->stats[i], sizeof(list->stats[0]), stats);
+	list->count++;
+}
+
+/*
+ * CALIBRATE <input file> <output file>
+ *  reply has the HDU number and the stats of every image HDU in the file order
+ */
+static int serve_file(calibrator_session_t *session, int fd, int argc, char **argv)
+{
+	service_hdu_stats_t list;
+	struct timespec start;
+	char reply[SERVICE_LINE_SIZE];
+	size_t len;
+	int i, status;
+
+	if (argc != 3) {
+		return -EINVAL;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	list.count = 0;
+
+	status = calibrate_file_stats(session, argv[1], argv[2], collect_hdu_stats, &list);
+
+	if (status != 0) {
+		return status;
+	}
+
+	len = snprintf(reply, sizeof(reply), "OK %.1f", elapsed_ms(&start));
+
+	for (i = 0; i < list.count && len < sizeof(reply); ++i) {
+		len += snprintf(reply + len, sizeof(reply) - len, " %i %s", list.hdu[i], list.stats[i]);
+	}
+
+	send_reply(fd, "%s\n", reply);
+
+	return 0;
+}
+
+static int send_buffer_stats(int fd, const float *result, int width, int height, const struct timespec *start)
+{
+	frame_stats_t stats;
+	fits_handle_t image;
+	char line[SERVICE_STATS_SIZE];
+	int status;
+
+	memset(&image, 0, sizeof(fits_handle_t));
+
+	image.width = width;
+	image.height = height;
+	image.planes = 1;
+	image.bitpix = FLOAT_IMG;
+
+	status = frame_stats_init(&stats, &image);
+
+	if (status != 0) {
+		return status;
+	}
+
+	frame_stats_add(&stats, result, (long) width * height);
+	frame_stats_finish(&stats);
+
+	format_stats(line, sizeof(line), &stats);
+
+	send_reply(fd, "OK %.1f %s\n", elapsed_ms(start), line);
+
+	frame_stats_free(&stats);
+
+	return 0;
+}
+
+/*
+ * BUFFER <shm name> <u16|i16|i32|f32> <width> <height> <obs time> <exptime> <ccd temp>
+ *  raw pixels are at the start of the shared memory, calibrated floats are stored
+ *  at SERVICE_RESULT_OFFSET() of the raw size
+ */
+static int serve_buffer(calibrator_session_t *session, int fd, int argc, char **argv)
+{
+	struct timespec start;
+	struct stat st;
+	calib_kernel_t kernel;
+	size_t raw_bytes, offset, total;
+	int pixel_type, width, height, shm_fd, status;
+	char *base;
+
+	if (argc != 8) {
+		return -EINVAL;
+	}
+
+	pixel_type = parse_pixel_type(argv[2]);
+	width = atoi(argv[3]);
+	height = atoi(argv[4]);
+
+	if (pixel_type < 0 || width <= 0 || height <= 0) {
+		return -EINVAL;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	calib_kernel_select(&kernel, pixel_type, KERNEL_OPS_DARK);
+
+	raw_bytes = (size_t) width * height * kernel.pixel_size;
+	offset = SERVICE_RESULT_OFFSET(raw_bytes);
+	total = offset + (size_t) width * height * sizeof(float);
+
+	shm_fd = shm_open(argv[1], O_RDWR, 0);
+
+	if (shm_fd < 0) {
+		return -errno;
+	}
+
+	if (fstat(shm_fd, &st) != 0 || (size_t) st.st_size < total) {
+		close(shm_fd);
+		return -EINVAL;
+	}
+
+	base = (char*) mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+
+	close(shm_fd);
+
+	if (base == MAP_FAILED) {
+		return -errno;
+	}
+
+	status = calibrate_buffer(session, base, pixel_type, width, height, (time_t) atol(argv[5]),
+				atof(argv[6]), atof(argv[7]), (float*) (base + offset));
+
+	if (status == 0) {
+		status = send_buffer_stats(fd, (float*) (base + offset), width, height, &start);
+	}
+
+	munmap(base, total);
+
+	return status;
+}
+
+static void *request_task(void *arg)
+{
+	service_request_t *req = (service_request_t *) arg;
+	int status = req->handler(req->session, req->fd, req->argc, req->argv);
+
+	pthread_mutex_lock(&req->lock);
+
+	req->status = status;
+	req->done = 1;
+
+	pthread_cond_signal(&req->cond);
+	pthread_mutex_unlock(&req->lock);
+
+	return NULL;
+}
+
+static int run_on_workers(calibrator_session_t *session, service_handler handler, int fd, int argc, char **argv)
+{
+	service_request_t req;
+
+	req.session = session;
+	req.handler = handler;
+	req.fd = fd;
+	req.argc = argc;
+	req.argv = argv;
+	req.status = 0;
+	req.done = 0;
+
+	pthread_mutex_init(&req.lock, NULL);
+	pthread_cond_init(&req.cond, NULL);
+
+	thread_pool_add_task(calibrator_session_pool(session), request_task, &req);
+
+	pthread_mutex_lock(&req.lock);
+
+	while (!req.done) {
+		pthread_cond_wait(&req.cond, &req.lock);
+	}
+
+	pthread_mutex_unlock(&req.lock);
+
+	pthread_cond_destroy(&req.cond);
+	pthread_mutex_destroy(&req.lock);
+
+	return req.status;
+}
+
+static void serve_request(calibrator_session_t *session, int fd, char *line)
+{
+	char *argv[SERVICE_MAX_ARGS];
+	char *saveptr = NULL, *tok;
+	int argc = 0, status = -EINVAL;
+
+	for (tok = strtok_r(line, " \t\r\n", &saveptr); tok && argc < SERVICE_MAX_ARGS;
+				tok = strtok_r(NULL, " \t\r\n", &saveptr)) {
+		argv[argc++] = tok;
+	}
+
+	if (argc == 0) {
+		return;
+	}
+
+	if (strcmp(argv[0], "PING") == 0) {
+		send_reply(fd, "OK\n");
+		return;
+	}
+
+	if (strcmp(argv[0], "CALIBRATE") == 0) {
+		status = run_on_workers(session, serve_file, fd, argc, argv);
+	} else if (strcmp(argv[0], "BUFFER") == 0) {
+		status = run_on_workers(session, serve_buffer, fd, argc, argv);
+	}
+
+	if (status != 0) {
+		send_error(fd, status);
+	}
+}
+
+/*
+ * Client sends one request per line and gets one reply line for each of them.
+ *  Every connection has its own thread, so the idle clients don't hold the workers.
+ *  Socket is polled every second, so the connection is closed soon after the service is stopped
+ */
+static void *serve_connection(void *arg)
+{
+	service_conn_t *conn = (service_conn_t *) arg;
+	service_t *service = conn->service;
+	struct timeval timeout = { 1, 0 };
+	ssize_t received;
+	char *eol;
+	int idle = 0;
+
+	setsockopt(conn->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	while (*service->run_flag && idle < SERVICE_IDLE_TIMEOUT_SEC) {
+		eol = memchr(conn->line, '\n', conn->len);
+
+		if (eol) {
+			*eol = '\0';
+
+			serve_request(service->session, conn->fd, conn->line);
+
+			conn->len -= eol + 1 - conn->line;
+			memmove(conn->line, eol + 1, conn->len);
+
+			continue;
+		}
+
+		if (conn->len == sizeof(conn->line)) {
+			send_error(conn->fd, -E2BIG);
+			break;
+		}
+
+		received = recv(conn->fd, conn->line + conn->len, sizeof(conn->line) - conn->len, 0);
+
+		if (received > 0) {
+			conn->len += received;
+			idle = 0;
+		} else if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			idle++;
+		} else if (received == 0 || errno != EINTR) {
+			break;
+		}
+	}
+
+	close(conn->fd);
+	free(conn);
+
+	pthread_mutex_lock(&service->lock);
+
+	service->connections--;
+
+	pthread_cond_signal(&service->cond);
+	pthread_mutex_unlock(&service->lock);
+
+	return NULL;
+}
+
+/* socket mode is checked by the path lookup only, so the peer is checked as well */
+static int is_trusted_peer(int fd)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0) {
+		return 0;
+	}
+
+	return cred.uid == geteuid() || cred.uid == 0;
+}
+
+static int start_connection(service_t *service, int client)
+{
+	service_conn_t *conn;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int status;
+
+	conn = (service_conn_t *) malloc(sizeof(service_conn_t));
+
+	if (!conn) {
+		return -ENOMEM;
+	}
+
+	conn->service = service;
+	conn->fd = client;
+	conn->len = 0;
+
+	pthread_mutex_lock(&service->lock);
+	service->connections++;
+	pthread_mutex_unlock(&service->lock);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	status = pthread_create(&thread, &attr, serve_connection, conn);
+
+	pthread_attr_destroy(&attr);
+
+	if (status != 0) {
+		pthread_mutex_lock(&service->lock);
+		service->connections--;
+		pthread_mutex_unlock(&service->lock);
+
+		free(conn);
+
+		return -status;
+	}
+
+	return 0;
+}
+
+static int open_socket(const char *socket_path)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+	int fd;
+
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		return -ENAMETOOLONG;
+	}
+
+	/* socket left by the previous run is replaced, anything else is kept */
+	if (lstat(socket_path, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode)) {
+			return -EEXIST;
+		}
+
+		unlink(socket_path);
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+	if (fd < 0) {
+		return -errno;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+
+	/* requests read and write any file of the service user, so only this user may connect */
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || chmod(socket_path, S_IRUSR | S_IWUSR) != 0
+				|| listen(fd, SOMAXCONN) != 0) {
+		close(fd);
+		return -errno;
+	}
+
+	return fd;
+}
+
+/*
+ * Accepts the clients until *run_flag is cleared, the requests are calibrated by the session workers,
+ *  so the masters and the workers stay warm between the requests
+ */
+int calibrator_serve(calibrator_session_t *session, const char *socket_path, volatile int *run_flag)
+{
+	struct pollfd pfd;
+	service_t service;
+	int fd, client, status;
+
+	status = calibrator_start(session);
+
+	if (status != 0) {
+		return status;
+	}
+
+	fd = open_socket(socket_path);
+
+	if (fd < 0) {
+		return fd;
+	}
+
+	service.session = session;
+	service.run_flag = run_flag;
+	service.connections = 0;
+
+	pthread_mutex_init(&service.lock, NULL);
+	pthread_cond_init(&service.cond, NULL);
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	while (*run_flag) {
+		if (poll(&pfd, 1, SERVICE_POLL_MS) <= 0) {
+			continue;
+		}
+
+		client = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+
+		if (client < 0) {
+			continue;
+		}
+
+		if (!is_trusted_peer(client)) {
+			send_error(client, -EACCES);
+			close(client);
+			continue;
+		}
+
+		if (start_connection(&service, client) != 0) {
+			close(client);
+		}
+	}
+
+	close(fd);
+	unlink(socket_path);
+
+	/* connections see the cleared flag within a poll period, the current requests are finished */
+	pthread_mutex_lock(&service.lock);
+
+	while (service.connections > 0) {
+		pthread_cond_wait(&service.cond, &service.lock);
+	}
+
+	pthread_mutex_unlock(&service.lock);
+
+	pthread_cond_destroy(&service.cond);
+	pthread_mutex_destroy(&service.lock);
+
+	return 0;
+}
@@ -0,0 +1,752 @@
+/* 
+   shared_cache.c
+    - master frames shared between calibrator processes and runs via mmap'ed files
+
+   Copyright 2022  Oleg Kutkov <contact@olegkutkov.me>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "shared_cache.h"
+
+/* pixels start on a page boundary, so the data can be mapped and used in place */
+#define SHARED_DATA_OFFSET 4096
+
+static void build_cache_path(const char *dir, uint64_t key, const char *suffix, char *buf, size_t len)
+{
+	snprintf(buf, len, "%s/%016llx.%s", dir, (unsigned long long) key, suffix);
+}
+
+/*
+ * Sidecar lists every contributing file with its size and mtime,
+ *  master is reused only if all of them are still unchanged
+ */
+static int write_sidecar(const char *dir, uint64_t key, list_node_t *files)
+{
+	char path[512], tmp_path[544], real_path[PATH_MAX];
+	struct stat st;
+	list_node_t *tmp;
+	FILE *fp;
+
+	build_cache_path(dir, key, "files", path, sizeof(path));
+	snprintf(tmp_path, sizeof(tmp_path), "%s.%i", path, getpid());
+
+	fp = fopen(tmp_path, "w");
+
+	if (!fp) {
+		return -errno;
+	}
+
+	for (tmp = files; tmp; tmp = tmp->next) {
+		if (!realpath(tmp->object, real_path) || stat(real_path, &st) != 0) {
+			fclose(fp);
+			unlink(tmp_path);
+			return -ENOENT;
+		}
+
+		fprintf(fp, "%lld %lld.%09ld %s\n", (long long) st.st_size,
+				(long long) st.st_mtim.tv_sec, st.st_mtim.tv_nsec, real_path);
+	}
+
+	fclose(fp);
+
+	if (rename(tmp_path, path) != 0) {
+		unlink(tmp_path);
+		return -errno;
+	}
+
+	return 0;
+}
+
+static int is_sidecar_valid(const char *dir, uint64_t key)
+{
+	char path[512], line[PATH_MAX + 64], file_path[PATH_MAX];
+	long long size, mtime_sec;
+	long mtime_nsec;
+	struct stat st;
+	int valid = 1, files = 0;
+	FILE *fp;
+
+	build_cache_path(dir, key, "files", path, sizeof(path));
+
+	fp = fopen(path, "r");
+
+	if (!fp) {
+		return 0;
+	}
+
+	while (valid && fgets(line, sizeof(line), fp)) {
+		line[strcspn(line, "\n")] = '\0';
+
+		if (sscanf(line, "%lld %lld.%ld %4095[^\n]", &size, &mtime_sec, &mtime_nsec, file_path) != 4) {
+			valid = 0;
+			break;
+		}
+
+		if (stat(file_path, &st) != 0 || st.st_size != size
+				|| st.st_mtim.tv_sec != mtime_sec || st.st_mtim.tv_nsec != mtime_nsec) {
+			valid = 0;
+		}
+
+		files++;
+	}
+
+	fclose(fp);
+
+	return valid && files > 0;
+}
+
+static void remove_entry(const char *dir, uint64_t key)
+{
+	char path[512];
+
+	build_cache_path(dir, key, "master", path, sizeof(path));
+	unlink(path);
+
+	build_cache_path(dir, key, "files", path, sizeof(path));
+	unlink(path);
+}
+
+/* lock left by a crashed builder, the one which is held is kept */
+static void remove_stale_lock(const char *dir, uint64_t key)
+{
+	char path[512];
+	int fd;
+
+	build_cache_path(dir, key, "lock", path, sizeof(path));
+
+	fd = open(path, O_RDWR | O_CLOEXEC);
+
+	if (fd < 0) {
+		return;
+	}
+
+	if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
+		unlink(path);
+	}
+
+	close(fd);
+}
+
+fits_handle_t *shared_cache_lookup(const char *dir, uint64_t key, int *count)
+{
+	char path[512];
+	int fd, status = 0;
+	struct stat st;
+	void *map;
+	shared_master_hdr_t *hdr;
+	size_t data_size;
+	fits_handle_t *master;
+
+	build_cache_path(dir, key, "master", path, sizeof(path));
+
+	fd = open(path, O_RDONLY);
+
+	if (fd < 0) {
+		return NULL;
+	}
+
+	if (!is_sidecar_valid(dir, key)) {
+		close(fd);
+		remove_entry(dir, key);
+		return NULL;
+	}
+
+	if (fstat(fd, &st) != 0 || st.st_size < SHARED_DATA_OFFSET) {
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+	/* mtime of the master is its last use time for the LRU eviction */
+	futimens(fd, NULL);
+
+	close(fd);
+
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+
+	hdr = (shared_master_hdr_t *) map;
+	data_size = (size_t) hdr->width * hdr->height * hdr->elem_size;
+
+	if (memcmp(hdr->magic, SHARED_CACHE_MAGIC, sizeof(hdr->magic)) != 0 || hdr->key != key
+			|| hdr->elem_size != sizeof(*master->image)
+			|| hdr->data_offset + data_size > (uint64_t) st.st_size
+			|| hdr->bad_offset + (uint64_t) hdr->bad_count * sizeof(*master->bad_pixels) > (uint64_t) st.st_size) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	master = fits_handler_mem_new(&status);
+
+	if (!master) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	master->image = (void *) ((char *) map + hdr->data_offset);
+	master->mapped_base = map;
+	master->mapped_size = st.st_size;
+	master->width = hdr->width;
+	master->height = hdr->height;
+	master->bitpix = hdr->bitpix;
+
+	if (hdr->bad_count) {
+		master->bad_pixels = (void *) ((char *) map + hdr->bad_offset);
+		master->bad_count = hdr->bad_count;
+	}
+
+	*count = hdr->count;
+
+	return master;
+}
+
+/*
+ * Only one process builds a master for the key, the others block here
+ *  and pick up the published file once the builder unlocks.
+ *  Lock file is removed by its holder, so the lock is taken again
+ *  if the file was unlinked while we were waiting for it
+ */
+int shared_cache_lock(const char *dir, uint64_t key)
+{
+	char path[512];
+	struct stat fd_st, path_st;
+	int fd;
+
+	build_cache_path(dir, key, "lock", path, sizeof(path));
+
+	for (;;) {
+		fd = open(path, O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+
+		if (fd < 0) {
+			return -errno;
+		}
+
+		while (flock(fd, LOCK_EX) != 0) {
+			if (errno != EINTR) {
+				close(fd);
+				return -errno;
+			}
+		}
+
+		if (fstat(fd, &fd_st) == 0 && stat(path, &path_st) == 0
+				&& fd_st.st_dev == path_st.st_dev && fd_st.st_ino == path_st.st_ino) {
+			return fd;
+		}
+
+		close(fd);
+	}
+}
+
+/* lock file is unlinked before the unlock, the processes waiting on it take the new one */
+void shared_cache_unlock(const char *dir, uint64_t key, int lock_fd)
+{
+	char path[512];
+
+	if (lock_fd >= 0) {
+		build_cache_path(dir, key, "lock", path, sizeof(path));
+		unlink(path);
+
+		flock(lock_fd, LOCK_UN);
+		close(lock_fd);
+	}
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *ptr = (const char *) buf;
+	ssize_t written;
+
+	while (len > 0) {
+		written = write(fd, ptr, len);
+
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return -errno;
+		}
+
+		ptr += written;
+		len -= written;
+	}
+
+	return 0;
+}
+
+int shared_cache_publish(const char *dir, uint64_t key, list_node_t *files, fits_handle_t *master, int count)
+{
+	char path[512], tmp_path[512], suffix[64];
+	char header[SHARED_DATA_OFFSET];
+	shared_master_hdr_t *hdr = (shared_master_hdr_t *) header;
+	int fd, err;
+
+	build_cache_path(dir, key, "master", path, sizeof(path));
+
+	snprintf(suffix, sizeof(suffix), "tmp.%i.%lx", getpid(), (unsigned long) pthread_self());
+	build_cache_path(dir, key, suffix, tmp_path, sizeof(tmp_path));
+
+	memset(header, 0, sizeof(header));
+	memcpy(hdr->magic, SHARED_CACHE_MAGIC, sizeof(hdr->magic));
+
+	hdr->key = key;
+	hdr->width = master->width;
+	hdr->height = master->height;
+	hdr->bitpix = master->bitpix;
+	hdr->count = count;
+	hdr->elem_size = sizeof(*master->image);
+	hdr->data_offset = SHARED_DATA_OFFSET;
+
+	/* bad pixels list follows the pixels */
+	hdr->bad_count = master->bad_count;
+	hdr->bad_offset = hdr->data_offset + (uint64_t) master->width * master->height * sizeof(*master->image);
+
+	err = write_sidecar(dir, key, files);
+
+	if (err) {
+		return err;
+	}
+
+	fd = open(tmp_path, O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0644);
+
+	if (fd < 0) {
+		return -errno;
+	}
+
+	err = write_all(fd, header, sizeof(header));
+
+	if (!err) {
+		err = write_all(fd, master->image, (size_t) master->width * master->height * sizeof(*master->image));
+	}
+
+	if (!err && master->bad_count) {
+		err = write_all(fd, master->bad_pixels, master->bad_count * sizeof(*master->bad_pixels));
+	}
+
+	close(fd);
+
+	/* readers never see a partially written master, rename is atomic */
+	if (!err && rename(tmp_path, path) != 0) {
+		err = -errno;
+	}
+
+	if (err) {
+		unlink(tmp_path);
+	}
+
+	return err;
+}
+
+typedef struct stack_file_rec {
+	uint64_t id;
+	int32_t frames;
+	uint32_t path_len;
+} stack_file_rec_t;
+
+static int is_stack_file(const char *name)
+{
+	return strlen(name) == 22 && strcmp(name + 16, ".stack") == 0;
+}
+
+/* files of the saved sums which are in the ids list, -1 if the sums are of another group */
+static int stack_file_overlap(const char *path, uint64_t group, const uint64_t *ids, int ids_count)
+{
+	shared_stack_hdr_t hdr;
+	stack_file_rec_t rec;
+	uint32_t i;
+	int j, overlap = 0;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+
+	if (!fp) {
+		return -1;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1
+			|| memcmp(hdr.magic, SHARED_STACK_MAGIC, sizeof(hdr.magic)) != 0 || hdr.group != group) {
+		fclose(fp);
+		return -1;
+	}
+
+	for (i = 0; i < hdr.files_count; ++i) {
+		if (fread(&rec, sizeof(rec), 1, fp) != 1 || fseeko(fp, rec.path_len, SEEK_CUR) != 0) {
+			break;
+		}
+
+		for (j = 0; j < ids_count; ++j) {
+			if (rec.id == ids[j]) {
+				overlap++;
+				break;
+			}
+		}
+	}
+
+	fclose(fp);
+
+	return overlap;
+}
+
+static master_stack_t *load_stack_file(const char *path, uint64_t group)
+{
+	shared_stack_hdr_t hdr;
+	stack_file_rec_t rec;
+	master_stack_t *stack;
+	master_stack_file_t *file;
+	size_t npixels;
+	uint32_t i;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+
+	if (!fp) {
+		return NULL;
+	}
+
+	stack = master_stack_new();
+
+	if (!stack || fread(&hdr, sizeof(hdr), 1, fp) != 1
+			|| memcmp(hdr.magic, SHARED_STACK_MAGIC, sizeof(hdr.magic)) != 0 || hdr.group != group
+			|| hdr.elem_size != sizeof(*stack->sum) || hdr.width <= 0 || hdr.height <= 0) {
+		goto fail;
+	}
+
+	stack->width = hdr.width;
+	stack->height = hdr.height;
+	stack->bitpix = hdr.bitpix;
+	stack->count = hdr.count;
+
+	stack->files = (master_stack_file_t *) calloc(hdr.files_count + 1, sizeof(master_stack_file_t));
+
+	if (!stack->files) {
+		goto fail;
+	}
+
+	stack->files_allocated = hdr.files_count + 1;
+
+	for (i = 0; i < hdr.files_count; ++i) {
+		if (fread(&rec, sizeof(rec), 1, fp) != 1 || rec.path_len >= PATH_MAX) {
+			goto fail;
+		}
+
+		file = &stack->files[i];
+		file->path = (char *) calloc(rec.path_len + 1, 1);
+
+		if (!file->path) {
+			goto fail;
+		}
+
+		stack->files_count++;
+
+		if (fread(file->path, 1, rec.path_len, fp) != rec.path_len) {
+			goto fail;
+		}
+
+		file->id = rec.id;
+		file->frames = rec.frames;
+	}
+
+	/* compensations follow the sums */
+	npixels = (size_t) hdr.width * hdr.height;
+	stack->sum = (double *) malloc(npixels * sizeof(*stack->sum));
+	stack->comp = (double *) malloc(npixels * sizeof(*stack->comp));
+
+	if (!stack->sum || !stack->comp || fseeko(fp, hdr.data_offset, SEEK_SET) != 0
+			|| fread(stack->sum, sizeof(*stack->sum), npixels, fp) != npixels
+			|| fread(stack->comp, sizeof(*stack->comp), npixels, fp) != npixels) {
+		goto fail;
+	}
+
+	fclose(fp);
+
+	return stack;
+
+fail:
+	fclose(fp);
+	master_stack_free(stack);
+
+	return NULL;
+}
+
+/*
+ * Running sums are saved by the key of their master, the group may have several of them.
+ *  Next master of the group takes the ones with most of its files, in any process:
+ *  the file is moved aside by rename(), so only one of the processes gets it,
+ *  and the updated sums are published by the key of the new master
+ */
+master_stack_t *shared_cache_load_stack(const char *dir, uint64_t group, const uint64_t *ids, int ids_count)
+{
+	char path[512], best_path[512] = { 0 }, taken_path[576];
+	master_stack_t *stack;
+	struct dirent *ep;
+	struct stat st;
+	time_t best_mtime = 0;
+	int overlap, best_overlap = 0;
+	DIR *dp;
+
+	dp = opendir(dir);
+
+	if (dp == NULL) {
+		return NULL;
+	}
+
+	while ((ep = readdir(dp))) {
+		if (!is_stack_file(ep->d_name)) {
+			continue;
+		}
+
+		snprintf(path, sizeof(path), "%s/%s", dir, ep->d_name);
+
+		overlap = stack_file_overlap(path, group, ids, ids_count);
+
+		if (overlap <= 0 || overlap < best_overlap || stat(path, &st) != 0
+				|| (overlap == best_overlap && st.st_mtime <= best_mtime)) {
+			continue;
+		}
+
+		strcpy(best_path, path);
+		best_overlap = overlap;
+		best_mtime = st.st_mtime;
+	}
+
+	closedir(dp);
+
+	if (!best_path[0]) {
+		return NULL;
+	}
+
+	snprintf(taken_path, sizeof(taken_path), "%s.taken.%i.%lx", best_path, getpid(), (unsigned long) pthread_self());
+
+	if (rename(best_path, taken_path) != 0) {
+		return NULL;
+	}
+
+	stack = load_stack_file(taken_path, group);
+
+	unlink(taken_path);
+
+	return stack;
+}
+
+int shared_cache_publish_stack(const char *dir, uint64_t key, uint64_t group, master_stack_t *stack)
+{
+	char path[512], tmp_path[512], suffix[64];
+	shared_stack_hdr_t hdr;
+	stack_file_rec_t rec;
+	uint64_t offset, zero = 0;
+	int i, fd, err;
+
+	if (!stack->sum) {
+		return -EINVAL;
+	}
+
+	build_cache_path(dir, key, "stack", path, sizeof(path));
+
+	snprintf(suffix, sizeof(suffix), "tmp.%i.%lx", getpid(), (unsigned long) pthread_self());
+	build_cache_path(dir, key, suffix, tmp_path, sizeof(tmp_path));
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SHARED_STACK_MAGIC, sizeof(hdr.magic));
+
+	hdr.group = group;
+	hdr.width = stack->width;
+	hdr.height = stack->height;
+	hdr.bitpix = stack->bitpix;
+	hdr.count = stack->count;
+	hdr.files_count = stack->files_count;
+	hdr.elem_size = sizeof(*stack->sum);
+
+	offset = sizeof(hdr);
+
+	for (i = 0; i < stack->files_count; ++i) {
+		offset += sizeof(rec) + strlen(stack->files[i].path);
+	}
+
+	hdr.data_offset = (offset + sizeof(*stack->sum) - 1) / sizeof(*stack->sum) * sizeof(*stack->sum);
+
+	fd = open(tmp_path, O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0644);
+
+	if (fd < 0) {
+		return -errno;
+	}
+
+	err = write_all(fd, &hdr, sizeof(hdr));
+
+	for (i = 0; !err && i < stack->files_count; ++i) {
+		rec.id = stack->files[i].id;
+		rec.frames = stack->files[i].frames;
+		rec.path_len = strlen(stack->files[i].path);
+
+		err = write_all(fd, &rec, sizeof(rec));
+
+		if (!err) {
+			err = write_all(fd, stack->files[i].path, rec.path_len);
+		}
+	}
+
+	/* sums are aligned to the element size */
+	if (!err && hdr.data_offset > offset) {
+		err = write_all(fd, &zero, hdr.data_offset - offset);
+	}
+
+	if (!err) {
+		err = write_all(fd, stack->sum, (size_t) stack->width * stack->height * sizeof(*stack->sum));
+	}
+
+	if (!err) {
+		err = write_all(fd, stack->comp, (size_t) stack->width * stack->height * sizeof(*stack->comp));
+	}
+
+	close(fd);
+
+	if (!err && rename(tmp_path, path) != 0) {
+		err = -errno;
+	}
+
+	if (err) {
+		unlink(tmp_path);
+	}
+
+	return err;
+}
+
+void shared_cache_remove_stack(const char *dir, uint64_t key)
+{
+	char path[512];
+
+	build_cache_path(dir, key, "stack", path, sizeof(path));
+
+	unlink(path);
+}
+
+typedef struct cache_file {
+	uint64_t key;
+	time_t last_use;
+	uint64_t size;
+	int stack;
+} cache_file_t;
+
+static int compare_last_use(const void *a, const void *b)
+{
+	const cache_file_t *fa = (const cache_file_t *) a;
+	const cache_file_t *fb = (const cache_file_t *) b;
+
+	return (fa->last_use > fb->last_use) - (fa->last_use < fb->last_use);
+}
+
+/*
+ * Removes least recently used masters and running sums until the directory fits max_bytes.
+ *  Processes which have the master mapped keep using it after unlink.
+ */
+void shared_cache_evict(const char *dir, uint64_t max_bytes)
+{
+	DIR *dp;
+	struct dirent *ep;
+	struct stat st;
+	char path[512];
+	unsigned long long key;
+	cache_file_t *entries = NULL, *tmp;
+	size_t count = 0, allocated = 0, i;
+	uint64_t total = 0;
+	int is_stack;
+
+	if (max_bytes == 0) {
+		return;
+	}
+
+	dp = opendir(dir);
+
+	if (dp == NULL) {
+		return;
+	}
+
+	while ((ep = readdir(dp))) {
+		is_stack = is_stack_file(ep->d_name);
+
+		if ((!is_stack && (strlen(ep->d_name) != 23 || strcmp(ep->d_name + 16, ".master") != 0))
+				|| sscanf(ep->d_name, "%16llx", &key) != 1) {
+			continue;
+		}
+
+		snprintf(path, sizeof(path), "%s/%s", dir, ep->d_name);
+
+		if (stat(path, &st) != 0) {
+			continue;
+		}
+
+		if (count == allocated) {
+			allocated = allocated ? allocated * 2 : 64;
+			tmp = (cache_file_t *) realloc(entries, allocated * sizeof(cache_file_t));
+
+			if (!tmp) {
+				break;
+			}
+
+			entries = tmp;
+		}
+
+		entries[count].key = key;
+		entries[count].last_use = st.st_mtime;
+		entries[count].size = st.st_size;
+		entries[count].stack = is_stack;
+
+		/* sidecar goes away with the master, so it's counted with it */
+		if (!is_stack) {
+			build_cache_path(dir, key, "files", path, sizeof(path));
+
+			if (stat(path, &st) == 0) {
+				entries[count].size += st.st_size;
+			}
+		}
+
+		total += entries[count].size;
+		count++;
+	}
+
+	closedir(dp);
+
+	if (total > max_bytes) {
+		qsort(entries, count, sizeof(cache_file_t), compare_last_use);
+
+		for (i = 0; i < count && total > max_bytes; ++i) {
+			if (entries[i].stack) {
+				build_cache_path(dir, entries[i].key, "stack", path, sizeof(path));
+				unlink(path);
+			} else {
+				remove_entry(dir, entries[i].key);
+				remove_stale_lock(dir, entries[i].key);
+			}
+
+			total -= entries[i].size;
+		}
+	}
+
+	free(entries);
+}
@@ -1,6 +1,6 @@
 /* 
    thread_pool.c
-    - simple threads launcher and storage
+    - simple threads pool with the tasks queue
 
    Copyright 2022  Oleg Kutkov <contact@olegkutkov.me>
 
@@ -18,62 +18,323 @@
    along with this program.  If not, see <http://www.gnu.org/licenses/>.  
  */
 
+#define _GNU_SOURCE
 #include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
+#include <limits.h>
+#include "cpu_topology.h"
 #include "thread_pool.h"
 
-static pthread_t *threads = NULL;
-static int total_threads = 0;
-static int threads_pool_cursor = 0;
+typedef struct pool_task {
+	thread_task task;
+	void *arg;
+	thread_group_t *group;
+	int priority;
+	long deadline;
+	struct pool_task *next;
+} pool_task_t;
 
-static pthread_mutex_t pool_lock;
+struct thread_pool {
+	pthread_t *threads;
+	int total_threads;
+	int shutdown;
 
-void init_thread_pool(size_t num_threads)
+	pool_task_t *queue_head;
+	pool_task_t *queue_tail;
+
+	pthread_mutex_t pool_lock;
+	pthread_mutex_t queue_lock;
+	pthread_cond_t queue_cond;
+	pthread_cond_t group_cond;
+};
+
+/* must be called with queue_lock held */
+static void run_task(thread_pool_t *pool, pool_task_t *item)
+{
+	pthread_mutex_unlock(&pool->queue_lock);
+
+	item->task(item->arg);
+
+	pthread_mutex_lock(&pool->queue_lock);
+
+	if (item->group) {
+		item->group->pending--;
+		pthread_cond_broadcast(&pool->group_cond);
+	}
+
+	free(item);
+}
+
+static void *worker_func(void *arg)
 {
-	if (threads) {
-		cleanup_thread_pool();
+	thread_pool_t *pool = (thread_pool_t *) arg;
+	pool_task_t *item;
+
+	pthread_mutex_lock(&pool->queue_lock);
+
+	while (1) {
+		while (!pool->queue_head && !pool->shutdown) {
+			pthread_cond_wait(&pool->queue_cond, &pool->queue_lock);
+		}
+
+		/* queue is drained before exit, tasks check the run flag themselves */
+		if (!pool->queue_head) {
+			break;
+		}
+
+		item = pool->queue_head;
+		pool->queue_head = item->next;
+
+		if (!pool->queue_head) {
+			pool->queue_tail = NULL;
+		}
+
+		run_task(pool, item);
 	}
 
-	pthread_mutex_init(&pool_lock, NULL);
+	pthread_mutex_unlock(&pool->queue_lock);
 
-	threads = (pthread_t*) malloc (sizeof(pthread_t) * num_threads);
-	total_threads = num_threads;
+	return NULL;
 }
 
-void thread_pool_add_task(thread_task task, void *task_arg)
+/*
+ * Every pool is independent, so several calibrations can run in one process
+ */
+thread_pool_t *thread_pool_new(size_t num_threads, int pin_threads)
 {
-	pthread_t *curr_thread = &threads[threads_pool_cursor];
-	pthread_create(curr_thread, NULL, task, task_arg);
+	pthread_attr_t attr;
+	cpu_set_t cpuset;
+	thread_pool_t *pool;
+	size_t i;
+
+	pool = (thread_pool_t *) calloc(1, sizeof(thread_pool_t));
+
+	if (!pool) {
+		return NULL;
+	}
+
+	pool->threads = (pthread_t*) malloc(sizeof(pthread_t) * (num_threads > 0 ? num_threads : 1));
+
+	if (!pool->threads) {
+		free(pool);
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->pool_lock, NULL);
+	pthread_mutex_init(&pool->queue_lock, NULL);
+	pthread_cond_init(&pool->queue_cond, NULL);
+	pthread_cond_init(&pool->group_cond, NULL);
 
-	threads_pool_cursor++;
+	for (i = 0; i < num_threads; i++) {
+		pthread_attr_init(&attr);
+
+		if (pin_threads) {
+			/* slots alternate between NUMA nodes, so any -j spreads over all sockets */
+			CPU_ZERO(&cpuset);
+			CPU_SET(cpu_topology_cpu_for_slot(i), &cpuset);
+
+			pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpuset);
+		}
+
+		if (pthread_create(&pool->threads[pool->total_threads], &attr, worker_func, pool) == 0) {
+			pool->total_threads++;
+		} else if (pin_threads && pthread_create(&pool->threads[pool->total_threads], NULL, worker_func, pool) == 0) {
+			/* CPU could go offline or out of the cpuset, the worker runs unpinned then */
+			pool->total_threads++;
+		}
+
+		pthread_attr_destroy(&attr);
+	}
+
+	return pool;
 }
 
-void cleanup_thread_pool()
+size_t thread_pool_threads(thread_pool_t *pool)
 {
-	int i;
+	return pool ? pool->total_threads : 0;
+}
+
+void thread_group_init(thread_group_t *group, thread_pool_t *pool)
+{
+	group->pool = pool;
+	group->pending = 0;
+}
 
-	for (i = 0; i < total_threads; i++) {
-		pthread_join(threads[i], NULL);
+/* higher priority goes first, then the earlier deadline, zero deadline is the latest */
+static int runs_before(const pool_task_t *a, const pool_task_t *b)
+{
+	if (a->priority != b->priority) {
+		return a->priority > b->priority;
 	}
 
-	if (threads) {
-		free(threads);
-		threads = NULL;
+	return a->deadline && (!b->deadline || a->deadline < b->deadline);
+}
+
+/*
+ * Tasks of the same order stay FIFO, so the common case is the append to the tail
+ *  must be called with queue_lock held
+ */
+static void insert_task(thread_pool_t *pool, pool_task_t *item)
+{
+	pool_task_t **pos;
+
+	if (!pool->queue_tail || !runs_before(item, pool->queue_tail)) {
+		if (pool->queue_tail) {
+			pool->queue_tail->next = item;
+		} else {
+			pool->queue_head = item;
+		}
+
+		pool->queue_tail = item;
+
+		return;
 	}
 
-	total_threads = 0;
-	threads_pool_cursor = 0;
+	/* stops at the tail at most, the item runs before it */
+	pos = &pool->queue_head;
+
+	while (!runs_before(item, *pos)) {
+		pos = &(*pos)->next;
+	}
 
-	pthread_mutex_destroy(&pool_lock);
+	item->next = *pos;
+	*pos = item;
 }
 
-void task_enter_critical_section()
+static void enqueue_task(thread_pool_t *pool, thread_group_t *group, thread_task task, void *task_arg,
+			int priority, long deadline)
 {
-	pthread_mutex_lock(&pool_lock);
+	pool_task_t *item = (pool_task_t *) malloc(sizeof(pool_task_t));
+
+	/* task is done in place when it can't be queued */
+	if (!item) {
+		task(task_arg);
+		return;
+	}
+
+	item->task = task;
+	item->arg = task_arg;
+	item->group = group;
+	item->priority = priority;
+	item->deadline = deadline;
+	item->next = NULL;
+
+	pthread_mutex_lock(&pool->queue_lock);
+
+	if (group) {
+		group->pending++;
+	}
+
+	insert_task(pool, item);
+
+	pthread_cond_signal(&pool->queue_cond);
+
+	pthread_mutex_unlock(&pool->queue_lock);
+}
+
+void thread_pool_add_task(thread_pool_t *pool, thread_task task, void *task_arg)
+{
+	enqueue_task(pool, NULL, task, task_arg, 0, 0);
+}
+
+void thread_pool_add_task_prio(thread_pool_t *pool, thread_task task, void *task_arg, int priority, long deadline)
+{
+	enqueue_task(pool, NULL, task, task_arg, priority, deadline);
 }
 
-void task_exit_critical_section()
+/*
+ * Group without the pool runs its tasks in the calling thread.
+ *  Group tasks finish the already started work, so they go before the queued tasks
+ */
+void thread_pool_add_group_task(thread_group_t *group, thread_task task, void *task_arg)
 {
-	pthread_mutex_unlock(&pool_lock);
+	if (!group->pool) {
+		task(task_arg);
+		return;
+	}
+
+	enqueue_task(group->pool, group, task, task_arg, INT_MAX, 0);
 }
 
+/*
+ * Waiting thread runs queued tasks of its own group,
+ *  so the group completes even if all the workers are waiting
+ */
+void thread_pool_wait_group(thread_group_t *group)
+{
+	thread_pool_t *pool = group->pool;
+	pool_task_t *item, *prev;
+
+	if (!pool) {
+		return;
+	}
+
+	pthread_mutex_lock(&pool->queue_lock);
+
+	while (group->pending > 0) {
+		prev = NULL;
+
+		for (item = pool->queue_head; item; prev = item, item = item->next) {
+			if (item->group == group) {
+				break;
+			}
+		}
+
+		if (!item) {
+			pthread_cond_wait(&pool->group_cond, &pool->queue_lock);
+			continue;
+		}
+
+		if (prev) {
+			prev->next = item->next;
+		} else {
+			pool->queue_head = item->next;
+		}
+
+		if (pool->queue_tail == item) {
+			pool->queue_tail = prev;
+		}
+
+		run_task(pool, item);
+	}
+
+	pthread_mutex_unlock(&pool->queue_lock);
+}
+
+void thread_pool_free(thread_pool_t *pool)
+{
+	int i;
+
+	if (!pool) {
+		return;
+	}
+
+	pthread_mutex_lock(&pool->queue_lock);
+	pool->shutdown = 1;
+	pthread_cond_broadcast(&pool->queue_cond);
+	pthread_mutex_unlock(&pool->queue_lock);
+
+	for (i = 0; i < pool->total_threads; i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+
+	free(pool->threads);
+
+	pthread_cond_destroy(&pool->group_cond);
+	pthread_cond_destroy(&pool->queue_cond);
+	pthread_mutex_destroy(&pool->queue_lock);
+	pthread_mutex_destroy(&pool->pool_lock);
+
+	free(pool);
+}
+
+void task_enter_critical_section(thread_pool_t *pool)
+{
+	pthread_mutex_lock(&pool->pool_lock);
+}
+
+void task_exit_critical_section(thread_pool_t *pool)
+{
+	pthread_mutex_unlock(&pool->pool_lock);
+}
@@ -0,0 +1,297 @@
+/* 
+   work_claim.c
+    - dividing the input between the calibrator instances on the shared filesystem
+
+   Copyright 2022  Oleg Kutkov <contact@olegkutkov.me>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "work_claim.h"
+
+/* claim file keeps the owner as "host pid start_time" */
+#define CLAIM_OWNER_SIZE (HOST_NAME_MAX + 64)
+#define CLAIM_KEY_SIZE (NAME_MAX + 32)
+
+static const char *file_name(const char *file)
+{
+	const char *name = strrchr(file, '/');
+
+	return name ? name + 1 : file;
+}
+
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t len)
+{
+	const unsigned char *bytes = (const unsigned char *) data;
+	size_t i;
+
+	for (i = 0; i < len; ++i) {
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+/*
+ * Files are divided by the hash of the name without the directory,
+ *  so the instances agree even when the input is mounted at different paths
+ */
+int work_shard_match(const char *file, int shard, int shards)
+{
+	const char *name = file_name(file);
+	uint64_t hash;
+
+	if (shards <= 1) {
+		return 1;
+	}
+
+	hash = hash_bytes(0xcbf29ce484222325ULL, name, strlen(name));
+
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+
+	return (int) (hash % shards) == shard;
+}
+
+/*
+ * Claim is keyed by the input name, its size and mtime and the output name, without the directories
+ *  for the different mount points. Changed input or the other output is a new claim
+ */
+static int claim_key(const char *file, const char *save_path, char *key)
+{
+	const char *out_name = file_name(save_path);
+	struct stat st;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	int64_t values[3];
+
+	if (stat(file, &st) != 0) {
+		return -errno;
+	}
+
+	values[0] = (int64_t) st.st_size;
+	values[1] = (int64_t) st.st_mtim.tv_sec;
+	values[2] = (int64_t) st.st_mtim.tv_nsec;
+
+	hash = hash_bytes(hash, values, sizeof(values));
+	hash = hash_bytes(hash, out_name, strlen(out_name));
+
+	snprintf(key, CLAIM_KEY_SIZE, "%s.%016llx", file_name(file), (unsigned long long) hash);
+
+	return 0;
+}
+
+static char *claim_path(const char *claim_dir, const char *key, const char *suffix)
+{
+	char *path;
+
+	path = (char*) malloc(strlen(claim_dir) + strlen(key) + strlen(suffix) + 2);
+
+	if (path) {
+		sprintf(path, "%s/%s%s", claim_dir, key, suffix);
+	}
+
+	return path;
+}
+
+static void make_owner(char *owner)
+{
+	char host[HOST_NAME_MAX + 1] = { 0 };
+
+	gethostname(host, HOST_NAME_MAX);
+
+	snprintf(owner, CLAIM_OWNER_SIZE, "%s %li %li\n", host, (long) getpid(), (long) time(NULL));
+}
+
+/*
+ * Claim is stale when it's older than the timeout or its owner process
+ *  on this host is gone
+ */
+static int is_stale_claim(const char *path, long stale_timeout, ino_t *inode)
+{
+	char owner[CLAIM_OWNER_SIZE] = { 0 };
+	char host[HOST_NAME_MAX + 1] = { 0 };
+	char owner_host[256] = { 0 };
+	struct stat st;
+	long pid;
+	ssize_t len;
+	int fd;
+
+	if (stat(path, &st) != 0) {
+		return 0;
+	}
+
+	*inode = st.st_ino;
+
+	if (stale_timeout > 0 && difftime(time(NULL), st.st_mtime) > stale_timeout) {
+		return 1;
+	}
+
+	fd = open(path, O_RDONLY);
+
+	if (fd < 0) {
+		return 0;
+	}
+
+	len = read(fd, owner, sizeof(owner) - 1);
+
+	close(fd);
+
+	if (len <= 0 || sscanf(owner, "%255s %li", owner_host, &pid) != 2) {
+		return 0;
+	}
+
+	gethostname(host, HOST_NAME_MAX);
+
+	return strcmp(host, owner_host) == 0 && kill((pid_t) pid, 0) != 0 && errno == ESRCH;
+}
+
+static int create_claim(const char *path)
+{
+	char owner[CLAIM_OWNER_SIZE];
+	ssize_t len;
+	int fd;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+
+	if (fd < 0) {
+		return -errno;
+	}
+
+	make_owner(owner);
+
+	len = write(fd, owner, strlen(owner));
+
+	close(fd);
+
+	return len > 0 ? 0 : -EIO;
+}
+
+/*
+ * Stale claim is moved aside by rename(), so only one of the instances takes it over.
+ *  If the claim was retaken between the check and the rename, it's linked back
+ */
+static void remove_stale_claim(const char *claim_dir, const char *key, const char *path, ino_t inode)
+{
+	char suffix[64];
+	char *stale_path;
+	struct stat st;
+
+	snprintf(suffix, sizeof(suffix), ".stale.%li", (long) getpid());
+
+	stale_path = claim_path(claim_dir, key, suffix);
+
+	if (!stale_path) {
+		return;
+	}
+
+	if (rename(path, stale_path) == 0) {
+		if (stat(stale_path, &st) == 0 && st.st_ino != inode) {
+			link(stale_path, path);
+		}
+
+		unlink(stale_path);
+	}
+
+	free(stale_path);
+}
+
+/*
+ * Returns 0 when the file is claimed by this process, -EBUSY when it's claimed by another one
+ *  and -EALREADY when it's done
+ */
+int work_claim(const char *claim_dir, const char *file, const char *save_path, long stale_timeout)
+{
+	char key[CLAIM_KEY_SIZE];
+	char *path, *done_path;
+	ino_t inode = 0;
+	int status;
+
+	status = claim_key(file, save_path, key);
+
+	if (status != 0) {
+		return status;
+	}
+
+	path = claim_path(claim_dir, key, ".claim");
+	done_path = claim_path(claim_dir, key, ".done");
+
+	if (!path || !done_path) {
+		free(path);
+		free(done_path);
+		return -ENOMEM;
+	}
+
+	if (access(done_path, F_OK) == 0) {
+		status = -EALREADY;
+	} else {
+		status = create_claim(path);
+
+		if (status == -EEXIST && is_stale_claim(path, stale_timeout, &inode)) {
+			remove_stale_claim(claim_dir, key, path, inode);
+
+			status = create_claim(path);
+		}
+
+		if (status == -EEXIST) {
+			status = -EBUSY;
+		}
+	}
+
+	free(path);
+	free(done_path);
+
+	return status;
+}
+
+/*
+ * Done claim stays as the marker for the other instances,
+ *  failed one is removed so the file can be retried
+ */
+void work_claim_release(const char *claim_dir, const char *file, const char *save_path, int done)
+{
+	char key[CLAIM_KEY_SIZE];
+	char *path, *done_path;
+
+	/* input is only read, so the key is the same as at work_claim() */
+	if (claim_key(file, save_path, key) != 0) {
+		return;
+	}
+
+	path = claim_path(claim_dir, key, ".claim");
+	done_path = claim_path(claim_dir, key, ".done");
+
+	if (path && done_path) {
+		if (done) {
+			rename(path, done_path);
+		} else {
+			unlink(path);
+		}
+	}
+
+	free(path);
+	free(done_path);
+}